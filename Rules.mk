@@ -50,6 +50,9 @@ CFLAGS += -O0 -g -fsanitize=address
 else
 CFLAGS += -O2
 endif
+ifeq ($(counters),y)
+CFLAGS += -DLIBDISK_COUNTERS
+endif
 CFLAGS += -fno-strict-aliasing -std=gnu99 -Wall
 ifneq ($(PLATFORM),win32)
 CFLAGS += -Werror
@@ -0,0 +1,560 @@
+/*
+ * bench/fluxgen.c
+ *
+ * Render the tracks of any libdisk image as synthetic flux, in SuperCard Pro
+ * (SCP) or KryoFlux STREAM format, with controllable noise:
+ *  - Gaussian jitter on every flux transition;
+ *  - sinusoidal speed drift, once per revolution;
+ *  - weak (random) regions, besides any recorded in the image;
+ *  - an offset between the index pulse and the start of the track data.
+ *
+ * With --sweep, the flux is instead rendered at each of a list of jitter
+ * levels and decoded again, against the image's own track formats, to
+ * report sector recovery rate and decode throughput at each level.
+ *
+ * Written in 2026 by agent
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+
+#include <libdisk/util.h>
+#include <libdisk/disk.h>
+#include <libdisk/stream.h>
+#include <private/disk.h>
+
+#define SCP_NS_PER_TICK 25u
+
+#define KF_MCK_FREQ (((18432000 * 73) / 14) / 2)
+#define KF_SCK_FREQ (KF_MCK_FREQ / 2)
+
+/* Transitions closer than this are merged by any real drive. */
+#define MIN_FLUX_NS 200
+
+static double jitter_ns, drift_pct;
+static unsigned int weak_bits, index_off_us, nr_revs = 3;
+static unsigned int start_trk = 0, end_trk = ~0u;
+static uint32_t seed = 1;
+static int pll_period_adj_pct = -1, pll_phase_adj_pct = -1;
+
+/* Absolute times of a track's flux transitions and index pulses. */
+struct flux {
+    uint64_t *t;
+    unsigned int nr, max;
+    uint64_t index[16];
+    unsigned int nr_index;
+};
+
+static void usage(int rc)
+{
+    printf("Usage: fluxgen [options] in_file out_file\n");
+    printf("       fluxgen [options] --sweep=NS[,NS...] in_file\n");
+    printf("Render an image as flux: to an SCP file if out_file ends "
+           "in .scp,\n");
+    printf("else to KryoFlux STREAM files out_fileNN.S.raw\n");
+    printf("Options:\n");
+    printf("  -h, --help    Display this information\n");
+    printf("  -j, --jitter=NS       Std. deviation of flux jitter\n");
+    printf("  -d, --drift=PCT       Amplitude of speed drift\n");
+    printf("  -w, --weak=BITS       Add a weak region to every track\n");
+    printf("  -i, --index-offset=US Delay from index to track data\n");
+    printf("  -r, --revs=N          Revolutions per track (%u)\n", nr_revs);
+    printf("  -s, --seed=N          Noise generator seed\n");
+    printf("  -t, --tracks=A[-B]    Render only these tracks\n");
+    printf("  -S, --sweep=NS[,...]  Decode at each jitter level\n");
+    printf("  -f, --format=scp|kf   Flux format for --sweep (scp)\n");
+    printf("  -p, --pll-period-adj=PCT  PLL period adjustment for "
+           "--sweep\n");
+    printf("  -P, --pll-phase-adj=PCT   PLL phase adjustment for "
+           "--sweep\n");
+    exit(rc);
+}
+
+static uint32_t rnd32(uint32_t *p_seed)
+{
+    uint32_t x = *p_seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *p_seed = x;
+}
+
+/* Approximately normal, mean 0 and std. deviation 1 (Irwin-Hall). */
+static double gauss(uint32_t *p_seed)
+{
+    double x = 0;
+    unsigned int i;
+    for (i = 0; i < 12; i++)
+        x += rnd32(p_seed) / 4294967296.0;
+    return x - 6.0;
+}
+
+static void flux_add(struct flux *f, uint64_t t)
+{
+    if (f->nr == f->max) {
+        uint64_t *old = f->t;
+        f->max = f->max ? f->max * 2 : 65536;
+        f->t = memalloc(f->max * sizeof(*f->t));
+        memcpy(f->t, old, f->nr * sizeof(*f->t));
+        memfree(old);
+    }
+    f->t[f->nr++] = t;
+}
+
+/* Render track @raw into @f: nr_revs revolutions plus a further one, so
+ * that the last index pulse has flux after it. */
+static void render(struct track_raw *raw, unsigned int tracknr,
+                   struct flux *f)
+{
+    uint32_t s = seed ^ (tracknr * 0x9e3779b9u);
+    double rev_ns = track_nsecs_from_rpm(DEFAULT_RPM);
+    double av_cell = rev_ns / raw->bitlen, pos = 0, cell, t, last = 0;
+    unsigned int bit, i, r, weak_start = 0;
+    bool_t one, weak;
+
+    f->nr = f->nr_index = 0;
+    if (raw->bitlen == 0)
+        return;
+
+    bit = (uint64_t)index_off_us * 1000 / av_cell;
+    bit = raw->bitlen - (bit % raw->bitlen);
+    if (bit == raw->bitlen)
+        bit = 0;
+    if (weak_bits)
+        weak_start = rnd32(&s) % raw->bitlen;
+
+    for (r = 0; r <= nr_revs; r++) {
+        f->index[f->nr_index++] = pos;
+        for (i = 0; i < raw->bitlen; i++) {
+            weak = (raw->speed[bit] == SPEED_WEAK)
+                || (((bit + raw->bitlen - weak_start) % raw->bitlen)
+                    < weak_bits);
+            if (weak) {
+                cell = av_cell;
+                one = rnd32(&s) & 1;
+            } else {
+                cell = av_cell * raw->speed[bit] / SPEED_AVG;
+                one = !!(raw->bits[bit>>3] & (0x80 >> (bit & 7)));
+            }
+            cell *= 1.0 + (drift_pct / 100.0) * sin(2 * M_PI * pos / rev_ns);
+            pos += cell;
+            if (one) {
+                t = pos + (jitter_ns ? jitter_ns * gauss(&s) : 0);
+                if (t < last + MIN_FLUX_NS)
+                    t = last + MIN_FLUX_NS;
+                flux_add(f, t);
+                last = t;
+            }
+            if (++bit == raw->bitlen)
+                bit = 0;
+        }
+    }
+}
+
+/*
+ * SCP: index-cued revolutions, each stored as the intervals of the
+ * transitions which end within it.
+ */
+
+struct scp_out {
+    int fd;
+    uint32_t csum;
+    uint32_t th_offs[168];
+    unsigned int nr_tracks;
+};
+
+static void scp_write(struct scp_out *o, const void *dat, size_t len)
+{
+    const uint8_t *p = dat;
+    size_t i;
+    write_exact(o->fd, dat, len);
+    for (i = 0; i < len; i++)
+        o->csum += p[i];
+}
+
+static struct scp_out *scp_create(const char *name, unsigned int nr_tracks)
+{
+    struct scp_out *o = memalloc(sizeof(*o));
+
+    if ((o->fd = file_open(name, O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1)
+        err(1, "%s", name);
+    o->nr_tracks = min_t(unsigned int, nr_tracks, ARRAY_SIZE(o->th_offs));
+
+    /* Header and track table are written last. */
+    if (lseek(o->fd, 16 + sizeof(o->th_offs), SEEK_SET) < 0)
+        err(1, "%s", name);
+
+    return o;
+}
+
+static void scp_track(struct scp_out *o, unsigned int tracknr,
+                      const struct flux *f)
+{
+    uint8_t thdr[4 + 12*nr_revs];
+    uint16_t *dat = memalloc((f->nr * 2 + 1) * sizeof(*dat));
+    uint64_t prev, tick, idx_tick;
+    unsigned int r, i = 0, j = 0, start;
+    off_t off;
+
+    if ((tracknr >= o->nr_tracks) || (f->nr_index <= nr_revs))
+        goto out;
+
+    if ((off = lseek(o->fd, 0, SEEK_CUR)) < 0)
+        err(1, NULL);
+    o->th_offs[tracknr] = htole32(off);
+
+    memcpy(thdr, "TRK", 3);
+    thdr[3] = tracknr;
+    prev = 0;
+    for (r = 0; r < nr_revs; r++) {
+        idx_tick = f->index[r+1] / SCP_NS_PER_TICK;
+        start = j;
+        for (; (i < f->nr) && (f->t[i] < f->index[r+1]); i++) {
+            tick = f->t[i] / SCP_NS_PER_TICK;
+            while ((tick - prev) >= 0x10000) {
+                dat[j++] = 0;
+                prev += 0x10000;
+            }
+            dat[j++] = htobe16((tick - prev) ?: 1);
+            prev = tick;
+        }
+        *(uint32_t *)&thdr[4+12*r+0] = htole32(
+            idx_tick - f->index[r] / SCP_NS_PER_TICK);
+        *(uint32_t *)&thdr[4+12*r+4] = htole32(j - start);
+        *(uint32_t *)&thdr[4+12*r+8] = htole32(
+            sizeof(thdr) + start * sizeof(*dat));
+    }
+
+    scp_write(o, thdr, sizeof(thdr));
+    scp_write(o, dat, j * sizeof(*dat));
+
+out:
+    memfree(dat);
+}
+
+static void scp_close(struct scp_out *o)
+{
+    uint8_t hdr[16] = { 'S', 'C', 'P' };
+
+    if (lseek(o->fd, 16, SEEK_SET) < 0)
+        err(1, NULL);
+    scp_write(o, o->th_offs, sizeof(o->th_offs));
+
+    hdr[3] = 0x16;    /* version 1.6 */
+    hdr[4] = 0x04;    /* disk type: Amiga, as written by libdisk */
+    hdr[5] = nr_revs;
+    hdr[7] = o->nr_tracks - 1;
+    hdr[8] = 0x03;    /* index cued, 96tpi */
+    *(uint32_t *)&hdr[12] = htole32(o->csum);
+    if (lseek(o->fd, 0, SEEK_SET) < 0)
+        err(1, NULL);
+    write_exact(o->fd, hdr, sizeof(hdr));
+
+    close(o->fd);
+    memfree(o);
+}
+
+/*
+ * KryoFlux: one file per track, of samples in sample-clock ticks, with an
+ * index block giving the stream position of the sample during which each
+ * index pulse occurs.
+ */
+
+static void kf_track(const char *basename, unsigned int tracknr,
+                     const struct flux *f)
+{
+    char name[strlen(basename) + 16];
+    uint8_t *dat = memalloc(f->nr * 4 + 16 * (f->nr_index + 1));
+    uint64_t prev = 0, tick, pos = 0;
+    unsigned int i, j = 0, r = 0;
+    uint32_t v;
+    int fd;
+
+    for (i = 0; i <= f->nr; i++) {
+        /* Index pulses before the next sample. */
+        while ((r < f->nr_index)
+               && ((i == f->nr) || (f->index[r] <= f->t[i]))) {
+            dat[j++] = 0x0d;
+            dat[j++] = 0x02;
+            *(uint16_t *)&dat[j] = htole16(12); j += 2;
+            *(uint32_t *)&dat[j] = htole32(pos); j += 4;
+            *(uint32_t *)&dat[j] = 0; j += 4;
+            *(uint32_t *)&dat[j] = 0; j += 4;
+            r++;
+        }
+        if (i == f->nr)
+            break;
+        tick = (f->t[i] * (KF_SCK_FREQ / 1000)) / 1000000;
+        v = tick - prev;
+        prev = tick;
+        for (; v >= 0x10000; v -= 0x10000, pos++)
+            dat[j++] = 0x0b; /* overflow16 */
+        if ((v >= 0x0e) && (v < 0x100)) {
+            dat[j++] = v;
+            pos += 1;
+        } else if (v < 0x800) {
+            dat[j++] = v >> 8;
+            dat[j++] = v;
+            pos += 2;
+        } else {
+            dat[j++] = 0x0c; /* value16 */
+            dat[j++] = v >> 8;
+            dat[j++] = v;
+            pos += 3;
+        }
+    }
+
+    /* End of file. */
+    memcpy(&dat[j], "\x0d\x0d\x00\x00", 4);
+    j += 4;
+
+    sprintf(name, "%s%02u.%u.raw", basename, cyl(tracknr), hd(tracknr));
+    if ((fd = file_open(name, O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1)
+        err(1, "%s", name);
+    write_exact(fd, dat, j);
+    close(fd);
+
+    memfree(dat);
+}
+
+static bool_t is_scp(const char *name)
+{
+    char suffix[8];
+    filename_extension(name, suffix, sizeof(suffix));
+    return !strcmp(suffix, "scp");
+}
+
+/* Render tracks of @d into flux file(s) @out. */
+static void write_flux(struct disk *d, const char *out)
+{
+    struct disk_info *di = disk_get_info(d);
+    struct track_raw *raw = track_alloc_raw_buffer(d);
+    struct scp_out *scp = is_scp(out) ? scp_create(out, di->nr_tracks) : NULL;
+    struct flux f = { 0 };
+    unsigned int i;
+
+    for (i = start_trk; (i <= end_trk) && (i < di->nr_tracks); i++) {
+        track_read_raw(raw, i);
+        render(raw, i, &f);
+        if (scp != NULL)
+            scp_track(scp, i, &f);
+        else if (f.nr != 0)
+            kf_track(out, i, &f);
+    }
+
+    if (scp != NULL)
+        scp_close(scp);
+    memfree(f.t);
+    track_free_raw_buffer(raw);
+}
+
+static void remove_flux(struct disk *d, const char *out)
+{
+    char name[strlen(out) + 16];
+    unsigned int i;
+
+    if (is_scp(out)) {
+        unlink(out);
+        return;
+    }
+    for (i = 0; i < disk_get_nr_tracks(d); i++) {
+        sprintf(name, "%s%02u.%u.raw", out, cyl(i), hd(i));
+        unlink(name);
+    }
+}
+
+/* Decode the flux @out against the track formats of @d. */
+static void sweep_one(struct disk *d, const char *out)
+{
+    struct disk_info *di = disk_get_info(d);
+    struct disk *dst = disk_create(NULL, 0);
+    struct track_info *ti, *dti;
+    struct stream *s;
+    unsigned int i, j, nr_trk = 0, nr_exact = 0, nr_sec = 0, nr_ok = 0;
+    uint64_t t, ns = 0, bits = 0, flux = 0;
+
+    if ((s = stream_open(out, 0, 0)) == NULL)
+        errx(1, "%s: cannot open rendered flux", out);
+    if (pll_period_adj_pct >= 0)
+        s->pll_period_adj_pct = pll_period_adj_pct;
+    if (pll_phase_adj_pct >= 0)
+        s->pll_phase_adj_pct = pll_phase_adj_pct;
+
+    for (i = start_trk; (i <= end_trk) && (i < di->nr_tracks); i++) {
+        ti = track_get_info(d, i);
+        if (ti->type == TRKTYP_unformatted)
+            continue;
+        nr_trk++;
+        bits -= s->nr_bits;
+        flux -= s->nr_flux;
+        t = time_ns();
+        (void)track_write_raw_from_stream(dst, i, ti->type, s);
+        ns += time_ns() - t;
+        bits += s->nr_bits;
+        flux += s->nr_flux;
+        dti = &disk_get_info(dst)->track[i];
+        for (j = 0; j < ti->nr_sectors; j++) {
+            if (!is_valid_sector(ti, j))
+                continue;
+            nr_sec++;
+            if ((dti->type == ti->type) && is_valid_sector(dti, j))
+                nr_ok++;
+        }
+        if ((dti->type == ti->type) && (dti->len == ti->len)
+            && !memcmp(dti->dat, ti->dat, ti->len))
+            nr_exact++;
+    }
+
+    printf("%6.1f%% %6.1f%% %9.2f %9.2f %9.1f\n",
+           nr_sec ? nr_ok * 100.0 / nr_sec : 100.0,
+           nr_trk ? nr_exact * 100.0 / nr_trk : 100.0,
+           ns ? bits * 1e3 / ns : 0, ns ? flux * 1e3 / ns : 0,
+           ns / 1e6);
+
+    stream_close(s);
+    disk_close(dst);
+}
+
+static void sweep(struct disk *d, const char *levels, bool_t scp)
+{
+    char dir[] = "/tmp/fluxgen.XXXXXX", out[sizeof(dir) + 16];
+    const char *p = levels;
+    char *q;
+
+    if (mkdtemp(dir) == NULL)
+        err(1, "mkdtemp");
+    sprintf(out, "%s/%s", dir, scp ? "flux.scp" : "track");
+
+    printf("%9s %7s %7s %9s %9s %9s\n", "Jitter ns", "Sectors",
+           "Tracks", "Mbit/s", "Mflux/s", "Decode ms");
+
+    for (;;) {
+        jitter_ns = strtod(p, &q);
+        if ((q == p) || ((*q != ',') && (*q != '\0')))
+            errx(1, "bad jitter list: %s", levels);
+        printf("%9.1f ", jitter_ns);
+        fflush(stdout);
+        write_flux(d, out);
+        sweep_one(d, out);
+        remove_flux(d, out);
+        if (*q == '\0')
+            break;
+        p = q + 1;
+    }
+
+    if (rmdir(dir) < 0)
+        warn("%s", dir);
+}
+
+int main(int argc, char **argv)
+{
+    const char *in, *out = NULL, *levels = NULL;
+    bool_t sweep_scp = TRUE;
+    struct disk *d;
+    char *p;
+    int ch;
+
+    const static char sopts[] = "hj:d:w:i:r:s:t:S:f:p:P:";
+    const static struct option lopts[] = {
+        { "help", 0, NULL, 'h' },
+        { "jitter", 1, NULL, 'j' },
+        { "drift", 1, NULL, 'd' },
+        { "weak", 1, NULL, 'w' },
+        { "index-offset", 1, NULL, 'i' },
+        { "revs", 1, NULL, 'r' },
+        { "seed", 1, NULL, 's' },
+        { "tracks", 1, NULL, 't' },
+        { "sweep", 1, NULL, 'S' },
+        { "format", 1, NULL, 'f' },
+        { "pll-period-adj", 1, NULL, 'p' },
+        { "pll-phase-adj", 1, NULL, 'P' },
+        { 0, 0, 0, 0 }
+    };
+
+    while ((ch = getopt_long(argc, argv, sopts, lopts, NULL)) != -1) {
+        switch (ch) {
+        case 'h':
+            usage(0);
+            break;
+        case 'j':
+            jitter_ns = atof(optarg);
+            break;
+        case 'd':
+            drift_pct = atof(optarg);
+            break;
+        case 'w':
+            weak_bits = atoi(optarg);
+            break;
+        case 'i':
+            index_off_us = atoi(optarg);
+            break;
+        case 'r':
+            nr_revs = atoi(optarg);
+            if ((nr_revs < 1) || (nr_revs > 10))
+                errx(1, "revolutions must be 1-10");
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0) ?: 1;
+            break;
+        case 't':
+            start_trk = end_trk = strtoul(optarg, &p, 0);
+            if (*p == '-')
+                end_trk = strtoul(p+1, NULL, 0);
+            break;
+        case 'S':
+            levels = optarg;
+            break;
+        case 'f':
+            if (!strcmp(optarg, "kf"))
+                sweep_scp = FALSE;
+            else if (strcmp(optarg, "scp"))
+                errx(1, "unknown flux format: %s", optarg);
+            break;
+        case 'p':
+            pll_period_adj_pct = atoi(optarg);
+            if ((pll_period_adj_pct < 0) || (pll_period_adj_pct > 100))
+                errx(1, "PLL period adjustment must be 0-100");
+            break;
+        case 'P':
+            pll_phase_adj_pct = atoi(optarg);
+            if ((pll_phase_adj_pct < 0) || (pll_phase_adj_pct > 100))
+                errx(1, "PLL phase adjustment must be 0-100");
+            break;
+        default:
+            usage(1);
+            break;
+        }
+    }
+
+    if (argc != (optind + (levels ? 1 : 2)))
+        usage(1);
+    in = argv[optind];
+    if (levels == NULL)
+        out = argv[optind+1];
+
+    if ((d = disk_open(in, DISKFL_read_only)) == NULL)
+        errx(1, "Unable to open %s", in);
+
+    if (levels != NULL)
+        sweep(d, levels, sweep_scp);
+    else
+        write_flux(d, out);
+
+    disk_close(d);
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,386 @@
+/*
+ * bench/handler-bench.c
+ *
+ * Round-trip every track handler: encode a track to raw bitcells
+ * (track_read_raw()), decode those back again (track_write_raw() over a soft
+ * stream), check the data survives, and report encode and decode throughput.
+ *
+ * The track is seeded with data the handler itself accepts: built from
+ * pseudo-random sectors, if the handler can; else decoded from pseudo-random
+ * bitcells, as the raw formats accept; else decoded from the handler's own
+ * encoding of pseudo-random track contents. Handlers which parse their track
+ * contents may reject those, or read them out of bounds, and so cannot be
+ * seeded: they are reported, but are not failures. A seeded track which does
+ * not survive a round trip is, unless its handler is listed in known_bad[].
+ *
+ * Each handler runs in a child process, so that one which crashes or hangs
+ * is reported rather than ending the run. That is a bug, unless it happens
+ * while working from random track contents, which the handler never made.
+ *
+ * Exits non-zero if any handler fails.
+ *
+ * Links libdisk statically, to reach the handler table.
+ *
+ * Written in 2026 by agent
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <libdisk/util.h>
+#include <libdisk/disk.h>
+#include <private/disk.h>
+
+/* A track away from the boot block and directory, which some handlers
+ * treat specially. */
+#define BENCH_TRACK 2
+
+/* Seconds a handler may run before it is declared hung. */
+#define HANG_SECS 30
+
+/* Child exit codes. */
+enum { RT_ok = 0, RT_no_seed = 10, RT_no_decode, RT_mismatch };
+
+/* Stage reached by the child, shared with the parent. */
+enum { ST_seed, ST_synthesise, ST_round_trip };
+static volatile int *stage;
+
+static unsigned int min_ms = 20;
+static int quiet;
+
+/* Handlers whose seeded tracks did not survive a round trip when this
+ * benchmark was written. Variable-rate raw tracks quantise their speeds;
+ * the rest are yet to be looked into. They are reported, but do not fail
+ * the run, so that it catches regressions in every other handler. Remove a
+ * handler from the list once it is fixed. */
+static const char *const known_bad[] = {
+    "raw_hd", "variable_raw_dd", "variable_raw_hd", "variable_raw_ed",
+    "dec_rx01", "dec_rx02", "dec_rx01_525", "dec_rx02_525",
+    "adls", "siemens_isdx_hd", "microsoft_dmf_hd", "acorn_adfs_s_m_l",
+    "super_hang_on_scores", "space_harrier_sega", "power_drift"
+};
+
+static bool_t is_known_bad(const char *name)
+{
+    unsigned int i;
+    for (i = 0; i < ARRAY_SIZE(known_bad); i++)
+        if (!strcmp(known_bad[i], name))
+            return TRUE;
+    return FALSE;
+}
+
+static void usage(int rc)
+{
+    printf("Usage: handler-bench [options] [format...]\n");
+    printf("Benchmark the named track formats, or all of them.\n");
+    printf("Options:\n");
+    printf("  -h, --help      Display this information\n");
+    printf("  -q, --quiet     Report only handlers which do not "
+           "round-trip\n");
+    printf("  -t, --time=MS   Minimum time to spend on each of encode "
+           "and decode (%u)\n", min_ms);
+    exit(rc);
+}
+
+static void fill_random(uint8_t *p, unsigned int len, uint32_t *seed)
+{
+    while (len--)
+        *p++ = rnd16(seed);
+}
+
+static unsigned int ns_per_cell(enum track_type type)
+{
+    switch (handlers[type]->density) {
+    case trkden_single: return 4000u;
+    case trkden_high: return 1000u;
+    case trkden_extra: return 500u;
+    default: return 2000u;
+    }
+}
+
+/* Repeat @fn for at least min_ms. Returns bitcells per second. */
+#define throughput(bitlen, fn) ({                               \
+    uint64_t _t0 = time_ns(), _dt;                              \
+    unsigned int _n = 0;                                        \
+    do {                                                        \
+        fn;                                                     \
+        _n++;                                                   \
+    } while ((_dt = time_ns() - _t0) < min_ms * 1000000ull);    \
+    (double)(bitlen) * _n * 1e9 / _dt; })
+
+/* Decode @bitlen bitcells into track BENCH_TRACK of @d, as @type. */
+static int decode(struct disk *d, uint8_t *bits, uint16_t *speed,
+                  uint32_t bitlen, enum track_type type)
+{
+    struct stream *s = stream_soft_open(bits, speed, bitlen, 300);
+    int rc = track_write_raw_from_stream(d, BENCH_TRACK, type, s);
+    stream_close(s);
+    return rc;
+}
+
+/* Build track BENCH_TRACK of @d from pseudo-random sectors. */
+static int seed_from_sectors(struct disk *d, enum track_type type,
+                             uint32_t *seed)
+{
+    struct track_sectors *sectors;
+    uint8_t *buf;
+    int rc;
+
+    if (handlers[type]->write_sectors == NULL)
+        return -1;
+
+    /* The handler consumes the buffer as it goes: keep hold of it. */
+    sectors = track_alloc_sector_buffer(d);
+    sectors->nr_bytes = 64*1024;
+    sectors->data = buf = memalloc(sectors->nr_bytes);
+    fill_random(buf, sectors->nr_bytes, seed);
+    rc = track_write_sectors(sectors, BENCH_TRACK, type);
+    sectors->data = NULL;
+    track_free_sector_buffer(sectors);
+    memfree(buf);
+
+    return rc;
+}
+
+/* Decode a track's worth of MFM-encoded pseudo-random data into @d. Raw
+ * bitcells must be valid MFM to be read back as they were written. */
+static int seed_from_bitcells(struct disk *d, enum track_type type,
+                              uint32_t *seed)
+{
+    uint32_t i, bitlen = (DEFAULT_BITS_PER_TRACK(d) * 2000u)
+        / ns_per_cell(type);
+    uint8_t *bits = memalloc((bitlen + 7) / 8);
+    uint16_t *speed = memalloc(bitlen * sizeof(*speed));
+    unsigned int b, prev = 0;
+    int rc;
+
+    for (i = 0; i + 1 < bitlen; i += 2) {
+        b = rnd16(seed) & 1;
+        if (!(prev | b))
+            bits[i/8] |= 0x80 >> (i%8);
+        if (b)
+            bits[(i+1)/8] |= 0x80 >> ((i+1)%8);
+        prev = b;
+    }
+    for (i = 0; i < bitlen; i++)
+        speed[i] = SPEED_AVG;
+    rc = decode(d, bits, speed, bitlen, type);
+
+    memfree(bits);
+    memfree(speed);
+    return rc;
+}
+
+/* Decode into @d the handler's encoding of pseudo-random track contents. */
+static int seed_from_contents(struct disk *d, enum track_type type,
+                              uint32_t *seed)
+{
+    struct disk *src = disk_create(NULL, 0);
+    struct track_info *ti = &disk_get_info(src)->track[BENCH_TRACK];
+    struct track_raw *raw;
+    int rc = -1;
+
+    memfree(ti->dat);
+    memset(ti, 0, sizeof(*ti));
+    init_track_info(ti, type);
+    ti->dat = memalloc(ti->len);
+    fill_random(ti->dat, ti->len, seed);
+    ti->total_bits = (DEFAULT_BITS_PER_TRACK(src) * 2000u)
+        / ns_per_cell(type);
+    ti->data_bitoff = 1024;
+    set_all_sectors_valid(ti);
+
+    raw = track_alloc_raw_buffer(src);
+    track_read_raw(raw, BENCH_TRACK);
+    if (raw->bitlen != 0)
+        rc = decode(d, raw->bits, raw->speed, raw->bitlen, type);
+
+    track_free_raw_buffer(raw);
+    disk_close(src);
+    return rc;
+}
+
+/* Seed track BENCH_TRACK of @d with @type. Returns -1 if it cannot. */
+static int seed_track(struct disk *d, enum track_type type)
+{
+    uint32_t seed = type;
+
+    *stage = ST_seed;
+    if ((seed_from_sectors(d, type, &seed) == 0)
+        || (seed_from_bitcells(d, type, &seed) == 0))
+        return 0;
+
+    *stage = ST_synthesise;
+    return seed_from_contents(d, type, &seed);
+}
+
+/* Round-trip @type, in a child process. Prints a result line and exits. */
+static void bench_one(enum track_type type)
+{
+    struct disk *seed = disk_create(NULL, 0), *dst = disk_create(NULL, 0);
+    struct track_info *ti, *dti;
+    struct track_raw *raw;
+    const char *why = NULL;
+    double enc = 0, dec = 0;
+    unsigned int i;
+    int rc = RT_ok;
+
+    alarm(HANG_SECS);
+
+    if (seed_track(seed, type) != 0) {
+        if (!quiet)
+            printf("%-32s   cannot seed\n", disk_get_format_id_name(type));
+        exit(RT_no_seed);
+    }
+
+    *stage = ST_round_trip;
+    ti = &disk_get_info(seed)->track[BENCH_TRACK];
+    dti = &disk_get_info(dst)->track[BENCH_TRACK];
+
+    raw = track_alloc_raw_buffer(seed);
+    track_read_raw(raw, BENCH_TRACK);
+    if (raw->bitlen == 0) {
+        rc = RT_no_decode;
+        why = "no bitcells";
+    } else if (decode(dst, raw->bits, raw->speed, raw->bitlen, type) != 0) {
+        rc = RT_no_decode;
+    } else {
+        if ((ti->type != dti->type) || (ti->len != dti->len))
+            why = "length";
+        else if (memcmp(ti->dat, dti->dat, ti->len))
+            why = "data";
+        for (i = 0; (why == NULL) && (i < ti->nr_sectors); i++)
+            if (is_valid_sector(ti, i) && !is_valid_sector(dti, i))
+                why = "bad sectors";
+        if (why != NULL)
+            rc = RT_mismatch;
+        enc = throughput(raw->bitlen, track_read_raw(raw, BENCH_TRACK));
+        dec = throughput(raw->bitlen, decode(dst, raw->bits, raw->speed,
+                                             raw->bitlen, type));
+    }
+
+    if (!quiet || (rc != RT_ok)) {
+        printf("%-32s %9.1f %9.1f  %s%s%s%s\n",
+               disk_get_format_id_name(type), enc / 1e6, dec / 1e6,
+               (rc == RT_ok) ? "ok" :
+               (rc == RT_no_decode) ? "no decode" : "mismatch",
+               why ? ": " : "", why ? why : "",
+               !is_known_bad(disk_get_format_id_name(type)) ? "" :
+               (rc == RT_ok) ? " (listed as known bad)" : " (known)");
+        fflush(stdout);
+    }
+
+    track_free_raw_buffer(raw);
+    disk_close(seed);
+    disk_close(dst);
+    exit(rc);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int nr_types, i, nr_ok = 0, nr_unseeded = 0, nr_known = 0;
+    unsigned int nr_bad = 0;
+    const char *name;
+    int ch, status;
+    pid_t pid;
+
+    const static char sopts[] = "hqt:";
+    const static struct option lopts[] = {
+        { "help", 0, NULL, 'h' },
+        { "quiet", 0, NULL, 'q' },
+        { "time", 1, NULL, 't' },
+        { 0, 0, 0, 0 }
+    };
+
+    stage = mmap(NULL, sizeof(*stage), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stage == MAP_FAILED)
+        err(1, "mmap");
+
+    while ((ch = getopt_long(argc, argv, sopts, lopts, NULL)) != -1) {
+        switch (ch) {
+        case 'h':
+            usage(0);
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        case 't':
+            min_ms = atoi(optarg);
+            break;
+        default:
+            usage(1);
+            break;
+        }
+    }
+
+    for (nr_types = 0; disk_get_format_id_name(nr_types); nr_types++)
+        continue;
+
+    printf("%-32s %9s %9s\n", "Format", "Enc Mb/s", "Dec Mb/s");
+
+    for (i = 0; i < nr_types; i++) {
+        name = disk_get_format_id_name(i);
+        if (optind < argc) {
+            int j;
+            for (j = optind; j < argc; j++)
+                if (!strcmp(argv[j], name))
+                    break;
+            if (j == argc)
+                continue;
+        }
+        if ((handlers[i]->read_raw == NULL)
+            || (handlers[i]->write_raw == NULL))
+            continue;
+
+        fflush(stdout);
+        if ((pid = fork()) < 0)
+            err(1, "fork");
+        if (pid == 0)
+            bench_one(i);
+        if (waitpid(pid, &status, 0) < 0)
+            err(1, "waitpid");
+
+        if (WIFEXITED(status) && (WEXITSTATUS(status) == RT_ok)) {
+            nr_ok++;
+        } else if (WIFEXITED(status)
+                   && (WEXITSTATUS(status) == RT_no_seed)) {
+            nr_unseeded++;
+        } else if (WIFEXITED(status) && is_known_bad(name)) {
+            nr_known++;
+        } else if (WIFEXITED(status)) {
+            nr_bad++;
+        } else if (*stage == ST_synthesise) {
+            /* The handler was given contents it never made. */
+            if (!quiet)
+                printf("%-32s   cannot seed: %s on random contents\n", name,
+                       (WTERMSIG(status) == SIGALRM) ? "hung" : "crashed");
+            nr_unseeded++;
+        } else {
+            printf("%-32s   %s\n", name,
+                   (WTERMSIG(status) == SIGALRM) ? "hung" : "crashed");
+            nr_bad++;
+        }
+    }
+
+    printf("%u handlers round-trip, %u cannot be seeded, %u known not to, "
+           "%u fail\n", nr_ok, nr_unseeded, nr_known, nr_bad);
+
+    return nr_bad ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,302 @@
+/*
+ * bench/stress.c
+ *
+ * Exercise the thread-safety contract of libdisk (see libdisk/disk.h): many
+ * threads open, decode and write independent disks at once, and each result
+ * must match the same work done by a single thread beforehand.
+ *
+ * Each job:
+ *  - decodes a pseudo-random ADF through the disk-image stream into an
+ *    anonymous disk, setting and checking that disk's tags as it goes;
+ *  - builds IBM-PC tracks from sectors, decodes them as IBM MFM, and writes
+ *    them out as a JV3 image, whose writer shares static buffers;
+ *  - if CAPS/IPF support is built in, opens a file with a CAPS signature,
+ *    which enters the handler and the shared CAPS library state.
+ *
+ * Exits non-zero if any job's result differs from the reference.
+ *
+ * Written in 2026 by agent
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include <libdisk/util.h>
+#include <libdisk/disk.h>
+#include <libdisk/stream.h>
+#include <private/util.h>
+
+/* Tracks decoded by each part of a job. */
+#define NR_TRACKS 20
+
+static unsigned int nr_threads = 8, nr_jobs = 2;
+static char dir[] = "/tmp/libdisk-stress.XXXXXX";
+static char adf_name[sizeof(dir) + 16], caps_name[sizeof(dir) + 16];
+
+struct result {
+    uint8_t digest[DISK_DIGEST_LEN];
+    void *jv3;
+    size_t jv3_len;
+    const char *why;
+};
+
+struct worker {
+    pthread_t thread;
+    unsigned int id, nr_failed;
+};
+
+static struct result ref;
+
+static void usage(int rc)
+{
+    printf("Usage: stress [options]\n");
+    printf("Decode and write independent disks from many threads at "
+           "once.\n");
+    printf("Options:\n");
+    printf("  -h, --help        Display this information\n");
+    printf("  -j, --threads=N   Number of threads (%u)\n", nr_threads);
+    printf("  -n, --jobs=N      Jobs run by each thread (%u)\n", nr_jobs);
+    exit(rc);
+}
+
+static void fill_random(uint8_t *p, unsigned int len, uint32_t *seed)
+{
+    while (len--)
+        *p++ = rnd16(seed);
+}
+
+/* Decode the first tracks of the ADF into an anonymous disk, whose tags are
+ * rewritten with values unique to worker @id before each track. */
+static void decode_adf(unsigned int id, struct result *res)
+{
+    struct disk *d = disk_create(NULL, 0);
+    struct stream *s;
+    struct disktag_disk_nr *tag;
+    uint32_t disk_nr;
+    unsigned int i;
+
+    if ((s = stream_open(adf_name, 300, 300)) == NULL)
+        errx(1, "%s: cannot open stream", adf_name);
+
+    for (i = 0; (i < NR_TRACKS) && (res->why == NULL); i++) {
+        disk_nr = (id << 8) | i;
+        tag = (struct disktag_disk_nr *)disk_set_tag(
+            d, DSKTAG_disk_nr, sizeof(disk_nr), &disk_nr);
+        if (track_write_raw_from_stream(d, i, TRKTYP_amigados, s) != 0)
+            res->why = "ADF decode";
+        else if ((disk_get_tag_by_id(d, DSKTAG_disk_nr) != &tag->tag)
+                 || (tag->disk_nr != disk_nr))
+            res->why = "disk tag";
+    }
+
+    /* The digest covers the tags: finish with the same one everywhere. */
+    disk_nr = 0;
+    disk_set_tag(d, DSKTAG_disk_nr, sizeof(disk_nr), &disk_nr);
+    disk_get_digest(d, res->digest);
+
+    stream_close(s);
+    disk_close(d);
+}
+
+/* Write IBM-PC tracks, decoded from their own bitcells, to JV3 file @name,
+ * and read the file back into @res. */
+static void write_jv3(const char *name, struct result *res)
+{
+    struct disk *src = disk_create(NULL, 0), *d;
+    struct track_sectors *sectors = track_alloc_sector_buffer(src);
+    struct track_raw *raw = track_alloc_raw_buffer(src);
+    struct stream *s;
+    uint8_t *buf = memalloc(9 * 512);
+    uint32_t seed = 1;
+    unsigned int i;
+    void *p;
+
+    if ((d = disk_create(name, 0)) == NULL)
+        errx(1, "%s: cannot create", name);
+
+    for (i = 0; (i < NR_TRACKS) && (res->why == NULL); i++) {
+        fill_random(buf, 9 * 512, &seed);
+        /* The handler consumes the buffer: keep hold of it ourselves. */
+        sectors->data = buf;
+        sectors->nr_bytes = 9 * 512;
+        if (track_write_sectors(sectors, i, TRKTYP_ibm_pc_dd) != 0) {
+            res->why = "IBM-PC encode";
+            break;
+        }
+        track_read_raw(raw, i);
+        s = stream_soft_open(raw->bits, raw->speed, raw->bitlen, 300);
+        if (track_write_raw_from_stream(d, i, TRKTYP_ibm_mfm_dd, s) != 0)
+            res->why = "IBM-MFM decode";
+        stream_close(s);
+    }
+
+    sectors->data = NULL;
+    track_free_sector_buffer(sectors);
+    track_free_raw_buffer(raw);
+    memfree(buf);
+    disk_close(src);
+    disk_close(d);
+
+    if ((p = map_file(name, &res->jv3_len)) == NULL)
+        errx(1, "%s: not written", name);
+    res->jv3 = memalloc(res->jv3_len);
+    memcpy(res->jv3, p, res->jv3_len);
+    unmap_file(p, res->jv3_len);
+    unlink(name);
+}
+
+static void open_caps(void)
+{
+#ifdef HAVE_CAPS
+    struct stream *s = stream_open(caps_name, 300, 300);
+    if (s != NULL)
+        stream_close(s);
+#endif
+}
+
+static void run_job(unsigned int id, struct result *res)
+{
+    char jv3_name[sizeof(dir) + 16];
+
+    sprintf(jv3_name, "%s/%u.jv3", dir, id);
+    memset(res, 0, sizeof(*res));
+    decode_adf(id, res);
+    write_jv3(jv3_name, res);
+    open_caps();
+}
+
+static void *worker(void *arg)
+{
+    struct worker *w = arg;
+    struct result res;
+    const char *why;
+    unsigned int i;
+
+    for (i = 0; i < nr_jobs; i++) {
+        run_job(w->id, &res);
+        why = res.why;
+        if ((why == NULL)
+            && memcmp(res.digest, ref.digest, sizeof(ref.digest)))
+            why = "ADF decode differs";
+        if ((why == NULL) && ((res.jv3_len != ref.jv3_len)
+                              || memcmp(res.jv3, ref.jv3, ref.jv3_len)))
+            why = "JV3 image differs";
+        if (why != NULL) {
+            warnx("thread %u, job %u: %s", w->id, i, why);
+            w->nr_failed++;
+        }
+        memfree(res.jv3);
+    }
+
+    return NULL;
+}
+
+static void make_inputs(void)
+{
+    uint8_t *buf = memalloc(160 * 11 * 512);
+    uint32_t seed = 1;
+    int fd;
+
+    if (mkdtemp(dir) == NULL)
+        err(1, "mkdtemp");
+    sprintf(adf_name, "%s/in.adf", dir);
+    sprintf(caps_name, "%s/in.ipf", dir);
+
+    fill_random(buf, 160 * 11 * 512, &seed);
+    if ((fd = file_open(adf_name, O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1)
+        err(1, "%s", adf_name);
+    write_exact(fd, buf, 160 * 11 * 512);
+    close(fd);
+
+    /* Just the signature: no image is expected to be found there. */
+    memset(buf, 0, 64);
+    memcpy(buf, "CAPS", 4);
+    if ((fd = file_open(caps_name, O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1)
+        err(1, "%s", caps_name);
+    write_exact(fd, buf, 64);
+    close(fd);
+
+    memfree(buf);
+}
+
+int main(int argc, char **argv)
+{
+    struct worker *workers;
+    unsigned int i, nr_failed = 0;
+    uint64_t t0;
+    int ch;
+
+    const static char sopts[] = "hj:n:";
+    const static struct option lopts[] = {
+        { "help", 0, NULL, 'h' },
+        { "threads", 1, NULL, 'j' },
+        { "jobs", 1, NULL, 'n' },
+        { 0, 0, 0, 0 }
+    };
+
+    while ((ch = getopt_long(argc, argv, sopts, lopts, NULL)) != -1) {
+        switch (ch) {
+        case 'h':
+            usage(0);
+            break;
+        case 'j':
+            nr_threads = atoi(optarg);
+            break;
+        case 'n':
+            nr_jobs = atoi(optarg);
+            break;
+        default:
+            usage(1);
+            break;
+        }
+    }
+
+    if ((optind != argc) || (nr_threads == 0))
+        usage(1);
+
+    make_inputs();
+
+    /* The reference result, from this thread alone. */
+    run_job(0, &ref);
+    if (ref.why != NULL)
+        errx(1, "reference job failed: %s", ref.why);
+
+    t0 = time_ns();
+    workers = memalloc(nr_threads * sizeof(*workers));
+    for (i = 0; i < nr_threads; i++) {
+        workers[i].id = i + 1;
+        if (pthread_create(&workers[i].thread, NULL, worker, &workers[i]))
+            errx(1, "pthread_create failed");
+    }
+    for (i = 0; i < nr_threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        nr_failed += workers[i].nr_failed;
+    }
+
+    printf("%u threads x %u jobs in %.1f s: %u failed\n",
+           nr_threads, nr_jobs, (time_ns() - t0) / 1e9, nr_failed);
+
+    memfree(workers);
+    memfree(ref.jv3);
+    unlink(adf_name);
+    unlink(caps_name);
+    if (rmdir(dir) < 0)
+        warn("%s", dir);
+
+    return nr_failed ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -17,21 +17,24 @@
 #include <time.h>
 #include <utime.h>
 #include <getopt.h>
+#include <pthread.h>
 
 #include <libdisk/stream.h>
 #include <libdisk/disk.h>
+#include <libdisk/analyse.h>
 #include <libdisk/util.h>
 
-#include "common.h"
-
-int quiet, verbose;
+static int quiet, verbose;
 static unsigned int start_cyl, disk_flags;
 static int index_align, clear_bad_sectors, single_sided = -1, end_cyl = -1;
 static int double_step = 0;
+static unsigned int nr_jobs;
 static unsigned int drive_rpm = 300, data_rpm = 300;
 static int pll_period_adj_pct = -1, pll_phase_adj_pct = -1;
+static uint32_t rev_mask;
 static struct format_list **format_lists;
-static char *in, *out;
+static char *in, *out, *config, *fp_db = "fingerprints", *stats_file;
+static struct format_stats *win_stats;
 
 /* Iteration start/step for single- and double-sided modes. */
 #define _TRACK_START ((single_sided == 1) ? 1 : 0)
@@ -48,6 +51,9 @@ static char *in, *out;
 static void usage(int rc)
 {
     printf("Usage: disk-analyse [options] in_file out_file\n");
+    printf("       disk-analyse [-c FILE] --build-db=DB_FILE\n");
+    printf("       disk-analyse [-F FILE] --fp-add=TITLE in_file\n");
+    printf("       disk-analyse --compare image_a image_b\n");
     printf("Options:\n");
     printf("  -h, --help          Display this information\n");
     printf("  -q, --quiet         Quiesce normal informational output\n");
@@ -59,13 +65,31 @@ static void usage(int rc)
     printf("                      Amount observed flux affects PLL\n");
     printf("  -r, --rpm=DRIVE[:DATA] RPM of drive that created the input,\n");
     printf("                         Original recording RPM of data [300]\n");
+    printf("  -R, --revs=LIST     Flux revolutions to use, eg. 2,3 or 1-2\n");
+    printf("                      (SCP input only) [all]\n");
     printf("  -D, --double-step   Double Step\n");
     printf("  -s, --start-cyl=N   Start cylinder\n");
     printf("  -e, --end-cyl=N     End cylinder\n");
     printf("  -S, --ss[=0|1]      Single-sided disk (default is side 0)\n");
     printf("  -k, --kryoflux-hack Fill empty tracks with prev track's data\n");
+    printf("  -E, --pipeline      Encode output tracks in a background thread\n");
+    printf("                      as they are analysed (HFE, SCP, EADF)\n");
     printf("  -f, --format=FORMAT Name of format descriptor in config file\n");
     printf("  -c, --config=FILE   Config file to parse for format info\n");
+    printf("  -j, --jobs=N        Worker threads for probe_all [#cpus]\n");
+    printf("  -b, --build-db=FILE Compile config into a formats database\n");
+    printf("  -a, --fp-add=TITLE  Add input to fingerprint DB as TITLE\n");
+    printf("  -F, --fp-db=FILE    Fingerprint database [fingerprints]\n");
+    printf("                      (-f identify: match input against it)\n");
+    printf("  -x, --compare       Compare in_file with image out_file\n");
+    printf("  -m, --stats=FILE    Write per-track decode stats to FILE\n");
+    printf("                      (CSV if FILE ends .csv, else JSON)\n");
+    printf("  -T, --trace=FILE    Write a timeline of decode and encode\n");
+    printf("                      work to FILE, as Chrome trace events\n");
+    printf("  -N, --counters      Print libdisk hot-path counters on exit\n");
+    printf("                      (libdisk built with counters=y)\n");
+    printf("  -W, --win-stats=FILE Try formats in order of past matches\n");
+    printf("                      recorded in FILE, and update it\n");
     printf("Supported file formats (suffix => type):\n");
     printf("  .adf  => ADF\n");
     printf("  .eadf => Extended-ADF\n");
@@ -74,6 +98,8 @@ static void usage(int rc)
     printf("  .img  => IBM-MFM Sector Dump\n");
     printf("  .ipf  => SPS/IPF\n");
     printf("  .dsk  => Libdisk\n");
+    printf("  .dskz => Libdisk, compressed\n");
+    printf("  .dskref => Libdisk, track data in shared dskpool/\n");
     printf("  .scp  => Supercard Pro\n");
     printf("  .st   => Atari ST Sector Dump\n");
     printf("Read-only support:\n");
@@ -178,13 +204,124 @@ static void dump_track_list(struct disk *d)
     printf("%u.%u: %s\n", TRACK_ARG(i-TRACK_STEP), prev_name);
 }
 
-static void probe_stream(void)
+/* Parse a list of revolution numbers and ranges into rev_mask. */
+static int parse_revs(const char *p)
 {
-    struct stream *s;
-    struct disk *d;
-    struct disk_info *di;
-    struct track_info *ti;
+    unsigned long a, b;
+    char *q;
+
+    for (;;) {
+        a = b = strtoul(p, &q, 10);
+        if (*q == '-')
+            b = strtoul(q+1, &q, 10);
+        if ((a < 1) || (b < a) || (b > 32))
+            return -1;
+        while (a <= b)
+            rev_mask |= 1u << (a++ - 1);
+        if (*q == '\0')
+            return 0;
+        if (*q++ != ',')
+            return -1;
+        p = q;
+    }
+}
+
+static const char *const analyse_status[] = {
+    "skipped", "ok", "bad_sectors", "unformatted", "unidentified"
+};
+
+static void json_string(FILE *f, const char *str)
+{
+    fputc('"', f);
+    for (; *str != '\0'; str++) {
+        if ((*str == '"') || (*str == '\\'))
+            fprintf(f, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            fprintf(f, "\\u%04x", *str);
+        else
+            fputc(*str, f);
+    }
+    fputc('"', f);
+}
+
+/* Write the outcome and cost of analysing each track in @opts's range to
+ * stats_file. @encode_ns[] is as accumulated by disk_set_encode_timer(). */
+static void write_stats(
+    struct stream *s, const struct analyse_opts *opts,
+    const struct analyse_track *res, const uint64_t *encode_ns)
+{
+    const struct analyse_track *r;
+    char suffix[8];
     unsigned int i;
+    int csv;
+    FILE *f;
+
+    filename_extension(stats_file, suffix, sizeof(suffix));
+    csv = !strcmp(suffix, "csv");
+
+    if ((f = fopen(stats_file, "w")) == NULL)
+        err(1, "%s", stats_file);
+
+    if (csv) {
+        fprintf(f, "track,cyl,head,status,format,attempts,time_ns,"
+                "bitcells,flux,revs,density_ns,pll_period_adj,"
+                "pll_phase_adj,sectors,bad_sectors,encode_ns\n");
+    } else {
+        fprintf(f, "{\n  \"input\": ");
+        json_string(f, in);
+        fprintf(f, ",\n  \"output\": ");
+        json_string(f, out);
+        fprintf(f, ",\n  \"drive_rpm\": %u, \"data_rpm\": %u,\n"
+                "  \"pll_period_adj\": %d, \"pll_phase_adj\": %d,\n"
+                "  \"tracks\": [",
+                drive_rpm, data_rpm,
+                s->pll_period_adj_pct, s->pll_phase_adj_pct);
+    }
+
+    for (i = opts->start_track; i <= opts->end_track; i += opts->step) {
+        r = &res[i];
+        if (csv) {
+            fprintf(f, "%u,%u,%u,%s,%s,%u,%llu,%llu,%llu,%u,%u,%d,%d,"
+                    "%u,%u,%llu\n",
+                    i, cyl(i), hd(i), analyse_status[r->status],
+                    disk_get_format_id_name(r->type), r->attempts,
+                    (unsigned long long)r->time_ns,
+                    (unsigned long long)r->nr_bits,
+                    (unsigned long long)r->nr_flux,
+                    r->revs, r->density_ns,
+                    s->pll_period_adj_pct, s->pll_phase_adj_pct,
+                    r->nr_sectors, r->nr_bad_sectors,
+                    (unsigned long long)encode_ns[i]);
+            continue;
+        }
+        fprintf(f, "%s\n    { \"track\": %u, \"cyl\": %u, \"head\": %u, "
+                "\"status\": \"%s\", \"format\": \"%s\", "
+                "\"attempts\": %u,\n"
+                "      \"time_ns\": %llu, \"bitcells\": %llu, "
+                "\"flux\": %llu, \"revs\": %u, \"density_ns\": %u,\n"
+                "      \"sectors\": %u, \"bad_sectors\": %u, "
+                "\"encode_ns\": %llu }",
+                (i == opts->start_track) ? "" : ",",
+                i, cyl(i), hd(i), analyse_status[r->status],
+                disk_get_format_id_name(r->type), r->attempts,
+                (unsigned long long)r->time_ns,
+                (unsigned long long)r->nr_bits,
+                (unsigned long long)r->nr_flux,
+                r->revs, r->density_ns,
+                r->nr_sectors, r->nr_bad_sectors,
+                (unsigned long long)encode_ns[i]);
+    }
+
+    if (!csv)
+        fprintf(f, "\n  ]\n}\n");
+
+    if (fclose(f) != 0)
+        err(1, "%s", stats_file);
+}
+
+static struct stream *open_stream(void)
+{
+    struct stream *s;
 
     if ((s = stream_open(in, drive_rpm, data_rpm)) == NULL)
         errx(1, "Failed to probe input file: %s", in);
@@ -194,47 +331,162 @@ static void probe_stream(void)
         s->pll_period_adj_pct = pll_period_adj_pct;
     if (pll_phase_adj_pct >= 0)
         s->pll_phase_adj_pct = pll_phase_adj_pct;
+    stream_set_revolutions(s, rev_mask);
     if (verbose)
         printf("PLL Parameters: period_adj=%d%% phase_adj=%d%%\n",
                s->pll_period_adj_pct, s->pll_phase_adj_pct);
 
+    return s;
+}
+
+/* Parse format plan @spec from the config, exiting on error. The parser has
+ * already said what is wrong. */
+static struct format_list **load_plan(const char *spec, int verbose)
+{
+    struct format_list **plan = format_plan_parse(config, spec, verbose);
+    if (plan == NULL)
+        exit(1);
+    return plan;
+}
+
+static void init_analyse_opts(struct analyse_opts *opts, struct disk_info *di)
+{
+    opts->start_track = TRACK_START;
+    opts->end_track = TRACK_END(di);
+    opts->step = TRACK_STEP;
+    opts->flags = 0;
+    opts->stats = win_stats;
+    if (index_align)
+        opts->flags |= ANALYSE_index_align;
+    if (clear_bad_sectors)
+        opts->flags |= ANALYSE_clear_bad_sectors;
+}
+
+/* probe_all: Per-format trial outcome for the current track. */
+struct probe_result {
+    bool_t match;
+    char name[128];
+    unsigned int nr_valid, nr_sectors;
+};
+
+/* probe_all: Each worker owns a scratch disk and tries a fixed subset of the
+ * formats (every nr_jobs'th format from its own index). */
+struct probe_worker {
+    pthread_t thread;
+    unsigned int idx, tracknr;
+    struct disk *d;
+    struct stream *s;
+    struct probe_result *results;
+};
+
+static void *probe_worker(void *arg)
+{
+    struct probe_worker *w = arg;
+    struct disk_info *di = disk_get_info(w->d);
+    struct track_info *ti = &di->track[w->tracknr];
+    struct probe_result *r;
+    const char *fmtname;
+    unsigned int j, k;
+
+    for (j = w->idx; (fmtname = disk_get_format_id_name(j)) != NULL;
+         j += nr_jobs) {
+        r = &w->results[j];
+        if (!strncmp(fmtname, "raw_", 4)) {
+            /* Skip raw formats, they accept everything. */
+            continue;
+        }
+        if (track_write_raw_from_stream(w->d, w->tracknr, j, w->s) != 0)
+            continue;
+        track_get_format_name(w->d, w->tracknr, r->name, sizeof(r->name));
+        if (!strncmp(r->name, "AmigaDOS", 8) && strcmp(fmtname, "amigados")) {
+            /* Skip umpteen variations on AmigaDOS. */
+            continue;
+        }
+        r->match = 1;
+        r->nr_sectors = ti->nr_sectors;
+        for (k = 0; k < ti->nr_sectors; k++)
+            if (!is_valid_sector(ti, k))
+                break;
+        r->nr_valid = k;
+    }
+
+    return NULL;
+}
+
+static void probe_stream(void)
+{
+    struct stream *s, *ms;
+    struct disk *d;
+    struct disk_info *di;
+    struct probe_worker *workers;
+    struct probe_result *results;
+    unsigned int i, j, nr_formats;
+
+    s = open_stream();
+
     if ((d = disk_create(out, disk_flags | DISKFL_rpm(data_rpm))) == NULL)
         errx(1, "Unable to create new disk file: %s", out);
     di = disk_get_info(d);
 
+    for (nr_formats = 0; disk_get_format_id_name(nr_formats); nr_formats++)
+        continue;
+    results = memalloc(nr_formats * sizeof(*results));
+
+    workers = memalloc(nr_jobs * sizeof(*workers));
+    for (j = 0; j < nr_jobs; j++) {
+        workers[j].idx = j;
+        workers[j].results = results;
+        workers[j].d = disk_create(NULL, disk_flags | DISKFL_rpm(data_rpm));
+    }
+
+    stream_set_track_order(s, TRACK_START, TRACK_END(di), TRACK_STEP);
     for (i = TRACK_START; i <= TRACK_END(di); i += TRACK_STEP) {
-        unsigned int j, k, nr = 0;
-        char name[128];
-        const char *fmtname;
+        unsigned int nr = 0, first = 0;
         printf("T%u.%u: ", TRACK_ARG(i));
-        for (j = 0; (fmtname = disk_get_format_id_name(j)) != NULL; j++) {
-            if (!strncmp(fmtname, "raw_", 4)) {
-                /* Skip raw formats, they accept everything. */
-                continue;
+        fflush(stdout);
+        memset(results, 0, nr_formats * sizeof(*results));
+        /* Each worker gets a private cursor over one shared flux capture. */
+        if ((ms = stream_capture_track(s, i)) != NULL) {
+            for (j = 0; j < nr_jobs; j++) {
+                workers[j].tracknr = i;
+                workers[j].s = stream_dup(ms);
+                if (pthread_create(&workers[j].thread, NULL,
+                                   probe_worker, &workers[j]))
+                    errx(1, "Failed to create probe thread");
             }
-            if (track_write_raw_from_stream(d, i, j, s) == 0) {
-                track_get_format_name(d, i, name, sizeof(name));
-                if (!strncmp(name, "AmigaDOS", 8)
-                    && strcmp(fmtname, "amigados")) {
-                    /* Skip umpteen variations on AmigaDOS. */
-                    continue;
-                }
-                if (nr++)
-                    printf(", ");
-                printf("%s(%s)", name, fmtname);
-                ti = &di->track[i];
-                for (k = 0; k < ti->nr_sectors; k++)
-                    if (!is_valid_sector(ti, k))
-                        break;
-                if (k != ti->nr_sectors)
-                    printf("[%u/%u]", k, ti->nr_sectors);
+            for (j = 0; j < nr_jobs; j++) {
+                pthread_join(workers[j].thread, NULL);
+                stream_close(workers[j].s);
             }
         }
+        for (j = 0; j < nr_formats; j++) {
+            struct probe_result *r = &results[j];
+            if (!r->match)
+                continue;
+            if (nr++)
+                printf(", ");
+            else
+                first = j;
+            printf("%s(%s)", r->name, disk_get_format_id_name(j));
+            if (r->nr_valid != r->nr_sectors)
+                printf("[%u/%u]", r->nr_valid, r->nr_sectors);
+        }
         if (!nr)
             printf("Unidentified");
         printf("\n");
+        /* The output disk receives the first matching format. */
+        if (ms != NULL) {
+            if (!nr || (track_write_raw_from_stream(d, i, first, ms) != 0))
+                track_mark_unformatted(d, i);
+            stream_close(ms);
+        }
     }
 
+    for (j = 0; j < nr_jobs; j++)
+        disk_close(workers[j].d);
+    memfree(workers);
+    memfree(results);
+
     disk_close(d);
     stream_close(s);
 }
@@ -244,68 +496,39 @@ static void handle_stream(void)
     struct stream *s;
     struct disk *d;
     struct disk_info *di;
-    struct track_info *ti;
-    unsigned int i, unidentified = 0, bad_secs = 0;
+    struct analyse_opts opts;
+    struct analyse_track *res;
+    uint64_t *encode_ns = NULL;
+    unsigned int i, unidentified, bad_secs = 0;
 
-    if ((s = stream_open(in, drive_rpm, data_rpm)) == NULL)
-        errx(1, "Failed to probe input file: %s", in);
-    s->double_step = double_step;
-
-    if (pll_period_adj_pct >= 0)
-        s->pll_period_adj_pct = pll_period_adj_pct;
-    if (pll_phase_adj_pct >= 0)
-        s->pll_phase_adj_pct = pll_phase_adj_pct;
-    if (verbose)
-        printf("PLL Parameters: period_adj=%d%% phase_adj=%d%%\n",
-               s->pll_period_adj_pct, s->pll_phase_adj_pct);
+    s = open_stream();
 
     if ((d = disk_create(out, disk_flags | DISKFL_rpm(data_rpm))) == NULL)
         errx(1, "Unable to create new disk file: %s", out);
     di = disk_get_info(d);
 
-    for (i = TRACK_START; i <= TRACK_END(di); i += TRACK_STEP) {
-        struct format_list *list = format_lists[i];
-        unsigned int j;
-        if (list == NULL)
-            continue;
-        for (j = 0; j < list->nr; j++) {
-            if (track_write_raw_from_stream(
-                    d, i, list->ent[list->pos], s) == 0)
-                break;
-            if (++list->pos >= list->nr)
-                list->pos = 0;
-        }
-        if ((j == list->nr) &&
-            (track_write_raw_from_stream(d, i, TRKTYP_unformatted, s) != 0)) {
-            /* Tracks 160+ are expected to be unused. Don't warn about them. */
-            if (i < 160)
-                unidentified++;
-            else
-                track_mark_unformatted(d, i);
-        }
+    init_analyse_opts(&opts, di);
+    res = memalloc(di->nr_tracks * sizeof(*res));
+    if (stats_file) {
+        encode_ns = memalloc(di->nr_tracks * sizeof(*encode_ns));
+        disk_set_encode_timer(d, encode_ns);
     }
 
+    unidentified = disk_analyse_stream(d, s, format_lists, &opts, res);
+
     for (i = TRACK_START; i <= TRACK_END(di); i += TRACK_STEP) {
+        struct analyse_track *r = &res[i];
         unsigned int j;
-        ti = &di->track[i];
-        if (index_align)
-            ti->data_bitoff = 1024;
-        for (j = 0; j < ti->nr_sectors; j++)
-            if (!is_valid_sector(ti, j))
-                break;
-        if (j == ti->nr_sectors)
+        if (r->nr_bad_sectors == 0)
             continue;
-        unidentified++;
         printf("T%u.%u: sectors ", TRACK_ARG(i));
-        for (j = 0; j < ti->nr_sectors; j++) {
-            if (is_valid_sector(ti, j))
+        for (j = 0; j < r->nr_sectors; j++) {
+            if (r->valid_sectors[j>>3] & (0x80u >> (j&7)))
                 continue;
             printf("%u,", j);
-            bad_secs++;
         }
         printf(" missing\n");
-        if (clear_bad_sectors)
-            set_all_sectors_valid(ti);
+        bad_secs += r->nr_bad_sectors;
     }
 
     if (clear_bad_sectors && bad_secs)
@@ -318,7 +541,181 @@ static void handle_stream(void)
         fprintf(stderr,"** WARNING: %u track%s damaged or unidentified!\n",
                 unidentified, (unidentified > 1) ? "s are" : " is");
 
+    /* Output tracks are encoded as the disk is closed. */
     disk_close(d);
+    if (stats_file)
+        write_stats(s, &opts, res, encode_ns);
+    memfree(encode_ns);
+    memfree(res);
+    stream_close(s);
+}
+
+/* Add the input's fingerprint to the fingerprint database. */
+static void fingerprint_add(const char *title)
+{
+    struct stream *s = open_stream();
+    struct disk_fingerprint *dfp;
+
+    dfp = disk_fingerprint_stream(s, title, FORMAT_PLAN_TRACKS);
+    if (fingerprint_db_append(fp_db, dfp) != 0)
+        exit(1);
+    disk_fingerprint_free(dfp);
+
+    stream_close(s);
+}
+
+/* Report differences between two tracks' sector contents. */
+static void compare_sectors(
+    struct disk *da, struct disk *db, unsigned int tracknr)
+{
+    struct track_sectors *sa = track_alloc_sector_buffer(da);
+    struct track_sectors *sb = track_alloc_sector_buffer(db);
+    unsigned int i, nr_diff = 0;
+
+    if ((track_read_sectors(sa, tracknr) == 0)
+        && (track_read_sectors(sb, tracknr) == 0)) {
+        if (sa->nr_bytes != sb->nr_bytes) {
+            printf("    Sector data: %u vs %u bytes\n",
+                   sa->nr_bytes, sb->nr_bytes);
+        } else {
+            for (i = 0; i < sa->nr_bytes; i++)
+                nr_diff += (sa->data[i] != sb->data[i]);
+            printf("    Sector data: %u of %u bytes differ\n",
+                   nr_diff, sa->nr_bytes);
+        }
+    }
+
+    track_free_sector_buffer(sa);
+    track_free_sector_buffer(sb);
+}
+
+/* compare: Diff two images by their recorded track digests, and decode only
+ * the tracks which differ. Exits non-zero if the images differ. */
+static int compare_images(void)
+{
+    struct disk *da, *db;
+    uint8_t dga[DISK_DIGEST_LEN], dgb[DISK_DIGEST_LEN];
+    unsigned int i, nr_a, nr_b, nr_diff = 0;
+    char name_a[128], name_b[128];
+    int rc = 0;
+
+    if ((da = disk_open(in, DISKFL_read_only)) == NULL)
+        errx(1, "Unable to open %s", in);
+    if ((db = disk_open(out, DISKFL_read_only)) == NULL)
+        errx(1, "Unable to open %s", out);
+
+    disk_get_digest(da, dga);
+    disk_get_digest(db, dgb);
+    if (!memcmp(dga, dgb, sizeof(dga))) {
+        printf("Images are identical\n");
+        goto out;
+    }
+    rc = 1;
+
+    nr_a = disk_get_nr_tracks(da);
+    nr_b = disk_get_nr_tracks(db);
+    if (nr_a != nr_b)
+        printf("Track count: %u vs %u\n", nr_a, nr_b);
+
+    for (i = 0; i < min(nr_a, nr_b); i++) {
+        track_get_digest(da, i, dga);
+        track_get_digest(db, i, dgb);
+        if (!memcmp(dga, dgb, sizeof(dga)))
+            continue;
+        nr_diff++;
+        track_get_format_name(da, i, name_a, sizeof(name_a));
+        track_get_format_name(db, i, name_b, sizeof(name_b));
+        printf("T%u.%u: %s | %s\n", TRACK_ARG(i), name_a, name_b);
+        compare_sectors(da, db, i);
+    }
+
+    if (nr_diff == 0)
+        printf("Track data is identical; layout or tags differ\n");
+    else
+        printf("%u tracks differ\n", nr_diff);
+
+out:
+    disk_close(da);
+    disk_close(db);
+    return rc;
+}
+
+/* identify: Rank known titles by fingerprint, then fully decode only the
+ * best few candidates using their format plans. */
+#define NR_CANDIDATES 3
+static void identify_stream(void)
+{
+    struct stream *s = open_stream();
+    struct disk_fingerprint *dfp, **db;
+    struct format_list **plan;
+    struct analyse_opts opts;
+    struct analyse_track *res;
+    struct disk *d;
+    struct disk_info *di;
+    struct {
+        unsigned int idx, score;
+    } cand[NR_CANDIDATES];
+    unsigned int i, j, nr, nr_cand = 0, damaged, best = 0, best_damaged = ~0u;
+
+    dfp = disk_fingerprint_stream(s, in, FORMAT_PLAN_TRACKS);
+    if ((db = fingerprint_db_load(fp_db, &nr)) == NULL)
+        exit(1);
+
+    for (i = 0; i < nr; i++) {
+        unsigned int score = disk_fingerprint_score(dfp, db[i]);
+        for (j = nr_cand; (j > 0) && (score > cand[j-1].score); j--)
+            if (j < NR_CANDIDATES)
+                cand[j] = cand[j-1];
+        if (j < NR_CANDIDATES) {
+            cand[j].idx = i;
+            cand[j].score = score;
+            nr_cand = min_t(unsigned int, nr_cand + 1, NR_CANDIDATES);
+        }
+    }
+
+    if (nr_cand == 0)
+        errx(1, "No candidates in fingerprint database %s", fp_db);
+
+    /* Trial decode of each candidate onto a scratch disk. */
+    printf("Candidates:\n");
+    for (i = 0; i < nr_cand; i++) {
+        const char *title = db[cand[i].idx]->title;
+        d = disk_create(NULL, disk_flags | DISKFL_rpm(data_rpm));
+        di = disk_get_info(d);
+        init_analyse_opts(&opts, di);
+        res = memalloc(di->nr_tracks * sizeof(*res));
+        plan = load_plan(title, verbose);
+        damaged = disk_analyse_stream(d, s, plan, &opts, res);
+        printf("  %3u.%u%% \"%s\": %u damaged track%s\n",
+               cand[i].score / 10, cand[i].score % 10, title,
+               damaged, (damaged == 1) ? "" : "s");
+        if (damaged < best_damaged) {
+            best = i;
+            best_damaged = damaged;
+        }
+        format_plan_free(plan);
+        memfree(res);
+        disk_close(d);
+    }
+
+    /* Decode the best candidate into the output disk. */
+    printf("Best match: \"%s\"\n", db[cand[best].idx]->title);
+    if ((d = disk_create(out, disk_flags | DISKFL_rpm(data_rpm))) == NULL)
+        errx(1, "Unable to create new disk file: %s", out);
+    di = disk_get_info(d);
+    init_analyse_opts(&opts, di);
+    res = memalloc(di->nr_tracks * sizeof(*res));
+    plan = load_plan(db[cand[best].idx]->title, 0);
+    (void)disk_analyse_stream(d, s, plan, &opts, res);
+    dump_track_list(d);
+    format_plan_free(plan);
+    memfree(res);
+    disk_close(d);
+
+    for (i = 0; i < nr; i++)
+        disk_fingerprint_free(db[i]);
+    memfree(db);
+    disk_fingerprint_free(dfp);
     stream_close(s);
 }
 
@@ -381,12 +778,26 @@ static void handle_img(void)
     track_free_sector_buffer(sectors);
 }
 
+static void print_counters(void)
+{
+    uint64_t ctrs[ctr_nr];
+    unsigned int i;
+
+    counters_read(ctrs);
+    printf("Counters:\n");
+    for (i = 0; i < ctr_nr; i++)
+        printf("  %-12s %llu\n", counter_name(i),
+               (unsigned long long)ctrs[i]);
+}
+
 int main(int argc, char **argv)
 {
-    char in_suffix[8], out_suffix[8], *config = NULL, *format = NULL;
-    int ch;
+    char in_suffix[8], out_suffix[8], *format = NULL;
+    char *build_db = NULL, *fp_add = NULL, *trace_file = NULL;
+    char *win_stats_file = NULL;
+    int ch, compare = 0, counters = 0;
 
-    const static char sopts[] = "hqviCp:P:r:s:e:S::Dkf:c:";
+    const static char sopts[] = "hqviCp:P:r:R:s:e:S::DkEf:c:j:b:a:F:xm:T:NW:";
     const static struct option lopts[] = {
         { "help", 0, NULL, 'h' },
         { "quiet", 0, NULL, 'q' },
@@ -396,13 +807,24 @@ int main(int argc, char **argv)
         { "pll-period-adj", 1, NULL, 'p' },
         { "pll-phase-adj", 1, NULL, 'P' },
         { "rpm", 1, NULL, 'r' },
+        { "revs", 1, NULL, 'R' },
         { "start-cyl", 1, NULL, 's' },
         { "end-cyl", 1, NULL, 'e' },
         { "ss", 2, NULL, 'S' },
         { "double-step", 0, NULL, 'D' },
         { "kryoflux-hack", 0, NULL, 'k' },
+        { "pipeline", 0, NULL, 'E' },
         { "format", 1, NULL, 'f' },
         { "config",  1, NULL, 'c' },
+        { "jobs", 1, NULL, 'j' },
+        { "build-db", 1, NULL, 'b' },
+        { "fp-add", 1, NULL, 'a' },
+        { "fp-db", 1, NULL, 'F' },
+        { "compare", 0, NULL, 'x' },
+        { "stats", 1, NULL, 'm' },
+        { "trace", 1, NULL, 'T' },
+        { "counters", 0, NULL, 'N' },
+        { "win-stats", 1, NULL, 'W' },
         { 0, 0, 0, 0}
     };
 
@@ -448,6 +870,12 @@ int main(int argc, char **argv)
             }
             break;
         }
+        case 'R':
+            if (parse_revs(optarg) != 0) {
+                warnx("Bad --revs value '%s'", optarg);
+                usage(1);
+            }
+            break;
         case 's':
             start_cyl = atoi(optarg);
             break;
@@ -467,24 +895,98 @@ int main(int argc, char **argv)
         case 'k':
             disk_flags |= DISKFL_kryoflux_hack;
             break;
+        case 'E':
+            disk_flags |= DISKFL_pipeline;
+            break;
         case 'f':
             format = optarg;
             break;
         case 'c':
             config = optarg;
             break;
+        case 'j':
+            nr_jobs = atoi(optarg);
+            if ((nr_jobs < 1) || (nr_jobs > 256)) {
+                warnx("Bad --jobs value '%s'", optarg);
+                usage(1);
+            }
+            break;
+        case 'b':
+            build_db = optarg;
+            break;
+        case 'a':
+            fp_add = optarg;
+            break;
+        case 'F':
+            fp_db = optarg;
+            break;
+        case 'x':
+            compare = 1;
+            break;
+        case 'm':
+            stats_file = optarg;
+            break;
+        case 'T':
+            trace_file = optarg;
+            break;
+        case 'N':
+            counters = 1;
+            break;
+        case 'W':
+            win_stats_file = optarg;
+            break;
         default:
             usage(1);
             break;
         }
     }
 
+    /* Complete the trace however we exit. */
+    if (trace_file) {
+        if (trace_start(trace_file) != 0)
+            exit(1);
+        atexit(trace_stop);
+    }
+
+    if (counters) {
+        uint64_t ctrs[ctr_nr];
+        if (counters_read(ctrs) < 0)
+            warnx("libdisk was built without counters (make counters=y)");
+        else
+            atexit(print_counters);
+    }
+
+    if (build_db) {
+        if (argc != optind)
+            usage(1);
+        return format_plan_compile(config, build_db) ? 1 : 0;
+    }
+
+    if (fp_add) {
+        if (argc != (optind + 1))
+            usage(1);
+        in = argv[optind];
+        fingerprint_add(fp_add);
+        return 0;
+    }
+
     if (argc != (optind + 2))
         usage(1);
 
+    if (nr_jobs == 0) {
+        long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nr_jobs = (nr_cpus > 0) ? min_t(long, nr_cpus, 256) : 1;
+    }
+
     in = argv[optind];
     out = argv[optind+1];
 
+    if (compare)
+        return compare_images();
+
+    if (win_stats_file)
+        win_stats = format_stats_open(win_stats_file);
+
     filename_extension(in, in_suffix, sizeof(in_suffix));
     filename_extension(out, out_suffix, sizeof(out_suffix));
 
@@ -503,17 +1005,27 @@ int main(int argc, char **argv)
         /* Lists all wholly- and partially-matching formats. */
         probe_stream();
 
+    } else if (format && !strcmp(format, "identify")) {
+
+        /* Finds the best-matching title in the fingerprint database. */
+        identify_stream();
+
     } else {
 
-        format_lists = parse_config(config, format);
+        format_lists = load_plan(format, verbose);
 
         if (!strcmp(in_suffix, "img") || !strcmp(in_suffix, "st"))
             handle_img();
         else
             handle_stream();
 
+        format_plan_free(format_lists);
+
     }
 
+    if (win_stats)
+        format_stats_close(win_stats);
+
     return 0;
 }
 
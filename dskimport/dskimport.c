@@ -0,0 +1,169 @@
+/*
+ * dskimport/dskimport.c
+ *
+ * Bulk-import disk images into a directory of reference (.dskref) images,
+ * whose track data is deduplicated in a shared dskpool/ beneath it.
+ *
+ * Written in 2026 by agent
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <getopt.h>
+
+#include <libdisk/disk.h>
+#include <libdisk/util.h>
+
+static int quiet;
+
+struct pool_usage {
+    unsigned long objects;
+    unsigned long long bytes;
+};
+
+static void usage(int rc)
+{
+    printf("Usage: dskimport [options] out_dir in_image...\n");
+    printf("Each in_image is copied to out_dir/<name>.dskref.\n");
+    printf("Options:\n");
+    printf("  -h, --help    Display this information\n");
+    printf("  -q, --quiet   Report only the summary\n");
+
+    exit(rc);
+}
+
+/* Walk the two levels of out_dir/dskpool/xx/<object>. */
+static void pool_usage(const char *dir, struct pool_usage *pu, int depth)
+{
+    char path[strlen(dir) + 260];
+    struct dirent *ent;
+    struct stat st;
+    DIR *d;
+
+    if ((d = opendir(dir)) == NULL)
+        return;
+
+    while ((ent = readdir(d)) != NULL) {
+        if (ent->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        if (stat(path, &st) != 0)
+            continue;
+        if (S_ISDIR(st.st_mode) && (depth == 0)) {
+            pool_usage(path, pu, 1);
+        } else if (S_ISREG(st.st_mode) && (depth == 1)) {
+            pu->objects++;
+            pu->bytes += st.st_size;
+        }
+    }
+
+    closedir(d);
+}
+
+static char *out_name(const char *out_dir, const char *in)
+{
+    const char *base = strrchr(in, '/'), *dot;
+    char *name;
+    int len;
+
+    base = base ? base + 1 : in;
+    dot = strrchr(base, '.');
+    len = dot ? dot - base : strlen(base);
+
+    name = memalloc(strlen(out_dir) + len + sizeof("/.dskref"));
+    sprintf(name, "%s/%.*s.dskref", out_dir, len, base);
+    return name;
+}
+
+int main(int argc, char **argv)
+{
+    struct disk *src, *dst;
+    struct disk_info *di;
+    struct pool_usage before = { 0 }, after = { 0 };
+    unsigned long long track_bytes = 0;
+    unsigned int i, nr_images = 0, nr_failed = 0, nr_tracks = 0;
+    char *out_dir, *pool, *name;
+    int ch;
+
+    const static char sopts[] = "hq";
+    const static struct option lopts[] = {
+        { "help", 0, NULL, 'h' },
+        { "quiet", 0, NULL, 'q' },
+        { 0, 0, 0, 0 }
+    };
+
+    while ((ch = getopt_long(argc, argv, sopts, lopts, NULL)) != -1) {
+        switch (ch) {
+        case 'h':
+            usage(0);
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        default:
+            usage(1);
+            break;
+        }
+    }
+
+    if ((argc - optind) < 2)
+        usage(1);
+
+    out_dir = argv[optind];
+    pool = memalloc(strlen(out_dir) + sizeof("/dskpool"));
+    sprintf(pool, "%s/dskpool", out_dir);
+    pool_usage(pool, &before, 0);
+
+    for (optind++; optind < argc; optind++) {
+        if ((src = disk_open(argv[optind], DISKFL_read_only)) == NULL) {
+            nr_failed++;
+            continue;
+        }
+        name = out_name(out_dir, argv[optind]);
+        if ((dst = disk_create(name, 0)) == NULL) {
+            disk_close(src);
+            memfree(name);
+            nr_failed++;
+            continue;
+        }
+
+        disk_copy(dst, src);
+        di = disk_get_info(dst);
+        for (i = 0; i < di->nr_tracks; i++)
+            track_bytes += di->track[i].len;
+        nr_tracks += di->nr_tracks;
+        nr_images++;
+
+        disk_close(dst);
+        disk_close(src);
+        if (!quiet)
+            printf("%s -> %s\n", argv[optind], name);
+        memfree(name);
+    }
+
+    pool_usage(pool, &after, 0);
+    memfree(pool);
+
+    printf("Imported %u images (%u failed), %u tracks, %llu bytes "
+           "of track data\n", nr_images, nr_failed, nr_tracks, track_bytes);
+    printf("Pool gained %lu objects, %llu bytes (now %lu, %llu bytes)\n",
+           after.objects - before.objects, after.bytes - before.bytes,
+           after.objects, after.bytes);
+
+    return nr_failed ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,122 @@
+/*
+ * analyse.c
+ *
+ * Decode a flux stream into a disk image according to a format plan.
+ *
+ * Written in 2026 by agent
+ */
+
+#include <libdisk/util.h>
+#include <libdisk/analyse.h>
+#include <private/disk.h>
+
+/* Tracks 160+ are expected to be unused. Don't warn about them. */
+#define NR_EXPECTED_TRACKS 160
+
+/* Index into @list of the @j'th format to try. The last format to match is
+ * tried first. Then the rest follow round-robin from there, or in the order
+ * bound to @stats if given. */
+static unsigned int trial_index(
+    const struct format_list *list, unsigned int j,
+    struct format_stats *stats)
+{
+    if (stats != NULL)
+        return format_stats_trial(stats, list, j);
+    return (list->pos + j) % list->nr;
+}
+
+unsigned int disk_analyse_stream(
+    struct disk *d, struct stream *s, struct format_list **plan,
+    const struct analyse_opts *opts, struct analyse_track *res)
+{
+    struct disk_info *di = d->di;
+    struct track_info *ti;
+    struct analyse_track *r;
+    unsigned int i, j, k, end, step, damaged = 0;
+    uint64_t t, t0, span, nr_bits, nr_flux;
+    bool_t won;
+
+    end = min_t(unsigned int, opts->end_track, di->nr_tracks - 1);
+    step = opts->step ?: 1;
+
+    memset(res, 0, di->nr_tracks * sizeof(*res));
+    stream_set_track_order(s, opts->start_track, end, step);
+    if (opts->stats != NULL)
+        format_stats_bind(opts->stats, plan);
+
+    for (i = opts->start_track; i <= end; i += step) {
+        struct format_list *list = (i < FORMAT_PLAN_TRACKS) ? plan[i] : NULL;
+        ti = &di->track[i];
+        r = &res[i];
+        t = time_ns();
+        span = trace_begin();
+        nr_bits = s->nr_bits;
+        nr_flux = s->nr_flux;
+        /* Finish with the track before a pipeline may start encoding it. */
+        pipeline_hold(d, i);
+        if (list != NULL) {
+            for (j = 0; j < list->nr; j++) {
+                k = trial_index(list, j, opts->stats);
+                r->attempts++;
+                t0 = (opts->stats != NULL) ? time_ns() : 0;
+                won = (track_write_raw_from_stream(
+                           d, i, list->ent[k], s) == 0);
+                if (opts->stats != NULL)
+                    format_stats_record(opts->stats, list, k, won,
+                                        time_ns() - t0);
+                if (won) {
+                    if (opts->stats == NULL)
+                        list->pos = k;
+                    break;
+                }
+                r->revs = max_t(unsigned int, r->revs, s->decode_index);
+            }
+            if (j != list->nr) {
+                r->status = ANALYSE_ok;
+                r->revs = s->decode_index;
+            } else if (track_write_raw_from_stream(
+                           d, i, TRKTYP_unformatted, s) == 0) {
+                r->status = ANALYSE_unformatted;
+            } else if (i < NR_EXPECTED_TRACKS) {
+                r->status = ANALYSE_unidentified;
+                damaged++;
+            } else {
+                track_mark_unformatted(d, i);
+                r->status = ANALYSE_unformatted;
+            }
+        }
+        r->type = ti->type;
+        r->nr_sectors = ti->nr_sectors;
+        memcpy(r->valid_sectors, ti->valid_sectors, sizeof(r->valid_sectors));
+        if (opts->flags & ANALYSE_index_align)
+            ti->data_bitoff = 1024;
+        for (j = 0; j < ti->nr_sectors; j++)
+            if (!is_valid_sector(ti, j))
+                r->nr_bad_sectors++;
+        if (r->nr_bad_sectors != 0) {
+            if (r->status == ANALYSE_ok)
+                r->status = ANALYSE_bad_sectors;
+            damaged++;
+            if (opts->flags & ANALYSE_clear_bad_sectors)
+                set_all_sectors_valid(ti);
+        }
+        pipeline_release(d);
+        trace_end(span, "analyse", "track", i, NULL);
+        r->density_ns = stream_get_density(s);
+        r->nr_bits = s->nr_bits - nr_bits;
+        r->nr_flux = s->nr_flux - nr_flux;
+        r->time_ns = time_ns() - t;
+    }
+
+    return damaged;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,879 @@
+/*
+ * config.c
+ * 
+ * Parse config file which defines allowed formats for particular disks.
+ * 
+ * Written in 2011 by Keir Fraser
+ *
+ * Moved into libdisk in 2026 by agent
+ */
+
+#include <stdint.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <setjmp.h>
+#include <sys/stat.h>
+#include <libdisk/disk.h>
+#include <libdisk/analyse.h>
+#include <libdisk/util.h>
+#include <private/util.h>
+
+#define NR_TRACKS FORMAT_PLAN_TRACKS
+
+#define DEF_DIR PREFIX "/share/disk-analyse"
+#define DEF_FIL "formats"
+
+struct token {
+    enum { STR, NUM, CHR, EOL } type;
+    union {
+        char str[128];
+        struct {
+            unsigned int start, end, step;
+        } num;
+        int ch;
+    } u;
+};
+
+struct file_info {
+    FILE *f;
+    /* If f is NULL, read from an in-memory buffer instead. */
+    const char *buf;
+    uint32_t pos, len;
+    char *name;
+    unsigned int line;
+    uint32_t src; /* format_plan_compile(): index into database sources */
+    jmp_buf *fail; /* parse_err() unwinds to here */
+    struct file_info *next;
+};
+
+static void parse_err(struct file_info *fi, const char *f, ...)
+{
+    char errs[128];
+    va_list args;
+
+    va_start(args, f);
+    vsnprintf(errs, sizeof(errs), f, args);
+    va_end(args);
+
+    warnx("error at %s:%u: %s", fi->name, fi->line, errs);
+    longjmp(*fi->fail, 1);
+}
+
+static int mygetc(struct file_info *fi)
+{
+    int c = fi->f ? fgetc(fi->f)
+        : (fi->pos < fi->len) ? (uint8_t)fi->buf[fi->pos++] : EOF;
+    if (c == '\n')
+        fi->line++;
+    return c;
+}
+
+static void myungetc(struct file_info *fi, int c)
+{
+    if (c == '\n')
+        fi->line--;
+    if (fi->f)
+        ungetc(c, fi->f);
+    else if (c != EOF)
+        fi->pos--;
+}
+
+static void parse_token(struct file_info *fi, struct token *t)
+{
+    int c;
+
+    while (isspace(c = mygetc(fi)) && (c != '\n'))
+        continue;
+
+retry:
+    if (isdigit(c)) {
+        t->type = NUM;
+        t->u.num.start = c - '0';
+        while (isdigit(c = mygetc(fi)))
+            t->u.num.start = t->u.num.start * 10 + c - '0';
+        t->u.num.end = t->u.num.start;
+        t->u.num.step = 1;
+        if (c == '-') {
+            t->u.num.end = 0;
+            while (isdigit(c = mygetc(fi)))
+                t->u.num.end = t->u.num.end * 10 + c - '0';
+            if (t->u.num.end < t->u.num.start)
+                parse_err(fi, "bad range %u-%u", t->u.num.start, t->u.num.end);
+        }
+        if (c == '/') {
+            t->u.num.step = 0;
+            while (isdigit(c = mygetc(fi)))
+                t->u.num.step = t->u.num.step * 10 + c - '0';
+        }
+        myungetc(fi, c);
+    } else if (c == '"') {
+        char *p = t->u.str;
+        t->type = STR;
+        while ((c = mygetc(fi)) != '"') {
+            if ((c == '\n') || (c == '\r') || (c == EOF))
+                parse_err(fi, "unexpected newline or end-of-file in string");
+            *p++ = c;
+            if ((p - t->u.str) >= (sizeof(t->u.str)-1))
+                parse_err(fi, "string too long");
+        }
+        *p = '\0';
+    } else if (isalpha(c)) {
+        char *p = t->u.str;
+        t->type = STR;
+        *p++ = c;
+        while (isalnum(c = mygetc(fi)) || (c == '_')) {
+            *p++ = c;
+            if ((p - t->u.str) >= (sizeof(t->u.str)-1))
+                parse_err(fi, "string too long");
+        }
+        *p = '\0';
+        myungetc(fi, c);
+    } else if (c == '\\') { /* ignore EOL at line break */
+        while (isspace(c = mygetc(fi)) && (c != '\n'))
+            continue;
+        if (c != '\n')
+            parse_err(fi, "expected newline after backslash");
+        while (isspace(c = mygetc(fi)) && (c != '\n'))
+            continue;
+        goto retry;
+    } else if (c == '#') { /* ignore until EOL */
+        while (((c = mygetc(fi)) != EOF) && (c != '\n'))
+            continue;
+        goto retry;
+    } else if ((c == EOF) || (c == '\n')) {
+        t->type = EOL;
+        t->u.ch = c;
+    } else {
+        t->type = CHR;
+        t->u.ch = c;
+    }
+}
+
+static struct file_info *open_file(const char *name)
+{
+    struct file_info *fi = memalloc(sizeof(*fi));
+
+    fi->line = 1;
+
+    if (name[0] != '/') {
+        char *path;
+        if ((path = getcwd(NULL, 0)) == NULL) {
+            memfree(fi);
+            return NULL;
+        }
+        fi->name = memalloc(strlen(path) + strlen(name) + 2);
+        sprintf(fi->name, "%s/%s", path, name);
+        free(path);
+        if ((fi->f = fopen(fi->name, "r")) == NULL) {
+            memfree(fi->name);
+            fi->name = memalloc(strlen(DEF_DIR) + strlen(name) + 2);
+            sprintf(fi->name, "%s/%s", DEF_DIR, name);
+            fi->f = fopen(fi->name, "r");
+        }
+    } else {
+        fi->name = memalloc(strlen(name) + 1);
+        strcpy(fi->name, name);
+        fi->f = fopen(fi->name, "r");
+    }
+
+    if (fi->f == NULL) {
+        memfree(fi->name);
+        memfree(fi);
+        fi = NULL;
+    }
+
+    return fi;
+}
+
+static void close_file(struct file_info *fi)
+{
+    if (fi->f != NULL)
+        fclose(fi->f);
+    memfree(fi->name);
+    memfree(fi);
+}
+
+static struct format_list *realloc_format_list(struct format_list *old)
+{
+    struct format_list *list;
+    unsigned int max = old ? old->max*2 : 4;
+    list = memalloc(sizeof(*list) + (max-1)*2);
+    if (old) {
+        memcpy(list, old, sizeof(*list) + (old->max-1)*2);
+        memfree(old);
+    }
+    list->max = max;
+    return list;
+}
+
+/* Parse the body of a format definition, starting at the end of its title
+ * line. */
+static struct format_list **parse_plan(struct file_info *fi, struct token *t)
+{
+    unsigned int i;
+    struct format_list **formats, ignore_list;
+    struct format_list *volatile list = NULL;
+    jmp_buf fail, *outer = fi->fail;
+
+    formats = memalloc(NR_TRACKS * sizeof(*formats));
+
+    /* On error free the partial plan, including any list not yet in it. */
+    if (setjmp(fail)) {
+        if (list != &ignore_list)
+            memfree(list);
+        for (i = 0; i < NR_TRACKS; i++)
+            if (formats[i] == &ignore_list)
+                formats[i] = NULL;
+        format_plan_free(formats);
+        fi->fail = outer;
+        longjmp(*outer, 1);
+    }
+    fi->fail = &fail;
+
+    for (;;) {
+        unsigned int start, end, step;
+        list = realloc_format_list(NULL);
+
+        while (t->type != EOL)
+            parse_token(fi, t);
+        parse_token(fi, t);
+        if ((t->type == CHR) && (t->u.ch == '*')) {
+            t->type = NUM;
+            t->u.num.start = 0;
+            t->u.num.end = NR_TRACKS-1;
+            t->u.num.step = 1;
+        }
+        if (t->type != NUM) {
+            memfree(list);
+            list = NULL;
+            break;
+        }
+        start = t->u.num.start;
+        end = t->u.num.end;
+        step = t->u.num.step;
+        if ((start >= NR_TRACKS) || (end >= NR_TRACKS))
+            parse_err(fi, "bad track range %u-%u", start, end);
+        for (;;) {
+            int type;
+            parse_token(fi, t);
+            if (t->type == EOL)
+                break;
+            if (list == &ignore_list)
+                parse_err(fi, "'ignore' must be sole format specifier");
+            if (t->type != STR)
+                parse_err(fi, "expected format string");
+            if (!strcmp("ignore", t->u.str)) {
+                if (list->nr != 0)
+                    parse_err(fi, "'ignore' must be sole format specifier");
+                memfree(list);
+                list = &ignore_list;
+            } else {
+                if ((type = disk_get_format_id_by_name(t->u.str)) < 0)
+                    parse_err(fi, "bad format name \"%s\"", t->u.str);
+                if (list->nr == list->max)
+                    list = realloc_format_list(list);
+                list->ent[list->nr++] = type;
+            }
+        }
+        if ((list->nr == 0) && (list != &ignore_list))
+            parse_err(fi, "empty format list");
+        for (i = start; i <= end; i += step)
+            if (formats[i] == NULL)
+                formats[i] = list;
+        list = NULL;
+    }
+
+    for (i = 0; i < NR_TRACKS; i++) {
+        if (formats[i] == NULL)
+            parse_err(fi, "no format specified for track %u", i);
+        if (formats[i] == &ignore_list)
+            formats[i] = NULL;
+    }
+
+    fi->fail = outer;
+    return formats;
+}
+
+/*
+ * Compiled formats database: the title lines of a config file and all its
+ * INCLUDEs, flattened into a single sequence of records in file order and
+ * hashed by title. A lookup therefore follows "title = alias" chains
+ * forwards through the sequence exactly as the text parser does. The body
+ * of each definition is stored verbatim and parsed only when it is used.
+ * All fields are little endian.
+ */
+#define FMTDB_MAGIC   "DAFMTDB"
+#define FMTDB_VERSION 1
+#define FMTDB_NONE    (~0u)
+
+struct fmtdb_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t names_crc; /* crc32 of all track type id names */
+    uint32_t nr_srcs, nr_recs, hash_size, strs_len;
+    /* Followed by: srcs[nr_srcs], recs[nr_recs], hash[hash_size], strs[] */
+};
+
+/* Source file, for staleness checks. */
+struct fmtdb_src {
+    uint32_t name; /* as named on the command line or by INCLUDE */
+    uint32_t size, mtime;
+};
+
+enum { FMTDB_alias, FMTDB_warn, FMTDB_def };
+
+struct fmtdb_rec {
+    uint32_t title, next; /* next: next record in same hash chain */
+    uint32_t kind, src, line;
+    uint32_t dat, dat_len; /* alias target, warning, or definition body */
+};
+
+struct fmtdb {
+    const char *name;
+    const struct fmtdb_header *hdr;
+    const struct fmtdb_src *srcs;
+    const struct fmtdb_rec *recs;
+    const uint32_t *hash;
+    const char *strs;
+};
+
+static uint32_t format_names_crc(void)
+{
+    const char *name;
+    uint32_t crc = 0;
+    unsigned int i;
+    for (i = 0; (name = disk_get_format_id_name(i)) != NULL; i++)
+        crc = crc32_add(name, strlen(name) + 1, crc);
+    return crc;
+}
+
+static uint32_t title_hash(const char *title, uint32_t hash_size)
+{
+    return crc32(title, strlen(title)) & (hash_size - 1);
+}
+
+static int stat_config(const char *name, uint32_t *size, uint32_t *mtime)
+{
+    struct file_info *fi;
+    struct stat st;
+    int rc = -1;
+
+    if ((fi = open_file(name)) == NULL)
+        return -1;
+    if (fstat(fileno(fi->f), &st) == 0) {
+        *size = st.st_size;
+        *mtime = st.st_mtime;
+        rc = 0;
+    }
+    close_file(fi);
+    return rc;
+}
+
+static const char *db_str(const struct fmtdb *db, uint32_t off)
+{
+    return (off < le32toh(db->hdr->strs_len)) ? db->strs + off : NULL;
+}
+
+/* Validate the database header and its freshness against its sources. */
+static int db_init(struct fmtdb *db, const void *p, size_t size)
+{
+    const struct fmtdb_header *hdr = p;
+    uint32_t i, nr_srcs, nr_recs, hash_size, strs_len, sz, mtime;
+    uint64_t len;
+
+    if ((size < sizeof(*hdr)) || memcmp(hdr->magic, FMTDB_MAGIC, 8)
+        || (le32toh(hdr->version) != FMTDB_VERSION)
+        || (le32toh(hdr->names_crc) != format_names_crc()))
+        return -1;
+
+    nr_srcs = le32toh(hdr->nr_srcs);
+    nr_recs = le32toh(hdr->nr_recs);
+    hash_size = le32toh(hdr->hash_size);
+    strs_len = le32toh(hdr->strs_len);
+    len = sizeof(*hdr) + (uint64_t)nr_srcs * sizeof(struct fmtdb_src)
+        + (uint64_t)nr_recs * sizeof(struct fmtdb_rec)
+        + (uint64_t)hash_size * sizeof(uint32_t) + strs_len;
+    if ((len != size) || (hash_size == 0) || (hash_size & (hash_size-1))
+        || (strs_len == 0) || (nr_srcs == 0))
+        return -1;
+
+    db->hdr = hdr;
+    db->srcs = (const struct fmtdb_src *)(hdr + 1);
+    db->recs = (const struct fmtdb_rec *)(db->srcs + nr_srcs);
+    db->hash = (const uint32_t *)(db->recs + nr_recs);
+    db->strs = (const char *)(db->hash + hash_size);
+    if (db->strs[strs_len-1] != '\0')
+        return -1;
+
+    for (i = 0; i < nr_srcs; i++) {
+        const char *name = db_str(db, le32toh(db->srcs[i].name));
+        if ((name == NULL) || stat_config(name, &sz, &mtime)
+            || (sz != le32toh(db->srcs[i].size))
+            || (mtime != le32toh(db->srcs[i].mtime)))
+            return -1;
+    }
+
+    return 0;
+}
+
+static const struct fmtdb_rec *db_find(
+    const struct fmtdb *db, const char *title, uint32_t seq)
+{
+    uint32_t nr_recs = le32toh(db->hdr->nr_recs);
+    uint32_t hash_size = le32toh(db->hdr->hash_size);
+    uint32_t i = le32toh(db->hash[title_hash(title, hash_size)]), next;
+    const char *t;
+
+    /* Chains run forwards through the records: stop at any that do not. */
+    for (; i < nr_recs; i = next) {
+        t = db_str(db, le32toh(db->recs[i].title));
+        if ((i >= seq) && (t != NULL) && !strcmp(t, title))
+            return &db->recs[i];
+        if ((next = le32toh(db->recs[i].next)) <= i)
+            break;
+    }
+
+    return NULL;
+}
+
+/* Look up @spec in a compiled database, returning the plan in @pformats.
+ * Returns 1 if the database is missing or out of date with respect to its
+ * sources, or -1 (with a warning) on error. */
+static int db_parse(
+    const char *dbname, const char *spec, int verbose,
+    struct format_list ***pformats)
+{
+    const struct fmtdb_rec *rec;
+    struct file_info fi;
+    struct fmtdb db;
+    struct token t;
+    uint32_t seq = 0;
+    jmp_buf fail;
+    size_t size;
+    int rc = -1;
+    void *p;
+
+    if ((p = map_file(dbname, &size)) == NULL)
+        return 1;
+    if (db_init(&db, p, size) != 0) {
+        if (verbose)
+            printf("Ignoring stale formats database %s\n", dbname);
+        rc = 1;
+        goto out;
+    }
+
+    for (;;) {
+        const char *dat;
+        if ((rec = db_find(&db, spec, seq)) == NULL) {
+            warnx("error in %s: no match for \"%s\"", dbname, spec);
+            goto out;
+        }
+        seq = (rec - db.recs) + 1;
+        if ((dat = db_str(&db, le32toh(rec->dat))) == NULL)
+            goto bad;
+        switch (le32toh(rec->kind)) {
+        case FMTDB_alias:
+            if (verbose)
+                printf("Format \"%s\" -> \"%s\"\n", spec, dat);
+            spec = dat;
+            break;
+        case FMTDB_warn:
+            printf("*** WARNING: %s\n", dat);
+            break;
+        case FMTDB_def:
+            if (verbose)
+                printf("Found format \"%s\"\n", spec);
+            memset(&fi, 0, sizeof(fi));
+            fi.buf = dat;
+            fi.len = min_t(uint32_t, le32toh(rec->dat_len),
+                           le32toh(db.hdr->strs_len) - le32toh(rec->dat));
+            fi.name = (char *)db_str(&db, le32toh(
+                db.srcs[min_t(uint32_t, le32toh(rec->src),
+                              le32toh(db.hdr->nr_srcs)-1)].name));
+            if (fi.name == NULL)
+                fi.name = (char *)dbname;
+            fi.line = le32toh(rec->line);
+            fi.fail = &fail;
+            t.type = EOL;
+            if (!setjmp(fail)) {
+                *pformats = parse_plan(&fi, &t);
+                rc = 0;
+            }
+            goto out;
+        default:
+            goto bad;
+        }
+    }
+
+bad:
+    warnx("error in %s: bad record", dbname);
+out:
+    unmap_file(p, size);
+    return rc;
+}
+
+struct format_list **format_plan_parse(
+    const char *config, const char *specifier, int verbose)
+{
+    struct format_list **formats = NULL;
+    struct file_info *volatile fi;
+    struct token t;
+    char *volatile spec;
+    char *dbname;
+    jmp_buf fail;
+    int rc;
+
+    if (specifier == NULL)
+        specifier = "default";
+
+    if ((fi = open_file(config ? : DEF_FIL)) == NULL) {
+        warnx("could not open config file \"%s\"", config ? : DEF_FIL);
+        return NULL;
+    }
+
+    /* Prefer an up-to-date compiled database alongside the config file. */
+    dbname = memalloc(strlen(fi->name) + 4);
+    sprintf(dbname, "%s.db", fi->name);
+    rc = db_parse(dbname, specifier, verbose, &formats);
+    memfree(dbname);
+    if (rc <= 0) {
+        close_file(fi);
+        return formats;
+    }
+
+    spec = memalloc(strlen(specifier)+1);
+    strcpy(spec, specifier);
+
+    if (setjmp(fail))
+        goto out;
+    fi->fail = &fail;
+
+    for (;;) {
+        parse_token(fi, &t);
+        if ((t.type == EOL) && (t.u.ch == EOF)) {
+            struct file_info *fi2 = fi->next;
+            if (fi2 == NULL)
+                parse_err(fi, "no match for \"%s\"", spec);
+            close_file(fi);
+            fi = fi2;
+        } else if (t.type != STR) {
+            /* nothing */
+        } else if (!strcmp("INCLUDE", t.u.str)) {
+            struct file_info *fi2;
+            parse_token(fi, &t);
+            if (t.type != STR)
+                parse_err(fi, "expected string after INCLUDE");
+            if ((fi2 = open_file(t.u.str)) == NULL)
+                parse_err(fi, "could not open config file \"%s\"", t.u.str);
+            fi2->fail = fi->fail;
+            fi2->next = fi;
+            fi = fi2;
+            t.type = EOL;
+        } else if (!strcmp(spec, t.u.str)) {
+            parse_token(fi, &t);
+            if ((t.type == CHR) && (t.u.ch == '=')) {
+                parse_token(fi, &t);
+                if (t.type != STR)
+                    parse_err(fi, "expected string after =");
+                if (verbose)
+                    printf("Format \"%s\" -> \"%s\"\n", spec, t.u.str);
+                memfree(spec);
+                spec = memalloc(strlen(t.u.str)+1);
+                strcpy(spec, t.u.str);
+            } else if ((t.type == STR) && !strcmp(t.u.str, "WARN")) {
+                while (t.type != EOL)
+                    parse_token(fi, &t);
+                parse_token(fi, &t);
+                if (t.type != STR)
+                    parse_err(fi, "expected string after WARN");
+                printf("*** WARNING: %s\n", t.u.str);
+            } else {
+                break;
+            }
+        }
+        while (t.type != EOL)
+            parse_token(fi, &t);
+    }
+
+    if (verbose)
+        printf("Found format \"%s\"\n", spec);
+    formats = parse_plan(fi, &t);
+
+out:
+    memfree(spec);
+    while (fi != NULL) {
+        struct file_info *fi2 = fi->next;
+        close_file(fi);
+        fi = fi2;
+    }
+
+    return formats;
+}
+
+/* Builder state for format_plan_compile(). */
+struct fmtdb_build {
+    struct fmtdb_src *srcs;
+    struct fmtdb_rec *recs;
+    char *strs;
+    uint32_t nr_srcs, nr_recs, strs_len;
+    unsigned int max_srcs, max_recs;
+    uint32_t max_strs;
+};
+
+static uint32_t add_str(struct fmtdb_build *b, const char *s, uint32_t len)
+{
+    uint32_t off = b->strs_len;
+    if (off + len + 1 > b->max_strs) {
+        char *strs = b->strs;
+        b->max_strs = max_t(uint32_t, b->max_strs * 2, off + len + 1);
+        b->strs = memalloc(b->max_strs);
+        memcpy(b->strs, strs, off);
+        memfree(strs);
+    }
+    memcpy(b->strs + off, s, len);
+    b->strs[off + len] = '\0';
+    b->strs_len += len + 1;
+    return off;
+}
+
+static uint32_t add_src(struct fmtdb_build *b, const char *name)
+{
+    struct fmtdb_src *src;
+    uint32_t size, mtime;
+    if (stat_config(name, &size, &mtime) != 0)
+        size = mtime = 0; /* never matches: the database will be stale */
+    b->srcs = memgrow(b->srcs, &b->max_srcs, b->nr_srcs, sizeof(*src));
+    src = &b->srcs[b->nr_srcs];
+    src->name = add_str(b, name, strlen(name));
+    src->size = size;
+    src->mtime = mtime;
+    return b->nr_srcs++;
+}
+
+static struct fmtdb_rec *add_rec(
+    struct fmtdb_build *b, const char *title, uint32_t kind,
+    uint32_t src, uint32_t line)
+{
+    struct fmtdb_rec *rec;
+    b->recs = memgrow(b->recs, &b->max_recs, b->nr_recs, sizeof(*rec));
+    rec = &b->recs[b->nr_recs++];
+    memset(rec, 0, sizeof(*rec));
+    rec->title = add_str(b, title, strlen(title));
+    rec->kind = kind;
+    rec->src = src;
+    rec->line = line;
+    return rec;
+}
+
+int format_plan_compile(const char *config, const char *dbname)
+{
+    struct fmtdb_build *b = memalloc(sizeof(*b));
+    struct fmtdb_header hdr;
+    struct file_info *volatile fi;
+    struct token t;
+    uint32_t i, h, *hash, *tail, hash_size;
+    jmp_buf fail;
+    int rc = -1;
+    FILE *f;
+
+    if ((fi = open_file(config ? : DEF_FIL)) == NULL) {
+        warnx("could not open config file \"%s\"", config ? : DEF_FIL);
+        goto out;
+    }
+    fi->src = add_src(b, config ? : DEF_FIL);
+
+    /* parse_err() has reported the error. */
+    if (setjmp(fail)) {
+        while (fi != NULL) {
+            struct file_info *fi2 = fi->next;
+            close_file(fi);
+            fi = fi2;
+        }
+        goto out;
+    }
+    fi->fail = &fail;
+
+    /* Walk the title lines in the same order as format_plan_parse(). */
+    for (;;) {
+        parse_token(fi, &t);
+        if ((t.type == EOL) && (t.u.ch == EOF)) {
+            struct file_info *fi2 = fi->next;
+            close_file(fi);
+            if ((fi = fi2) == NULL)
+                break;
+        } else if (t.type != STR) {
+            /* nothing */
+        } else if (!strcmp("INCLUDE", t.u.str)) {
+            struct file_info *fi2;
+            parse_token(fi, &t);
+            if (t.type != STR)
+                parse_err(fi, "expected string after INCLUDE");
+            if ((fi2 = open_file(t.u.str)) == NULL)
+                parse_err(fi, "could not open config file \"%s\"", t.u.str);
+            fi2->src = add_src(b, t.u.str);
+            fi2->fail = fi->fail;
+            fi2->next = fi;
+            fi = fi2;
+            t.type = EOL;
+        } else {
+            char title[sizeof(t.u.str)];
+            struct fmtdb_rec *rec;
+            unsigned int line = fi->line;
+            strcpy(title, t.u.str);
+            parse_token(fi, &t);
+            if ((t.type == CHR) && (t.u.ch == '=')) {
+                parse_token(fi, &t);
+                if (t.type != STR)
+                    parse_err(fi, "expected string after =");
+                rec = add_rec(b, title, FMTDB_alias, fi->src, line);
+                rec->dat = add_str(b, t.u.str, strlen(t.u.str));
+            } else if ((t.type == STR) && !strcmp(t.u.str, "WARN")) {
+                while (t.type != EOL)
+                    parse_token(fi, &t);
+                parse_token(fi, &t);
+                if (t.type != STR)
+                    parse_err(fi, "expected string after WARN");
+                rec = add_rec(b, title, FMTDB_warn, fi->src, line);
+                rec->dat = add_str(b, t.u.str, strlen(t.u.str));
+            } else {
+                /* Definition: the body is every following line which
+                 * starts with a track range. Stop at the first line which
+                 * does not, and rewind so that it is scanned as normal. */
+                long start, end;
+                char *body;
+                while (t.type != EOL)
+                    parse_token(fi, &t);
+                rec = add_rec(b, title, FMTDB_def, fi->src, fi->line);
+                start = ftell(fi->f);
+                for (;;) {
+                    long pos = ftell(fi->f);
+                    unsigned int l = fi->line;
+                    parse_token(fi, &t);
+                    if ((t.type != NUM)
+                        && ((t.type != CHR) || (t.u.ch != '*'))) {
+                        fseek(fi->f, pos, SEEK_SET);
+                        fi->line = l;
+                        break;
+                    }
+                    while (t.type != EOL)
+                        parse_token(fi, &t);
+                }
+                end = ftell(fi->f);
+                body = memalloc(end - start);
+                fseek(fi->f, start, SEEK_SET);
+                if (fread(body, 1, end - start, fi->f)
+                    != (size_t)(end - start)) {
+                    memfree(body);
+                    parse_err(fi, "read error");
+                }
+                rec->dat = add_str(b, body, end - start);
+                rec->dat_len = end - start;
+                memfree(body);
+                t.type = EOL;
+            }
+        }
+        while (t.type != EOL)
+            parse_token(fi, &t);
+    }
+
+    /* Hash chains are kept in sequence order. */
+    for (hash_size = 64; hash_size < b->nr_recs * 2; hash_size *= 2)
+        continue;
+    hash = memalloc(hash_size * sizeof(*hash));
+    tail = memalloc(hash_size * sizeof(*tail));
+    memset(hash, 0xff, hash_size * sizeof(*hash));
+    for (i = 0; i < b->nr_recs; i++) {
+        struct fmtdb_rec *rec = &b->recs[i];
+        h = title_hash(b->strs + rec->title, hash_size);
+        rec->next = FMTDB_NONE;
+        if (hash[h] == FMTDB_NONE)
+            hash[h] = i;
+        else
+            b->recs[tail[h]].next = htole32(i);
+        tail[h] = i;
+    }
+    for (i = 0; i < b->nr_recs; i++) {
+        struct fmtdb_rec *rec = &b->recs[i];
+        rec->title = htole32(rec->title);
+        rec->kind = htole32(rec->kind);
+        rec->src = htole32(rec->src);
+        rec->line = htole32(rec->line);
+        rec->dat = htole32(rec->dat);
+        rec->dat_len = htole32(rec->dat_len);
+    }
+    for (i = 0; i < b->nr_srcs; i++) {
+        struct fmtdb_src *s = &b->srcs[i];
+        s->name = htole32(s->name);
+        s->size = htole32(s->size);
+        s->mtime = htole32(s->mtime);
+    }
+    for (i = 0; i < hash_size; i++)
+        hash[i] = htole32(hash[i]);
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, FMTDB_MAGIC, 8);
+    hdr.version = htole32(FMTDB_VERSION);
+    hdr.names_crc = htole32(format_names_crc());
+    hdr.nr_srcs = htole32(b->nr_srcs);
+    hdr.nr_recs = htole32(b->nr_recs);
+    hdr.hash_size = htole32(hash_size);
+    hdr.strs_len = htole32(b->strs_len);
+
+    if ((f = fopen(dbname, "wb")) == NULL) {
+        warn("%s", dbname);
+    } else {
+        fwrite(&hdr, sizeof(hdr), 1, f);
+        fwrite(b->srcs, sizeof(*b->srcs), b->nr_srcs, f);
+        fwrite(b->recs, sizeof(*b->recs), b->nr_recs, f);
+        fwrite(hash, sizeof(*hash), hash_size, f);
+        fwrite(b->strs, 1, b->strs_len, f);
+        if (ferror(f) | fclose(f))
+            warn("%s", dbname);
+        else
+            rc = 0;
+    }
+
+    memfree(hash);
+    memfree(tail);
+out:
+    memfree(b->srcs);
+    memfree(b->recs);
+    memfree(b->strs);
+    memfree(b);
+    return rc;
+}
+
+void format_plan_free(struct format_list **plan)
+{
+    unsigned int i, j;
+
+    if (plan == NULL)
+        return;
+
+    /* Lists are shared by ranges of tracks: free each one only once. */
+    for (i = 0; i < NR_TRACKS; i++) {
+        struct format_list *list = plan[i];
+        if (list == NULL)
+            continue;
+        for (j = i; j < NR_TRACKS; j++)
+            if (plan[j] == list)
+                plan[j] = NULL;
+        memfree(list);
+    }
+
+    memfree(plan);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
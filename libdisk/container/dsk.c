@@ -10,7 +10,19 @@
  *  <struct track_header> * #tracks (each entry is disk_header.bytes_per_thdr)
  *  [<struct tag_header> tag data...]+
  *  <track data...>
- * All fields are big endian (network ordering).
+ * All fields are big endian (network ordering). The first tag is usually a
+ * container-private list of track digests (DSKTAG_dsk_track_digests).
+ *
+ * Compressed (version 1) images have the same layout, but each track header
+ * is followed by the stored length of the track's data. If this is less
+ * than the track length, the data is an independently decompressible LZ
+ * block (see lz.c).
+ *
+ * Reference (DSKR) images have the same layout, but no track data. Instead
+ * each track header is followed by the SHA-256 digest of the track's type,
+ * flags, length and data, which names an object in the "dskpool" directory
+ * alongside the image. Identical tracks of different images share a single
+ * pool object.
  */
 
 #include <libdisk/util.h>
@@ -22,6 +34,8 @@
 #include <unistd.h>
 #include <time.h>
 
+#define DSKREF_POOL "dskpool"
+
 struct disk_header {
     char signature[4];
     uint16_t version;
@@ -103,124 +117,507 @@ void dsk_init(struct disk *d)
     _dsk_init(d, 168);
 }
 
-static struct container *dsk_open(struct disk *d)
+/* Container-private tag recording the digest of every track, so that
+ * track_get_digest() need not read track data. It is consumed by dsk_open()
+ * and regenerated by dsk_close(), so never appears in a disk's tag list.
+ * The tag begins with a digest of the track headers (with zero offsets), so
+ * that it is ignored if tracks are rewritten by software that preserves
+ * unknown tags. */
+#define DSKTAG_dsk_track_digests 0xfffeu
+
+struct dsk_priv {
+    uint8_t th_digest[SHA256_LEN];
+    struct {
+        uint32_t off;      /* DSK: file offset of track data */
+        uint32_t zlen;     /* DSK: stored length of track data */
+        uint8_t digest[SHA256_LEN];
+        bool_t has_digest; /* digest recorded in the image */
+        bool_t pending;    /* data not yet read */
+    } track[1];
+};
+
+static struct dsk_priv *dsk_priv_alloc(struct disk *d, unsigned int nr)
+{
+    struct dsk_priv *priv;
+
+    priv = memalloc(sizeof(*priv) + nr * sizeof(priv->track[0]));
+    d->priv = priv;
+    return priv;
+}
+
+static int dsk_get_track_digest(
+    struct disk *d, unsigned int tracknr, uint8_t *digest)
+{
+    struct dsk_priv *priv = d->priv;
+
+    if ((priv == NULL) || !priv->track[tracknr].pending
+        || !priv->track[tracknr].has_digest)
+        return -1;
+
+    memcpy(digest, priv->track[tracknr].digest, SHA256_LEN);
+    return 0;
+}
+
+/* Digests of all tracks, using those recorded in the image where the track
+ * has not been touched since it was opened. The first digest is left free
+ * for the digest of the track headers. */
+static uint8_t *dsk_track_digests(struct disk *d)
+{
+    struct disk_info *di = d->di;
+    uint8_t *digests = memalloc((di->nr_tracks + 1) * SHA256_LEN);
+    unsigned int i;
+
+    for (i = 0; i < di->nr_tracks; i++)
+        track_get_digest(d, i, &digests[(i + 1) * SHA256_LEN]);
+
+    return digests;
+}
+
+/* Pool object for @digest: <image dir>/dskpool/<xx>/<rest of digest>. */
+static char *dskref_object_name(struct disk *d, const uint8_t *digest)
+{
+    const char *p = strrchr(d->name, '/');
+    int i, dirlen = p ? p - d->name + 1 : 0;
+    char *name, *q;
+
+    name = memalloc(dirlen + sizeof(DSKREF_POOL) + 2*SHA256_LEN + 2);
+    q = name + sprintf(name, "%.*s" DSKREF_POOL "/", dirlen, d->name);
+    for (i = 0; i < SHA256_LEN; i++)
+        q += sprintf(q, (i == 1) ? "/%02x" : "%02x", digest[i]);
+
+    return name;
+}
+
+static void dskref_put_object(
+    struct disk *d, const struct track_info *ti, const uint8_t *digest)
+{
+    char *name = dskref_object_name(d, digest), *tmp, *p;
+    int fd;
+
+    if (access(name, F_OK) == 0)
+        goto out;
+
+    /* Create the pool and its fan-out directory as needed. */
+    for (p = strrchr(name, '/') - 3 - strlen(DSKREF_POOL);
+         (p = strchr(p, '/')) != NULL; p++) {
+        *p = '\0';
+        if ((posix_mkdir(name, 0777) != 0) && (errno != EEXIST))
+            err(1, "%s", name);
+        *p = '/';
+    }
+
+    /* Write under a temporary name and rename into place, so that an object
+     * is never seen incomplete, even by concurrent writers. */
+    tmp = memalloc(strlen(name) + 40);
+    sprintf(tmp, "%s.%u.%lx.tmp", name, (unsigned int)getpid(),
+            (unsigned long)d);
+    if ((fd = file_open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1)
+        err(1, "%s", tmp);
+    write_exact(fd, ti->dat, ti->len);
+    if (close(fd) != 0)
+        err(1, "%s", tmp);
+    if (rename(tmp, name) != 0)
+        err(1, "%s", name);
+    memfree(tmp);
+
+out:
+    memfree(name);
+}
+
+static void dsk_load_track(struct disk *d, unsigned int tracknr)
+{
+    struct dsk_priv *priv = d->priv;
+    struct track_info *ti = &d->di->track[tracknr];
+
+    if ((priv == NULL) || !priv->track[tracknr].pending)
+        return;
+    priv->track[tracknr].pending = 0;
+
+    ti->dat = memalloc(ti->len);
+    lseek(d->fd, priv->track[tracknr].off, SEEK_SET);
+    if (priv->track[tracknr].zlen >= ti->len) {
+        read_exact(d->fd, ti->dat, ti->len);
+    } else {
+        uint8_t *zdat = memalloc(priv->track[tracknr].zlen);
+        read_exact(d->fd, zdat, priv->track[tracknr].zlen);
+        if (lz_decompress(zdat, priv->track[tracknr].zlen,
+                          ti->dat, ti->len) != 0)
+            errx(1, "%s: T%u.%u: Bad compressed track data",
+                 d->name, cyl(tracknr), hd(tracknr));
+        memfree(zdat);
+    }
+}
+
+static void dskref_load_track(struct disk *d, unsigned int tracknr)
+{
+    struct dsk_priv *priv = d->priv;
+    struct track_info *ti = &d->di->track[tracknr];
+    uint8_t digest[SHA256_LEN];
+    struct stat st;
+    char *name;
+    int fd;
+
+    if ((priv == NULL) || !priv->track[tracknr].pending)
+        return;
+    priv->track[tracknr].pending = 0;
+
+    name = dskref_object_name(d, priv->track[tracknr].digest);
+    if ((fd = file_open(name, O_RDONLY)) == -1)
+        err(1, "%s", name);
+    if ((fstat(fd, &st) != 0) || (st.st_size != ti->len))
+        errx(1, "%s: Bad track object", name);
+    ti->dat = memalloc(ti->len);
+    read_exact(fd, ti->dat, ti->len);
+    close(fd);
+
+    track_compute_digest(ti, digest);
+    if (memcmp(digest, priv->track[tracknr].digest, SHA256_LEN))
+        errx(1, "%s: Bad track object", name);
+
+    memfree(name);
+}
+
+static void read_track_digests(struct disk *d, const struct disktag *dtag)
+{
+    struct dsk_priv *priv = d->priv;
+    const uint8_t *p = (const uint8_t *)(dtag + 1);
+    unsigned int i;
+
+    if ((dtag->len != ((d->di->nr_tracks + 1) * SHA256_LEN))
+        || memcmp(p, priv->th_digest, SHA256_LEN))
+        return;
+    p += SHA256_LEN;
+
+    for (i = 0; i < d->di->nr_tracks; i++) {
+        memcpy(priv->track[i].digest, &p[i * SHA256_LEN], SHA256_LEN);
+        priv->track[i].has_digest = 1;
+    }
+}
+
+static void read_tags(struct disk *d)
 {
-    struct disk_header dh;
-    struct track_header th;
     struct tag_header tagh;
     struct disk_list_tag *dltag, **pprevtag;
     struct disktag *dtag;
+
+    pprevtag = &d->tags;
+    for (;;) {
+        read_exact(d->fd, &tagh, sizeof(tagh));
+        dltag = memalloc(sizeof(*dltag) + be16toh(tagh.len));
+        dtag = &dltag->tag;
+        dtag->id = be16toh(tagh.id);
+        dtag->len = be16toh(tagh.len);
+        read_exact(d->fd, dtag+1, dtag->len);
+        if (dtag->id == DSKTAG_dsk_track_digests) {
+            read_track_digests(d, dtag);
+            memfree(dltag);
+            continue;
+        }
+        tag_swizzle(dtag);
+        *pprevtag = dltag;
+        pprevtag = &dltag->next;
+        if (dtag->id == DSKTAG_end)
+            break;
+    }
+    *pprevtag = NULL;
+}
+
+static void write_tag(int fd, uint16_t id, uint16_t len, const void *dat)
+{
+    struct tag_header tagh;
+
+    tagh.id = htobe16(id);
+    tagh.len = htobe16(len);
+    write_exact(fd, &tagh, sizeof(tagh));
+    write_exact(fd, dat, len);
+}
+
+/* Write the tag list, preceded by track @digests if non-NULL. */
+static void write_tags(struct disk *d, const uint8_t *digests)
+{
+    struct disk_list_tag *dltag;
+    struct disktag *dtag;
+
+    if (digests != NULL)
+        write_tag(d->fd, DSKTAG_dsk_track_digests,
+                  (d->di->nr_tracks + 1) * SHA256_LEN, digests);
+
+    for (dltag = d->tags; dltag != NULL; dltag = dltag->next) {
+        dtag = &dltag->tag;
+        tag_swizzle(dtag);
+        write_tag(d->fd, dtag->id, dtag->len, dtag+1);
+        tag_swizzle(dtag);
+    }
+}
+
+static unsigned int tags_size(struct disk *d, const uint8_t *digests)
+{
+    struct disk_list_tag *dltag;
+    unsigned int sz = 0;
+
+    if (digests != NULL)
+        sz += sizeof(struct tag_header) + (d->di->nr_tracks+1) * SHA256_LEN;
+
+    for (dltag = d->tags; dltag != NULL; dltag = dltag->next)
+        sz += sizeof(struct tag_header) + dltag->tag.len;
+
+    return sz;
+}
+
+static void th_to_ti(const struct track_header *th, struct track_info *ti)
+{
+    init_track_info(ti, be16toh(th->type));
+    ti->flags = be16toh(th->flags);
+    ti->nr_sectors = be16toh(th->nr_sectors);
+    ti->bytes_per_sector = be16toh(th->bytes_per_sector);
+    memcpy(ti->valid_sectors, th->valid_sectors, sizeof(th->valid_sectors));
+    ti->len = be32toh(th->len);
+    ti->data_bitoff = be32toh(th->data_bitoff);
+    ti->total_bits = be32toh(th->total_bits);
+}
+
+static void ti_to_th(const struct track_info *ti, struct track_header *th)
+{
+    th->type = htobe16(ti->type);
+    th->flags = htobe16(ti->flags);
+    th->nr_sectors = htobe16(ti->nr_sectors);
+    th->bytes_per_sector = htobe16(ti->bytes_per_sector);
+    memcpy(th->valid_sectors, ti->valid_sectors, sizeof(th->valid_sectors));
+    th->off = 0;
+    th->len = htobe32(ti->len);
+    th->data_bitoff = htobe32(ti->data_bitoff);
+    th->total_bits = htobe32(ti->total_bits);
+}
+
+static struct container *dsk_open(struct disk *d)
+{
+    struct disk_header dh;
+    struct track_header th;
+    struct dsk_priv *priv;
     struct disk_info *di;
     struct track_info *ti;
-    unsigned int i, bytes_per_th, read_bytes_per_th;
-    off_t off;
+    struct sha256_ctx ctx;
+    unsigned int i, version, bytes_per_th, read_bytes_per_th;
+    uint32_t zlen;
 
     read_exact(d->fd, &dh, sizeof(dh));
-    if (strncmp(dh.signature, "DSK\0", 4) ||
-        (be16toh(dh.version) != 0))
+    version = be16toh(dh.version);
+    bytes_per_th = be16toh(dh.bytes_per_thdr);
+    if (strncmp(dh.signature, "DSK\0", 4) || (version > 1) ||
+        ((version == 1) && (bytes_per_th < (sizeof(th) + sizeof(zlen)))))
         return NULL;
 
-    di = memalloc(sizeof(*di));
+    d->di = di = memalloc(sizeof(*di));
     di->nr_tracks = be16toh(dh.nr_tracks);
     di->flags = be16toh(dh.flags);
     di->track = memalloc(di->nr_tracks * sizeof(*ti));
-    read_bytes_per_th = bytes_per_th = be16toh(dh.bytes_per_thdr);
-    if (read_bytes_per_th > sizeof(*ti))
-        read_bytes_per_th = sizeof(*ti);
+    priv = dsk_priv_alloc(d, di->nr_tracks);
+    read_bytes_per_th = min_t(unsigned int, bytes_per_th, sizeof(th));
 
+    /* Track data is read only when it is first used. */
+    sha256_init(&ctx);
     for (i = 0; i < di->nr_tracks; i++) {
         memset(&th, 0, sizeof(th));
         read_exact(d->fd, &th, read_bytes_per_th);
+        zlen = be32toh(th.len);
+        if (version == 1) {
+            read_exact(d->fd, &zlen, sizeof(zlen));
+            zlen = be32toh(zlen);
+            lseek(d->fd, bytes_per_th - sizeof(th) - sizeof(zlen), SEEK_CUR);
+        } else {
+            lseek(d->fd, bytes_per_th - read_bytes_per_th, SEEK_CUR);
+        }
         ti = &di->track[i];
-        init_track_info(ti, be16toh(th.type));
-        ti->flags = be16toh(th.flags);
-        ti->nr_sectors = be16toh(th.nr_sectors);
-        ti->bytes_per_sector = be16toh(th.bytes_per_sector);
-        memcpy(ti->valid_sectors, th.valid_sectors, sizeof(th.valid_sectors));
-        ti->len = be32toh(th.len);
-        ti->data_bitoff = be32toh(th.data_bitoff);
-        ti->total_bits = be32toh(th.total_bits);
-        off = lseek(d->fd, bytes_per_th-read_bytes_per_th, SEEK_CUR);
-        lseek(d->fd, be32toh(th.off), SEEK_SET);
-        ti->dat = memalloc(ti->len);
-        read_exact(d->fd, ti->dat, ti->len);
-        lseek(d->fd, off, SEEK_SET);
+        th_to_ti(&th, ti);
+        priv->track[i].off = be32toh(th.off);
+        priv->track[i].zlen = zlen;
+        if (ti->len == 0)
+            ti->dat = memalloc(0);
+        else
+            priv->track[i].pending = 1;
+        th.off = 0;
+        sha256_add(&ctx, &th, sizeof(th));
     }
+    sha256_final(&ctx, priv->th_digest);
 
-    pprevtag = &d->tags;
-    do {
-        read_exact(d->fd, &tagh, sizeof(tagh));
-        dltag = memalloc(sizeof(*dltag) + be16toh(tagh.len));
-        dtag = &dltag->tag;
-        dtag->id = be16toh(tagh.id);
-        dtag->len = be16toh(tagh.len);
-        read_exact(d->fd, dtag+1, dtag->len);
-        tag_swizzle(dtag);
-        *pprevtag = dltag;
-        pprevtag = &dltag->next;
-    } while (dtag->id != DSKTAG_end);
-    *pprevtag = NULL;
+    read_tags(d);
 
-    d->di = di;
-    return &container_dsk;
+    return (version == 1) ? &container_dskz : &container_dsk;
 }
 
-static void dsk_close(struct disk *d)
+static void _dsk_close(struct disk *d, bool_t compress)
 {
     struct disk_header dh;
     struct track_header th;
     struct disk_info *di = d->di;
     struct track_info *ti;
-    struct disk_list_tag *dltag;
-    struct disktag *dtag;
-    unsigned int i, datoff;
+    struct sha256_ctx ctx;
+    uint8_t *digests = dsk_track_digests(d), **zdat = NULL;
+    uint32_t *zlen = NULL;
+    unsigned int i, datoff, bytes_per_th = sizeof(th);
+
+    /* Everything is rewritten in place: first read in all track data. */
+    for (i = 0; i < di->nr_tracks; i++)
+        dsk_load_track(d, i);
+
+    /* Compress each track on its own. Data which does not shrink is stored
+     * as is. */
+    if (compress) {
+        bytes_per_th += sizeof(*zlen);
+        zdat = memalloc(di->nr_tracks * sizeof(*zdat));
+        zlen = memalloc(di->nr_tracks * sizeof(*zlen));
+        for (i = 0; i < di->nr_tracks; i++) {
+            ti = &di->track[i];
+            zdat[i] = memalloc(ti->len);
+            zlen[i] = lz_compress(ti->dat, ti->len, zdat[i], ti->len);
+            if (zlen[i] == 0) {
+                memcpy(zdat[i], ti->dat, ti->len);
+                zlen[i] = ti->len;
+            }
+        }
+    }
+
+    /* Digests are optional, and omitted if they would overflow a tag. */
+    if (((di->nr_tracks + 1) * SHA256_LEN) > 0xffffu) {
+        memfree(digests);
+        digests = NULL;
+    }
 
     lseek(d->fd, 0, SEEK_SET);
     if (ftruncate(d->fd, 0) < 0)
         err(1, NULL);
 
     memcpy(dh.signature, "DSK\0", 4);
-    dh.version = 0;
+    dh.version = htobe16(compress ? 1 : 0);
     dh.nr_tracks = htobe16(di->nr_tracks);
-    dh.bytes_per_thdr = htobe16(sizeof(th));
+    dh.bytes_per_thdr = htobe16(bytes_per_th);
     dh.flags = htobe16(di->flags);
     write_exact(d->fd, &dh, sizeof(dh));
 
-    datoff = sizeof(dh) + di->nr_tracks * sizeof(th);
-    for (dltag = d->tags; dltag != NULL; dltag = dltag->next)
-        datoff += sizeof(struct tag_header) + dltag->tag.len;
+    datoff = sizeof(dh) + di->nr_tracks * bytes_per_th
+        + tags_size(d, digests);
 
+    sha256_init(&ctx);
     for (i = 0; i < di->nr_tracks; i++) {
         ti = &di->track[i];
-        th.type = htobe16(ti->type);
-        th.flags = htobe16(ti->flags);
-        th.nr_sectors = htobe16(ti->nr_sectors);
-        th.bytes_per_sector = htobe16(ti->bytes_per_sector);
-        memcpy(th.valid_sectors, ti->valid_sectors, sizeof(th.valid_sectors));
+        ti_to_th(ti, &th);
+        sha256_add(&ctx, &th, sizeof(th));
         th.off = htobe32(datoff);
-        th.len = htobe32(ti->len);
-        th.data_bitoff = htobe32(ti->data_bitoff);
-        th.total_bits = htobe32(ti->total_bits);
         write_exact(d->fd, &th, sizeof(th));
-        datoff += ti->len;
+        if (compress) {
+            uint32_t be_zlen = htobe32(zlen[i]);
+            write_exact(d->fd, &be_zlen, sizeof(be_zlen));
+            datoff += zlen[i];
+        } else {
+            datoff += ti->len;
+        }
     }
+    if (digests != NULL)
+        sha256_final(&ctx, digests);
 
-    for (dltag = d->tags; dltag != NULL; dltag = dltag->next) {
-        struct tag_header tagh;
-        dtag = &dltag->tag;
-        tagh.id = htobe16(dtag->id);
-        tagh.len = htobe16(dtag->len);
-        tag_swizzle(dtag);
-        write_exact(d->fd, &tagh, sizeof(tagh));
-        write_exact(d->fd, dtag+1, dtag->len);
-        tag_swizzle(dtag);
-    }
+    write_tags(d, digests);
 
     for (i = 0; i < di->nr_tracks; i++) {
         ti = &di->track[i];
-        if (ti->len != 0)
+        if (compress) {
+            write_exact(d->fd, zdat[i], zlen[i]);
+            memfree(zdat[i]);
+        } else if (ti->len != 0) {
             write_exact(d->fd, ti->dat, ti->len);
+        }
     }
+
+    memfree(zdat);
+    memfree(zlen);
+    memfree(digests);
+}
+
+static void dsk_close(struct disk *d)
+{
+    _dsk_close(d, 0);
+}
+
+static void dskz_close(struct disk *d)
+{
+    _dsk_close(d, 1);
+}
+
+static struct container *dskref_open(struct disk *d)
+{
+    struct disk_header dh;
+    struct track_header th;
+    struct dsk_priv *priv;
+    struct disk_info *di;
+    struct track_info *ti;
+    unsigned int i, bytes_per_th;
+
+    read_exact(d->fd, &dh, sizeof(dh));
+    bytes_per_th = be16toh(dh.bytes_per_thdr);
+    if (strncmp(dh.signature, "DSKR", 4) ||
+        (be16toh(dh.version) != 0) ||
+        (bytes_per_th < (sizeof(th) + SHA256_LEN)))
+        return NULL;
+
+    d->di = di = memalloc(sizeof(*di));
+    di->nr_tracks = be16toh(dh.nr_tracks);
+    di->flags = be16toh(dh.flags);
+    di->track = memalloc(di->nr_tracks * sizeof(*ti));
+    priv = dsk_priv_alloc(d, di->nr_tracks);
+
+    /* Track data is fetched from the pool only when it is first used. */
+    for (i = 0; i < di->nr_tracks; i++) {
+        read_exact(d->fd, &th, sizeof(th));
+        read_exact(d->fd, priv->track[i].digest, SHA256_LEN);
+        lseek(d->fd, bytes_per_th - sizeof(th) - SHA256_LEN, SEEK_CUR);
+        ti = &di->track[i];
+        th_to_ti(&th, ti);
+        priv->track[i].has_digest = 1;
+        if (ti->len == 0)
+            ti->dat = memalloc(0);
+        else
+            priv->track[i].pending = 1;
+    }
+
+    read_tags(d);
+
+    return &container_dskref;
+}
+
+static void dskref_close(struct disk *d)
+{
+    struct disk_header dh;
+    struct track_header th;
+    struct dsk_priv *priv = d->priv;
+    struct disk_info *di = d->di;
+    struct track_info *ti;
+    uint8_t *digests = dsk_track_digests(d), *digest;
+    unsigned int i;
+
+    lseek(d->fd, 0, SEEK_SET);
+    if (ftruncate(d->fd, 0) < 0)
+        err(1, NULL);
+
+    memcpy(dh.signature, "DSKR", 4);
+    dh.version = 0;
+    dh.nr_tracks = htobe16(di->nr_tracks);
+    dh.bytes_per_thdr = htobe16(sizeof(th) + SHA256_LEN);
+    dh.flags = htobe16(di->flags);
+    write_exact(d->fd, &dh, sizeof(dh));
+
+    for (i = 0; i < di->nr_tracks; i++) {
+        ti = &di->track[i];
+        digest = &digests[(i + 1) * SHA256_LEN];
+        /* Tracks unmodified since open are already in the pool. */
+        if (!(priv && priv->track[i].pending) && (ti->len != 0))
+            dskref_put_object(d, ti, digest);
+        ti_to_th(ti, &th);
+        write_exact(d->fd, &th, sizeof(th));
+        write_exact(d->fd, digest, SHA256_LEN);
+    }
+
+    write_tags(d, NULL);
+
+    memfree(digests);
 }
 
 int dsk_write_raw(
@@ -230,6 +627,7 @@ int dsk_write_raw(
     struct disk_info *di = d->di;
     struct track_info *ti = &di->track[tracknr];
     unsigned int ns_per_cell = 0, default_len;
+    uint64_t t;
 
     memset(ti, 0, sizeof(*ti));
     init_track_info(ti, type);
@@ -245,8 +643,13 @@ int dsk_write_raw(
     default_len = (DEFAULT_BITS_PER_TRACK(d) * 2000u) / ns_per_cell;
     ti->total_bits = default_len;
 
+    t = trace_begin();
+    s->decode_index = 0;
     if (stream_select_track(s, tracknr) == 0)
         ti->dat = handlers[type]->write_raw(d, tracknr, s);
+    s->decode_index = s->nr_index;
+    trace_end(t, "decode", disk_get_format_id_name(type), tracknr,
+              ti->dat ? "match" : "no match");
 
     if (ti->dat == NULL) {
         track_mark_unformatted(d, tracknr);
@@ -279,7 +682,27 @@ struct container container_dsk = {
     .init = dsk_init,
     .open = dsk_open,
     .close = dsk_close,
-    .write_raw = dsk_write_raw
+    .write_raw = dsk_write_raw,
+    .load_track = dsk_load_track,
+    .get_track_digest = dsk_get_track_digest
+};
+
+struct container container_dskz = {
+    .init = dsk_init,
+    .open = dsk_open,
+    .close = dskz_close,
+    .write_raw = dsk_write_raw,
+    .load_track = dsk_load_track,
+    .get_track_digest = dsk_get_track_digest
+};
+
+struct container container_dskref = {
+    .init = dsk_init,
+    .open = dskref_open,
+    .close = dskref_close,
+    .write_raw = dsk_write_raw,
+    .load_track = dskref_load_track,
+    .get_track_digest = dsk_get_track_digest
 };
 
 /*
@@ -75,39 +75,202 @@ static void hfe_init(struct disk *d)
 }
 
 /* HFE dat bit order is LSB first. Switch to/from MSB first.  */
-static void bit_reverse(uint8_t *block, unsigned int len)
+static uint8_t bit_reverse_tab[256];
+
+static void __initcall bit_reverse_tab_init(void)
 {
-    while (len--) {
-        uint8_t x = *block, y, k;
-        for (k = y = 0; k < 8; k++) {
+    unsigned int i, k;
+    uint8_t x, y;
+    for (i = 0; i < 256; i++) {
+        for (x = i, y = k = 0; k < 8; k++) {
             y <<= 1;
             y |= x&1;
             x >>= 1;
         }
-        *block++ = y;
+        bit_reverse_tab[i] = y;
     }
 }
 
+static void bit_reverse(uint8_t *block, unsigned int len)
+{
+    while (len--) {
+        *block = bit_reverse_tab[*block];
+        block++;
+    }
+}
+
+/* OR @nr bits at @src_off in @src into @dst at @dst_off. Bits are copied
+ * singly only until the destination is byte aligned, and at the tail: the
+ * bulk is shifted and merged a 32-bit word at a time. */
 static void bit_copy(void *dst, unsigned int dst_off,
-                     void *src, unsigned int src_off,
+                     const void *src, unsigned int src_off,
                      unsigned int nr)
 {
-    uint8_t *s = src, *d = dst;
-    unsigned int i;
-    for (i = 0; i < nr; i++) {
-        uint8_t x = (s[src_off/8] >> (7-(src_off&7))) & 1;
-        d[dst_off/8] |= x << (7-(dst_off&7));
-        src_off++; dst_off++;
+    const uint8_t *s = src;
+    uint8_t *d = dst;
+    uint32_t x, y;
+    unsigned int sh;
+
+    for (; nr && (dst_off & 7); nr--, src_off++, dst_off++) {
+        uint8_t b = (s[src_off/8] >> (7-(src_off&7))) & 1;
+        d[dst_off/8] |= b << (7-(dst_off&7));
+    }
+
+    s += src_off/8; d += dst_off/8;
+    sh = src_off & 7;
+
+    for (; nr >= 32; nr -= 32, s += 4, d += 4) {
+        memcpy(&x, s, 4);
+        x = be32toh(x);
+        if (sh)
+            x = (x << sh) | (s[4] >> (8-sh));
+        memcpy(&y, d, 4);
+        y |= htobe32(x);
+        memcpy(d, &y, 4);
+    }
+
+    for (; nr >= 8; nr -= 8, s++)
+        *d++ |= sh ? (s[0] << sh) | (s[1] >> (8-sh)) : s[0];
+
+    for (src_off = sh, dst_off = 0; nr--; src_off++, dst_off++) {
+        uint8_t b = (s[src_off/8] >> (7-(src_off&7))) & 1;
+        d[dst_off/8] |= b << (7-(dst_off&7));
     }
 }
 
+/* Tracks are decoded from the image file on first use. */
+struct hfe_priv {
+    bool_t v3;
+    struct track_header thdr[256];
+    bool_t pending[512];
+};
+
+/* HFEv3: process opcodes in the input byte stream @raw_dat of @len bytes,
+ * and set up track @tracknr from the result. @raw_dat is clobbered. */
+static void hfe_v3_setup_track(
+    struct disk *d, unsigned int tracknr, uint8_t *raw_dat, unsigned int len)
+{
+    uint8_t *new_dat = memalloc(len);
+    uint8_t br = 0, *brs = memalloc(len+1);
+    unsigned int inb = 0, outb = 0, opc, index_bc = 0, len_bc, k;
+    unsigned int rand = 0;
+
+    while (inb/8 < len) {
+        brs[outb/8] = br;
+        BUG_ON(inb & 7);
+        opc = raw_dat[inb/8];
+        if ((opc & 0xf0) != 0xf0) {
+            /* Copy a run of plain data bytes in one go. */
+            for (k = inb/8 + 1; k < len; k++)
+                if ((raw_dat[k] & 0xf0) == 0xf0)
+                    break;
+            k -= inb/8;
+            memset(&brs[outb/8], br, k);
+            bit_copy(new_dat, outb, raw_dat, inb, k*8);
+            inb += k*8; outb += k*8;
+            continue;
+        }
+        switch (opc & 0x0f) {
+        case OP_nop:
+            inb += 8;
+            break;
+        case OP_index:
+            inb += 8;
+            index_bc = outb;
+            break;
+        case OP_bitrate:
+            br = raw_dat[inb/8+1];
+            inb += 2*8;
+            break;
+        case OP_skip: {
+            uint8_t skip = raw_dat[inb/8+1];
+            inb += 2*8 + skip;
+            BUG_ON(skip > 8);
+            bit_copy(new_dat, outb, raw_dat, inb, 8-skip);
+            inb += 8-skip; outb += 8-skip;
+            break;
+        }
+        case OP_rand: {
+            rand++;
+            inb += 8; outb += 8;
+            break;
+        }
+        default:
+            fprintf(stderr, "Unknown HFEv3 opcode %02x\n", opc);
+            BUG();
+        }
+    }
+
+    /* Rotate track so index pulse is at bit 0. */
+    brs[outb/8] = br;
+    len_bc = outb;
+    memset(raw_dat, 0, len);
+    bit_copy(raw_dat, 0, new_dat, index_bc, len_bc-index_bc);
+    bit_copy(raw_dat, len_bc-index_bc, new_dat, 0, index_bc);
+    memfree(new_dat);
+
+    /* Set up the track. */
+    setup_uniform_raw_track(d, tracknr, TRKTYP_raw_dd, len_bc, raw_dat);
+
+    /* HACK: Poke the non-uniform speed values. */
+    {
+        uint16_t *s = (uint16_t *)d->di->track[tracknr].dat;
+        unsigned int av_br, cur_br;
+        av_br = (7200000 + len_bc/2) / len_bc;
+        for (k = 0; k < (outb+7)/8; k++) {
+            cur_br = brs[(k+index_bc/8) % ((outb+7)/8)];
+            s[k] = cur_br ? (cur_br*SPEED_AVG + av_br/2) / av_br
+                : SPEED_AVG;
+        }
+    }
+
+    memfree(brs);
+    if (rand != 0)
+        fprintf(stderr, "T%d.%d: HFEv3: WARNING: %d unsupported "
+                "random bytes\n", tracknr/2, tracknr&1, rand);
+}
+
+static void hfe_load_track(struct disk *d, unsigned int tracknr)
+{
+    struct hfe_priv *hfe = d->priv;
+    struct track_header *thdr;
+    unsigned int i, len, side = tracknr & 1;
+    uint8_t *tbuf, *raw_dat;
+
+    /* Nothing is pending in a newly-created image. */
+    if ((hfe == NULL) || !hfe->pending[tracknr])
+        return;
+    hfe->pending[tracknr] = 0;
+    thdr = &hfe->thdr[tracknr/2];
+
+    /* Read into track buffer, padded up to 512-byte boundary. */
+    len = (thdr->len + 0x1ff) & ~0x1ff;
+    tbuf = memalloc(len);
+    lseek(d->fd, thdr->offset*512, SEEK_SET);
+    read_exact(d->fd, tbuf, len);
+
+    /* Demux this side's data. */
+    raw_dat = memalloc(len/2);
+    for (i = 0; i < len; i += 512)
+        memcpy(&raw_dat[i/2], &tbuf[i + side*256], 256);
+    memfree(tbuf);
+    bit_reverse(raw_dat, len/2);
+
+    if (hfe->v3)
+        hfe_v3_setup_track(d, tracknr, raw_dat, len/2);
+    else
+        setup_uniform_raw_track(d, tracknr, TRKTYP_raw_dd,
+                                thdr->len*4, raw_dat);
+
+    memfree(raw_dat);
+}
+
 static struct container *hfe_open(struct disk *d)
 {
     struct disk_header dhdr;
-    struct track_header thdr;
     struct disk_info *di;
-    unsigned int i, j, len;
-    uint8_t *tbuf, *raw_dat[2];
+    struct hfe_priv *hfe;
+    unsigned int i;
     bool_t v3 = 0;
 
     lseek(d->fd, 0, SEEK_SET);
@@ -123,152 +286,92 @@ static struct container *hfe_open(struct disk *d)
 
     dhdr.track_list_offset = le16toh(dhdr.track_list_offset);
 
+    d->priv = hfe = memalloc(sizeof(*hfe));
+    hfe->v3 = v3;
+
     d->di = di = memalloc(sizeof(*di));
     di->nr_tracks = dhdr.nr_tracks * 2;
     di->track = memalloc(di->nr_tracks * sizeof(struct track_info));
 
+    /* Only the track LUT is read now. Track data is decoded on demand. */
+    lseek(d->fd, dhdr.track_list_offset*512, SEEK_SET);
+    read_exact(d->fd, hfe->thdr, dhdr.nr_tracks * sizeof(hfe->thdr[0]));
     for (i = 0; i < dhdr.nr_tracks; i++) {
-        lseek(d->fd, dhdr.track_list_offset*512 + i*4, SEEK_SET);
-        read_exact(d->fd, &thdr, 4);
-        thdr.offset = le16toh(thdr.offset);
-        thdr.len = le16toh(thdr.len);
-
-        /* Read into track buffer, padded up to 512-byte boundary. */
-        len = (thdr.len + 0x1ff) & ~0x1ff;
-        tbuf = memalloc(len);
-        lseek(d->fd, thdr.offset*512, SEEK_SET);
-        read_exact(d->fd, tbuf, len);
-        bit_reverse(tbuf, len);
-
-        /* Allocate track buffers and demux the data. */
-        raw_dat[0] = memalloc(len/2);
-        raw_dat[1] = memalloc(len/2);
-        for (j = 0; j < len; j += 512) {
-            memcpy(&raw_dat[0][j/2], &tbuf[j+  0], 256);
-            memcpy(&raw_dat[1][j/2], &tbuf[j+256], 256);
-        }
-        if (v3) {
-            /* HFEv3: process opcodes in the input byte stream. */
-            for (j = 0; j < 2; j++) {
-                uint8_t *new_dat = memalloc(len/2);
-                uint8_t br = 0, *brs = memalloc(len/2+1);
-                unsigned int inb = 0, outb = 0, opc, index_bc = 0, len_bc;
-                unsigned int rand = 0;
-                while (inb/8 < len/2) {
-                    brs[outb/8] = br;
-                    BUG_ON(inb & 7);
-                    opc = raw_dat[j][inb/8]; 
-                    if ((opc & 0xf0) == 0xf0) {
-                        switch (opc & 0x0f) {
-                        case OP_nop:
-                            inb += 8;
-                            break;
-                        case OP_index:
-                            inb += 8;
-                            index_bc = outb;
-                            break;
-                        case OP_bitrate:
-                            br = raw_dat[j][inb/8+1];
-                            inb += 2*8;
-                            break;
-                        case OP_skip: {
-                            uint8_t skip = raw_dat[j][inb/8+1];
-                            inb += 2*8 + skip;
-                            BUG_ON(skip > 8);
-                            bit_copy(new_dat, outb, raw_dat[j], inb, 8-skip);
-                            inb += 8-skip; outb += 8-skip;
-                            break;
-                        }
-                        case OP_rand: {
-                            rand++;
-                            inb += 8; outb += 8;
-                            break;
-                        }
-                        default:
-                            fprintf(stderr,
-                                    "Unknown HFEv3 opcode %02x\n", opc);
-                            BUG();
-                        }
-                    } else {
-                        bit_copy(new_dat, outb, raw_dat[j], inb, 8);
-                        inb += 8; outb += 8;
-                    }
-                }
-                /* Rotate track so index pulse is at bit 0. */
-                brs[outb/8] = br;
-                len_bc = outb;
-                memset(raw_dat[j], 0, len/2);
-                bit_copy(raw_dat[j], 0, new_dat, index_bc, len_bc-index_bc);
-                bit_copy(raw_dat[j], len_bc-index_bc, new_dat, 0, index_bc); 
-                memfree(new_dat);
-                /* Set up the track. */
-                setup_uniform_raw_track(d, i*2+j, TRKTYP_raw_dd,
-                                        len_bc, raw_dat[j]);
-                /* HACK: Poke the non-uniform speed values. */
-                {
-                    uint16_t *s = (uint16_t *)d->di->track[i*2+j].dat;
-                    unsigned int k, av_br, cur_br;
-                    av_br = (7200000 + len_bc/2) / len_bc;
-                    for (k = 0; k < (outb+7)/8; k++) {
-                        cur_br = brs[(k+index_bc/8) % ((outb+7)/8)];
-                        s[k] = cur_br ? (cur_br*SPEED_AVG + av_br/2) / av_br
-                            : SPEED_AVG;
-                    }
-                }
-                memfree(raw_dat[j]);
-                memfree(brs);
-                if (rand != 0)
-                    fprintf(stderr, "T%d.%d: HFEv3: WARNING: %d unsupported "
-                            "random bytes\n", i, j, rand);
-            }
-        } else {
-            /* Original HFE */
-            for (j = 0; j < 2; j++) {
-                setup_uniform_raw_track(d, i*2+j, TRKTYP_raw_dd,
-                                        thdr.len*4, raw_dat[j]);
-                memfree(raw_dat[j]);
-            }
-        }
+        hfe->thdr[i].offset = le16toh(hfe->thdr[i].offset);
+        hfe->thdr[i].len = le16toh(hfe->thdr[i].len);
+    }
 
-        memfree(tbuf);
+    for (i = 0; i < di->nr_tracks; i++) {
+        init_track_info(&di->track[i], TRKTYP_raw_dd);
+        hfe->pending[i] = 1;
     }
 
     return &container_hfe;
 }
 
+/* Encode one side of a cylinder into the HFE track buffer @dst, which holds
+ * @len bytes for this side, interleaved in 256-byte halves of each 512-byte
+ * block with the other side. Output is LSB first. */
 static void write_bits(
     struct track_raw *raw,
     uint8_t *dst,
     unsigned int len)
 {
-    unsigned int i, bit;
-    uint8_t x;
+    unsigned int i, n, bit, bitlen = raw->bitlen, nr = len*8;
+    uint8_t *lin;
+
+    /* Too short for a 16-bit gap pattern: leave the track blank. */
+    if (bitlen < 16)
+        return;
+
+    lin = memalloc(len);
 
     /* Rotate the track so gap is at index. */
     bit = raw->write_splice_bc;
     if (bit > raw->data_start_bc)
         bit = 0; /* don't mess with an already-aligned track */
+    bit_copy(lin, 0, raw->bits, bit, bitlen - bit);
+    bit_copy(lin, bitlen - bit, raw->bits, 0, bit);
+
+    /* Repeat the last 16 bits as extra gap, doubling the copy each time. */
+    for (i = bitlen - 16, n = 16; i + n < nr; n += n)
+        bit_copy(lin, i + n, lin, i, min(n, nr - (i + n)));
+
+    /* Only half of each 512-byte block belongs to this track. */
+    for (i = 0; i < len; i++) {
+        if (i && !(i & 255))
+            dst += 256;
+        *dst++ = bit_reverse_tab[lin[i]];
+    }
 
-    i = x = 0;
-    while (i < len*8) {
-        /* Consume a bit. */
-        x <<= 1;
-        x |= !!(raw->bits[bit>>3] & (0x80 >> (bit & 7)));
-        /* Deal with byte and block boundaries. */
-        if (!(++i & 7)) {
-            *dst++ = x;
-            /* Only half of each 512-byte block belongs to this track. */
-            if (!(i & (256*8-1)))
-                dst += 256;
-        }
-        /* Deal with wrap. */
-        if (++bit >= raw->bitlen)
-            bit = 0;
-        /* If we consumed all bits then repeat last 16 bits as extra gap. */
-        if ((i >= raw->bitlen) && !((i - raw->bitlen) & 15)) {
-            int new_bit = (int)bit - 16;
-            bit = (new_bit < 0) ? new_bit + raw->bitlen : new_bit;
-        }
+    memfree(lin);
+}
+
+/* Read track @tracknr into @raw, ready for encoding into an HFE cylinder. */
+static void hfe_read_track(
+    struct disk *d, struct track_raw *raw, unsigned int tracknr)
+{
+    unsigned int i;
+
+    track_read_raw(raw, tracknr);
+
+    /* Unformatted tracks are random density, so skip speed check. 
+     * Also they are random length so do not share the track buffer 
+     * well with their neighbouring track on the same cylinder. Truncate 
+     * the random data to a default length. */
+    if (d->di->track[tracknr].type == TRKTYP_unformatted) {
+        raw->bitlen = min(raw->bitlen, DEFAULT_BITS_PER_TRACK(d));
+        return;
+    }
+
+    /* HFE tracks are uniform density. */
+    for (i = 0; i < raw->bitlen; i++) {
+        if (raw->speed[i] == 1000)
+            continue;
+        fprintf(stderr, "*** T%u.%u: Variable-density track cannot be "
+                "correctly written to an HFE file\n",
+                tracknr/2, tracknr&1);
+        break;
     }
 }
 
@@ -281,36 +384,18 @@ static void hfe_close(struct disk *d)
     } block;
     struct disk_info *di = d->di;
     struct track_header *thdr;
-    struct track_raw *_raw[di->nr_tracks], **raw = _raw;
-    unsigned int i, j, off, bitlen, bytelen, len;
+    struct track_raw *raw[2];
+    unsigned int i, off, bitlen, bytelen, len;
     bool_t is_st, is_amiga;
     uint8_t *tbuf;
 
+    /* Decode any tracks still in the file before we overwrite it. */
+    for (i = 0; i < di->nr_tracks; i++)
+        hfe_load_track(d, i);
+
     is_st = di->nr_tracks && (di->track[0].type == TRKTYP_atari_st_720kb);
     is_amiga = di->nr_tracks && (di->track[0].type == TRKTYP_amigados);
 
-    for (i = 0; i < di->nr_tracks; i++) {
-        raw[i] = track_alloc_raw_buffer(d);
-        track_read_raw(raw[i], i);
-        /* Unformatted tracks are random density, so skip speed check. 
-         * Also they are random length so do not share the track buffer 
-         * well with their neighbouring track on the same cylinder. Truncate 
-         * the random data to a default length. */
-        if (di->track[i].type == TRKTYP_unformatted) {
-            raw[i]->bitlen = min(raw[i]->bitlen, DEFAULT_BITS_PER_TRACK(d));
-            continue;
-        }
-        /* HFE tracks are uniform density. */
-        for (j = 0; j < raw[i]->bitlen; j++) {
-            if (raw[i]->speed[j] == 1000)
-                continue;
-            fprintf(stderr, "*** T%u.%u: Variable-density track cannot be "
-                    "correctly written to an HFE file\n",
-                    i/2, i&1);
-            break;
-        }
-    }
-
     lseek(d->fd, 0, SEEK_SET);
     if (ftruncate(d->fd, 0) < 0)
         err(1, NULL);
@@ -333,44 +418,49 @@ static void hfe_close(struct disk *d)
     };
     write_exact(d->fd, block.x, 512);
 
-    /* Block 1: Track LUT. */
+    /* Block 1: Track LUT. Filled in as each cylinder is written, and then
+     * written back once all cylinder lengths are known. */
     memset(block.x, 0xff, 512);
+    write_exact(d->fd, block.x, 512);
+
+    /* Encode one cylinder at a time: only two tracks are live at once.
+     * Fresh buffers per cylinder keep weak/random data seeded per track. */
     thdr = block.thdr;
     off = 2;
     for (i = 0; i < di->nr_tracks/2; i++) {
-        bitlen = max(raw[i*2]->bitlen, raw[i*2+1]->bitlen);
+        raw[0] = track_alloc_raw_buffer(d);
+        raw[1] = track_alloc_raw_buffer(d);
+        hfe_read_track(d, raw[0], i*2);
+        hfe_read_track(d, raw[1], i*2+1);
+
+        bitlen = max(raw[0]->bitlen, raw[1]->bitlen);
         bytelen = ((bitlen + 7) / 8) * 2;
+        len = (bytelen + 0x1ff) & ~0x1ff;
         thdr->offset = htole16(off);
         thdr->len = htole16(bytelen);
-        off += (bytelen + 0x1ff) >> 9;
+        off += len >> 9;
         thdr++;
-    }
-    write_exact(d->fd, block.x, 512);
 
-    for (i = 0; i < di->nr_tracks/2; i++) {
-        bitlen = max(raw[0]->bitlen, raw[1]->bitlen);
-        bytelen = ((bitlen + 7) / 8) * 2;
-        len = (bytelen + 0x1ff) & ~0x1ff;
         tbuf = memalloc(len);
-
         write_bits(raw[0], &tbuf[0], len/2);
         write_bits(raw[1], &tbuf[256], len/2);
-
-        bit_reverse(tbuf, len);
         write_exact(d->fd, tbuf, len);
         memfree(tbuf);
 
         track_free_raw_buffer(raw[0]);
         track_free_raw_buffer(raw[1]);
-        raw += 2;
     }
+
+    lseek(d->fd, 512, SEEK_SET);
+    write_exact(d->fd, block.x, 512);
 }
 
 struct container container_hfe = {
     .init = hfe_init,
     .open = hfe_open,
     .close = hfe_close,
-    .write_raw = dsk_write_raw
+    .write_raw = dsk_write_raw,
+    .load_track = hfe_load_track
 };
 
 /*
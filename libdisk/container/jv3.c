@@ -35,6 +35,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 
 /* Todo: Move to a run-time option */
 #ifndef JV3_DEBUG
@@ -91,6 +92,9 @@ static int jv3_debug = JV3_DEBUG;
 
 static unsigned char jv3_buf[JV3_HEADER_SIZE+3]; /* add a few bytes of overflow */
 
+/* jv3_buf[] and all[] are shared by every JV3 disk: one writer at a time. */
+static pthread_mutex_t jv3_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static struct container *jv3_open(struct disk *d)
 {
     /* not supported */
@@ -323,7 +327,7 @@ static int realcyl(int track, int eighty)
 
 
 /* Write out the JV3 header and raw sector dump */
-static void jv3_close(struct disk *d)
+static void __jv3_close(struct disk *d)
 {
     struct disk_info *di = d->di;
     struct track_info *ti;
@@ -1062,6 +1066,13 @@ static void jv3_close(struct disk *d)
     } /* for(jv3_state ..) */
 }
 
+static void jv3_close(struct disk *d)
+{
+    pthread_mutex_lock(&jv3_lock);
+    __jv3_close(d);
+    pthread_mutex_unlock(&jv3_lock);
+}
+
 struct container container_jv3 = {
     .init = dsk_init,
     .open = jv3_open,
@@ -34,6 +34,32 @@ static struct track_format_names {
 #undef X
 };
 
+/* Open-addressed hash of id names: holds (track_type + 1), or 0 if empty. */
+#define NAME_HASH_SIZE 1024
+static uint16_t name_hash[NAME_HASH_SIZE];
+
+/* FNV-1a: usable before other constructors (e.g. crc32's table) have run. */
+static unsigned int hash_name(const char *name)
+{
+    uint32_t h = 2166136261u;
+    while (*name)
+        h = (h ^ (uint8_t)*name++) * 16777619u;
+    return h;
+}
+
+static void __initcall name_hash_init(void)
+{
+    unsigned int i, h;
+    BUG_ON(ARRAY_SIZE(track_format_names) >= NAME_HASH_SIZE/2);
+    for (i = 0; i < ARRAY_SIZE(track_format_names); i++) {
+        const char *name = track_format_names[i].id_name;
+        h = hash_name(name);
+        while (name_hash[h % NAME_HASH_SIZE] != 0)
+            h++;
+        name_hash[h % NAME_HASH_SIZE] = i + 1;
+    }
+}
+
 static void tbuf_finalise(struct tbuf *tbuf);
 
 static struct container *container_from_filename(
@@ -49,6 +75,10 @@ static struct container *container_from_filename(
         return &container_eadf;
     if (!strcmp(suffix, "dsk"))
         return &container_dsk;
+    if (!strcmp(suffix, "dskz"))
+        return &container_dskz;
+    if (!strcmp(suffix, "dskref"))
+        return &container_dskref;
     if (!strcmp(suffix, "hfe"))
         return &container_hfe;
     if (!strcmp(suffix, "imd"))
@@ -66,30 +96,48 @@ static struct container *container_from_filename(
     return NULL;
 }
 
+static char *disk_name_dup(const char *name)
+{
+    char *p;
+
+    if (name == NULL)
+        return NULL;
+    p = memalloc(strlen(name) + 1);
+    strcpy(p, name);
+    return p;
+}
+
 struct disk *disk_create(const char *name, unsigned int flags)
 {
     struct disk *d;
     struct container *c;
     int fd;
-    unsigned int rpm = flags >> DISKFL_rpm_shift;
+    unsigned int rpm = (flags & ~DISKFL_pipeline) >> DISKFL_rpm_shift;
 
-    if ((c = container_from_filename(name)) == NULL)
+    if (name == NULL) {
+        /* Anonymous scratch disk. */
+        c = &container_dsk;
+        fd = -1;
+    } else if ((c = container_from_filename(name)) == NULL) {
         return NULL;
-
-    if ((fd = file_open(name, O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1) {
+    } else if ((fd = file_open(name, O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1) {
         warn("%s", name);
         return NULL;
     }
 
     d = memalloc(sizeof(*d));
+    d->name = disk_name_dup(name);
     d->fd = fd;
-    d->read_only = 0;
+    d->read_only = (name == NULL);
     d->kryoflux_hack = !!(flags & DISKFL_kryoflux_hack);
     d->rpm = rpm ?: DEFAULT_RPM;
     d->container = c;
 
     c->init(d);
 
+    if ((flags & DISKFL_pipeline) && (name != NULL))
+        pipeline_start(d);
+
     return d;
 }
 
@@ -98,7 +146,7 @@ struct disk *disk_open(const char *name, unsigned int flags)
     struct disk *d;
     struct container *c;
     int fd, read_only = !!(flags & DISKFL_read_only);
-    unsigned int rpm = flags >> DISKFL_rpm_shift;
+    unsigned int rpm = (flags & ~DISKFL_pipeline) >> DISKFL_rpm_shift;
 
     if ((c = container_from_filename(name)) == NULL)
         return NULL;
@@ -109,6 +157,7 @@ struct disk *disk_open(const char *name, unsigned int flags)
     }
 
     d = memalloc(sizeof(*d));
+    d->name = disk_name_dup(name);
     d->fd = fd;
     d->read_only = read_only;
     d->kryoflux_hack = !!(flags & DISKFL_kryoflux_hack);
@@ -117,6 +166,8 @@ struct disk *disk_open(const char *name, unsigned int flags)
 
     if (!d->container) {
         warnx("%s: Bad disk image", name);
+        memfree(d->priv);
+        memfree(d->name);
         memfree(d);
         return NULL;
     }
@@ -124,14 +175,33 @@ struct disk *disk_open(const char *name, unsigned int flags)
     return d;
 }
 
+void disk_set_encode_timer(struct disk *d, uint64_t *ns)
+{
+    d->encode_ns = ns;
+}
+
+void track_load(struct disk *d, unsigned int tracknr)
+{
+    /* Containers may initialise tracks within open(), before d->container
+     * is set: there is nothing deferred to load at that point. */
+    if ((d->container != NULL) && d->container->load_track
+        && (tracknr < d->di->nr_tracks))
+        d->container->load_track(d, tracknr);
+}
+
 void disk_close(struct disk *d)
 {
     struct disk_list_tag *dltag;
     struct disk_info *di = d->di;
     unsigned int i;
 
-    if (!d->read_only)
+    pipeline_stop(d);
+    if (!d->read_only) {
+        uint64_t t = trace_begin();
         d->container->close(d);
+        trace_end(t, "container", "close", -1, d->name);
+    }
+    pipeline_free(d);
 
     dltag = d->tags;
     while (dltag != NULL) {
@@ -144,7 +214,10 @@ void disk_close(struct disk *d)
         memfree(di->track[i].dat);
     memfree(di->track);
     memfree(di);
-    close(d->fd);
+    memfree(d->priv);
+    memfree(d->name);
+    if (d->fd != -1)
+        close(d->fd);
     memfree(d);
 }
 
@@ -153,6 +226,140 @@ struct disk_info *disk_get_info(struct disk *d)
     return d->di;
 }
 
+struct disk_info *disk_get_loaded_info(struct disk *d)
+{
+    unsigned int i;
+
+    for (i = 0; i < d->di->nr_tracks; i++)
+        track_load(d, i);
+
+    return d->di;
+}
+
+struct track_info *track_get_info(struct disk *d, unsigned int tracknr)
+{
+    if (tracknr >= d->di->nr_tracks)
+        return NULL;
+    track_load(d, tracknr);
+    return &d->di->track[tracknr];
+}
+
+unsigned int disk_get_nr_tracks(struct disk *d)
+{
+    return d->di->nr_tracks;
+}
+
+void disk_copy(struct disk *dst, struct disk *src)
+{
+    /* Load @dst too, so that no deferred load overwrites the copy. */
+    struct disk_info *sdi = disk_get_loaded_info(src);
+    struct disk_info *ddi = disk_get_loaded_info(dst);
+    struct disk_list_tag *dltag, **pprevtag;
+    struct track_info *ti;
+    unsigned int i;
+
+    for (i = 0; i < ddi->nr_tracks; i++) {
+        pipeline_invalidate(dst, i);
+        memfree(ddi->track[i].dat);
+    }
+    memfree(ddi->track);
+
+    ddi->nr_tracks = sdi->nr_tracks;
+    ddi->flags = sdi->flags;
+    ddi->track = memalloc(sdi->nr_tracks * sizeof(*ti));
+    for (i = 0; i < sdi->nr_tracks; i++) {
+        ti = &ddi->track[i];
+        *ti = sdi->track[i];
+        ti->dat = memalloc(ti->len);
+        memcpy(ti->dat, sdi->track[i].dat, ti->len);
+    }
+
+    dltag = dst->tags;
+    while (dltag != NULL) {
+        struct disk_list_tag *nxt = dltag->next;
+        memfree(dltag);
+        dltag = nxt;
+    }
+
+    pprevtag = &dst->tags;
+    for (dltag = src->tags; dltag != NULL; dltag = dltag->next) {
+        *pprevtag = memalloc(sizeof(*dltag) + dltag->tag.len);
+        memcpy(*pprevtag, dltag, sizeof(*dltag) + dltag->tag.len);
+        pprevtag = &(*pprevtag)->next;
+    }
+    *pprevtag = NULL;
+}
+
+void track_compute_digest(const struct track_info *ti, uint8_t *digest)
+{
+    struct sha256_ctx ctx;
+    struct { uint16_t type, flags; uint32_t len; } key;
+
+    key.type = htobe16(ti->type);
+    key.flags = htobe16(ti->flags);
+    key.len = htobe32(ti->len);
+
+    sha256_init(&ctx);
+    sha256_add(&ctx, &key, sizeof(key));
+    sha256_add(&ctx, ti->dat, ti->len);
+    sha256_final(&ctx, digest);
+}
+
+void track_get_digest(struct disk *d, unsigned int tracknr, uint8_t *digest)
+{
+    if (d->container->get_track_digest
+        && (d->container->get_track_digest(d, tracknr, digest) == 0))
+        return;
+
+    track_load(d, tracknr);
+    track_compute_digest(&d->di->track[tracknr], digest);
+}
+
+void disk_get_digest(struct disk *d, uint8_t *digest)
+{
+    struct disk_info *di = d->di;
+    struct track_info *ti;
+    struct disk_list_tag *dltag;
+    struct sha256_ctx ctx;
+    uint8_t track_digest[DISK_DIGEST_LEN];
+    struct {
+        uint16_t type, flags, nr_sectors, bytes_per_sector;
+        uint32_t data_bitoff, total_bits;
+    } th;
+    uint16_t x[2];
+    unsigned int i;
+
+    sha256_init(&ctx);
+
+    x[0] = htobe16(di->nr_tracks);
+    x[1] = htobe16(di->flags);
+    sha256_add(&ctx, x, sizeof(x));
+
+    for (i = 0; i < di->nr_tracks; i++) {
+        /* First, as it may load the track. */
+        track_get_digest(d, i, track_digest);
+        ti = &di->track[i];
+        th.type = htobe16(ti->type);
+        th.flags = htobe16(ti->flags);
+        th.nr_sectors = htobe16(ti->nr_sectors);
+        th.bytes_per_sector = htobe16(ti->bytes_per_sector);
+        th.data_bitoff = htobe32(ti->data_bitoff);
+        th.total_bits = htobe32(ti->total_bits);
+        sha256_add(&ctx, &th, sizeof(th));
+        sha256_add(&ctx, ti->valid_sectors, sizeof(ti->valid_sectors));
+        sha256_add(&ctx, track_digest, sizeof(track_digest));
+    }
+
+    for (dltag = d->tags; dltag != NULL; dltag = dltag->next) {
+        x[0] = htobe16(dltag->tag.id);
+        x[1] = htobe16(dltag->tag.len);
+        sha256_add(&ctx, x, sizeof(x));
+        sha256_add(&ctx, &dltag->tag + 1, dltag->tag.len);
+    }
+
+    sha256_final(&ctx, digest);
+}
+
 struct track_raw *track_alloc_raw_buffer(struct disk *d)
 {
     struct tbuf *tbuf = memalloc(sizeof(*tbuf));
@@ -166,6 +373,7 @@ void track_free_raw_buffer(struct track_raw *track_raw)
     struct tbuf *tbuf = container_of(track_raw, struct tbuf, raw);
 
     track_purge_raw_buffer(track_raw);
+    memfree(tbuf->weak_ext);
     memfree(tbuf);
 }
 
@@ -177,17 +385,26 @@ void track_purge_raw_buffer(struct track_raw *track_raw)
 }
 
 void track_read_raw(struct track_raw *track_raw, unsigned int tracknr)
+{
+    if (pipeline_take(track_raw, tracknr) != 0)
+        __track_read_raw(track_raw, tracknr);
+}
+
+void __track_read_raw(struct track_raw *track_raw, unsigned int tracknr)
 {
     struct tbuf *tbuf = container_of(track_raw, struct tbuf, raw);
     struct disk *d = tbuf->disk;
     struct disk_info *di = d->di;
     struct track_info *ti;
     const struct track_handler *thnd;
+    uint64_t t = (d->encode_ns != NULL) ? time_ns() : 0;
+    uint64_t span = trace_begin();
 
     track_purge_raw_buffer(track_raw);
 
     if (tracknr >= di->nr_tracks)
         return;
+    track_load(d, tracknr);
     ti = &di->track[tracknr];
 
     if ((int32_t)ti->total_bits > 0)
@@ -197,6 +414,11 @@ void track_read_raw(struct track_raw *track_raw, unsigned int tracknr)
     thnd->read_raw(d, tracknr, tbuf);
 
     tbuf_finalise(tbuf);
+
+    if (d->encode_ns != NULL)
+        d->encode_ns[tracknr] += time_ns() - t;
+    trace_end(span, "encode", disk_get_format_id_name(ti->type), tracknr,
+              NULL);
 }
 
 int track_write_raw(
@@ -217,11 +439,20 @@ int track_write_raw_from_stream(
 {
     struct disk_info *di = d->di;
     struct track_info *ti = &di->track[tracknr];
+    int rc;
+
+    pipeline_invalidate(d, tracknr);
+    pipeline_hold(d, tracknr);
 
+    track_load(d, tracknr);
     memfree(ti->dat);
     ti->dat = NULL;
 
-    return d->container->write_raw(d, tracknr, type, s);
+    rc = d->container->write_raw(d, tracknr, type, s);
+
+    pipeline_queue(d, tracknr);
+    pipeline_release(d);
+    return rc;
 }
 
 struct sbuf {
@@ -263,6 +494,7 @@ int track_read_sectors(
 
     if (tracknr >= di->nr_tracks)
         return -1;
+    track_load(d, tracknr);
     ti = &di->track[tracknr];
 
     thnd = handlers[ti->type];
@@ -283,9 +515,13 @@ int track_write_sectors(
     struct track_info *ti;
     const struct track_handler *thnd;
     unsigned int ns_per_cell = 0;
+    int rc = 0;
 
     if (tracknr >= di->nr_tracks)
         return -1;
+    pipeline_invalidate(d, tracknr);
+    pipeline_hold(d, tracknr);
+    track_load(d, tracknr);
     ti = &di->track[tracknr];
 
     memfree(ti->dat);
@@ -309,12 +545,16 @@ int track_write_sectors(
     if (ti->dat == NULL)
         goto fail;
 
-    return 0;
+out:
+    pipeline_queue(d, tracknr);
+    pipeline_release(d);
+    return rc;
 
 fail:
     track_mark_unformatted(d, tracknr);
     ti->typename = "Unformatted*";
-    return -1;
+    rc = -1;
+    goto out;
 }
 
 void track_mark_unformatted(
@@ -323,10 +563,13 @@ void track_mark_unformatted(
     struct disk_info *di = d->di;
     struct track_info *ti = &di->track[tracknr];
 
+    pipeline_invalidate(d, tracknr);
+    track_load(d, tracknr);
     memfree(ti->dat);
     memset(ti, 0, sizeof(*ti));
     init_track_info(ti, TRKTYP_unformatted);
     ti->total_bits = TRK_WEAK;
+    pipeline_queue(d, tracknr);
 }
 
 struct disktag *disk_get_tag_by_id(struct disk *d, uint16_t id)
@@ -353,6 +596,18 @@ struct disktag *disk_set_tag(
     struct disk *d, uint16_t id, uint16_t len, void *dat)
 {
     struct disk_list_tag *dltag, **pprev;
+    struct disktag *tag;
+
+    /* Track handlers may be reading tags in the pipeline worker. */
+    pipeline_pause(d);
+
+    /* Overwrite an existing same-sized tag in place, so that pointers
+     * previously returned for this tag remain valid. */
+    if (((tag = disk_get_tag_by_id(d, id)) != NULL) && (tag->len == len)) {
+        memcpy(tag + 1, dat, len);
+        pipeline_resume(d);
+        return tag;
+    }
 
     dltag = memalloc(sizeof(*dltag) + len);
     dltag->tag.id = id;
@@ -372,6 +627,7 @@ struct disktag *disk_set_tag(
         break;
     }
 
+    pipeline_resume(d);
     return &dltag->tag;
 }
 
@@ -382,6 +638,15 @@ const char *disk_get_format_id_name(enum track_type type)
     return track_format_names[type].id_name;
 }
 
+int disk_get_format_id_by_name(const char *name)
+{
+    unsigned int h = hash_name(name), type;
+    while ((type = name_hash[h++ % NAME_HASH_SIZE]) != 0)
+        if (!strcmp(track_format_names[type-1].id_name, name))
+            return type - 1;
+    return -1;
+}
+
 const char *disk_get_format_desc_name(enum track_type type)
 {
     if (type >= ARRAY_SIZE(track_format_names))
@@ -401,6 +666,7 @@ void track_get_format_name(
         return;
     }
 
+    track_load(d, tracknr);
     ti = &di->track[tracknr];
     thnd = handlers[ti->type];
 
@@ -467,6 +733,7 @@ static void append_bit(struct tbuf *tbuf, uint16_t speed, uint8_t x)
 {
     change_bit(tbuf->raw.bits, tbuf->pos, x);
     tbuf->raw.speed[tbuf->pos] = speed;
+    counter_inc(ctr_tbuf_bits);
     if (++tbuf->pos >= tbuf->raw.bitlen)
         tbuf->pos = 0;
 }
@@ -478,6 +745,13 @@ static void tbuf_bit(
     if (enc == bc_mfm) {
         /* Clock bit */
         uint8_t clk = !(tbuf->prev_data_bit | dat);
+        /* Does it depend on the last data bit of a weak extent? */
+        if (tbuf->nr_weak_ext != 0) {
+            struct tbuf_weak_extent *ext =
+                &tbuf->weak_ext[tbuf->nr_weak_ext-1];
+            if (ext->end == tbuf->pos)
+                ext->clk_after = 1;
+        }
         append_bit(tbuf, speed, clk);
     }
 
@@ -496,6 +770,8 @@ void tbuf_init(struct tbuf *tbuf, uint32_t bitstart, uint32_t bitlen)
     tbuf->bit = tbuf_bit;
     tbuf->gap = NULL;
     tbuf->weak = NULL;
+    tbuf->nr_weak_ext = 0;
+    tbuf->weak_ext_valid = 1;
 
     memset(&tbuf->raw, 0, sizeof(tbuf->raw));
     tbuf->raw.bitlen = bitlen;
@@ -624,17 +900,89 @@ void tbuf_set_gap_fill_byte(struct tbuf *tbuf, uint8_t byte)
     tbuf->gap_fill_byte = byte;
 }
 
+/* Record the extent of @bits MFM-encoded weak bits about to be emitted. */
+static void tbuf_note_weak(struct tbuf *tbuf, unsigned int bits)
+{
+    struct tbuf_weak_extent *ext;
+    unsigned int nr = bits * 2;
+
+    if (tbuf->bit != tbuf_bit) {
+        tbuf->weak_ext_valid = 0;
+        return;
+    }
+
+    ext = tbuf->nr_weak_ext ? &tbuf->weak_ext[tbuf->nr_weak_ext-1] : NULL;
+    if ((ext == NULL) || (ext->end != tbuf->pos)) {
+        if (tbuf->nr_weak_ext == tbuf->max_weak_ext) {
+            struct tbuf_weak_extent *old = tbuf->weak_ext;
+            tbuf->max_weak_ext = tbuf->max_weak_ext * 2 ?: 8;
+            tbuf->weak_ext = memalloc(
+                tbuf->max_weak_ext * sizeof(*tbuf->weak_ext));
+            memcpy(tbuf->weak_ext, old,
+                   tbuf->nr_weak_ext * sizeof(*tbuf->weak_ext));
+            memfree(old);
+        }
+        ext = &tbuf->weak_ext[tbuf->nr_weak_ext++];
+        ext->start = tbuf->pos;
+        ext->nr = 0;
+        ext->prev_data_bit = tbuf->prev_data_bit;
+    }
+
+    /* Contiguous weak bits extend the previous extent. */
+    ext->nr += nr;
+    ext->end = (ext->start + ext->nr) % tbuf->raw.bitlen;
+    ext->clk_after = 0;
+}
+
 void tbuf_weak(struct tbuf *tbuf, unsigned int bits)
 {
     tbuf->raw.has_weak_bits = 1;
     if (tbuf->weak != NULL) {
         tbuf->weak(tbuf, bits);
     } else {
+        tbuf_note_weak(tbuf, bits);
         while (bits--)
             tbuf->bit(tbuf, SPEED_WEAK, bc_mfm, tbuf_rnd16(tbuf) & 1);
     }
 }
 
+int track_regen_weak_bits(struct track_raw *raw)
+{
+    struct tbuf *tbuf = container_of(raw, struct tbuf, raw);
+    struct tbuf_weak_extent *ext;
+    unsigned int i, j, pos, nxt;
+    uint8_t prev, dat;
+
+    if (!raw->has_weak_bits)
+        return 0;
+    if (!tbuf->weak_ext_valid || (tbuf->nr_weak_ext == 0))
+        return -1;
+
+    /* Draw random bits in the same order as the track handler did. */
+    for (i = 0; i < tbuf->nr_weak_ext; i++) {
+        ext = &tbuf->weak_ext[i];
+        pos = ext->start;
+        prev = ext->prev_data_bit;
+        for (j = 0; j < ext->nr; j += 2) {
+            dat = tbuf_rnd16(tbuf) & 1;
+            change_bit(raw->bits, pos, !(prev | dat));
+            if (++pos >= raw->bitlen)
+                pos = 0;
+            change_bit(raw->bits, pos, dat);
+            if (++pos >= raw->bitlen)
+                pos = 0;
+            prev = dat;
+        }
+        if (ext->clk_after) {
+            nxt = (pos + 1 < raw->bitlen) ? pos + 1 : 0;
+            dat = (raw->bits[nxt>>3] >> (~nxt&7)) & 1;
+            change_bit(raw->bits, pos, !(prev | dat));
+        }
+    }
+
+    return 0;
+}
+
 void tbuf_start_crc(struct tbuf *tbuf)
 {
     tbuf->crc16_ccitt = 0xffff;
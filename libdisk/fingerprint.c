@@ -0,0 +1,240 @@
+/*
+ * fingerprint.c
+ *
+ * Cheap per-track signatures for identifying a disk before it is decoded.
+ * A track's fingerprint is its length in bitcells plus a count of each of a
+ * table of well-known sync words, gathered in a single revolution.
+ *
+ * Written in 2026 by agent
+ */
+
+#include <libdisk/util.h>
+#include <libdisk/stream.h>
+#include <libdisk/analyse.h>
+
+/* Raw sync words which are common in the track formats we understand. */
+static const uint16_t fp_syncs[FP_NR_SYNCS] = {
+    0x4489, /* MFM A1 (Amiga, IBM MFM) */
+    0x5224, /* MFM C2 (IBM index mark) */
+    0x4488, 0x4429, 0x448a, 0x44a9, /* Variants of MFM A1 */
+    0xa144, 0xa145, 0xa245, 0x8944, 0x924a, 0x9521, /* Custom loaders */
+    0x4891, 0x1448, /* RNC PDOS and friends */
+    0xf57e, 0xf56f  /* FM IDAM and DAM, with clocks */
+};
+
+/* Raw word -> (index into fp_syncs[] + 1), or 0 if not a sync word. */
+static uint8_t fp_sync_idx[65536];
+
+static void __initcall fp_sync_idx_init(void)
+{
+    unsigned int i;
+    for (i = 0; i < FP_NR_SYNCS; i++)
+        fp_sync_idx[fp_syncs[i]] = i + 1;
+}
+
+int track_fingerprint(
+    struct stream *s, unsigned int tracknr, struct track_fingerprint *fp)
+{
+    unsigned int i;
+
+    memset(fp, 0, sizeof(*fp));
+
+    if (stream_select_track(s, tracknr) != 0)
+        return -1;
+
+    /* stream_select_track() leaves us at the first index pulse. */
+    while (s->nr_index < 2) {
+        if (stream_next_bit(s) == -1)
+            return -1;
+        if ((i = fp_sync_idx[(uint16_t)s->word]) && (fp->sync[i-1] != 0xffff))
+            fp->sync[i-1]++;
+    }
+
+    fp->bitlen = s->track_len_bc;
+    return 0;
+}
+
+struct disk_fingerprint *disk_fingerprint_stream(
+    struct stream *s, const char *title, unsigned int nr_tracks)
+{
+    struct disk_fingerprint *dfp = memalloc(sizeof(*dfp));
+    unsigned int i;
+
+    dfp->title = memalloc(strlen(title) + 1);
+    strcpy(dfp->title, title);
+    dfp->nr_tracks = nr_tracks;
+    dfp->track = memalloc(nr_tracks * sizeof(*dfp->track));
+
+    stream_set_track_order(s, 0, nr_tracks - 1, 1);
+    for (i = 0; i < nr_tracks; i++)
+        (void)track_fingerprint(s, i, &dfp->track[i]);
+
+    return dfp;
+}
+
+void disk_fingerprint_free(struct disk_fingerprint *dfp)
+{
+    memfree(dfp->title);
+    memfree(dfp->track);
+    memfree(dfp);
+}
+
+/* Per-track similarity, 0..1000: ratio of shared to total sync words,
+ * halved if the track lengths differ by more than 2%. */
+static unsigned int track_score(
+    const struct track_fingerprint *a, const struct track_fingerprint *b)
+{
+    unsigned int i, shared = 0, total = 0, score;
+
+    for (i = 0; i < FP_NR_SYNCS; i++) {
+        shared += min(a->sync[i], b->sync[i]);
+        total += max(a->sync[i], b->sync[i]);
+    }
+
+    score = total ? (shared * 1000) / total : 1000;
+    if ((abs((int)a->bitlen - (int)b->bitlen) * 50)
+        > max(a->bitlen, b->bitlen))
+        score /= 2;
+
+    return score;
+}
+
+unsigned int disk_fingerprint_score(
+    const struct disk_fingerprint *a, const struct disk_fingerprint *b)
+{
+    const struct track_fingerprint *ta, *tb;
+    unsigned int i, nr = 0, score = 0;
+
+    for (i = 0; i < max(a->nr_tracks, b->nr_tracks); i++) {
+        ta = (i < a->nr_tracks) ? &a->track[i] : NULL;
+        tb = (i < b->nr_tracks) ? &b->track[i] : NULL;
+        if ((ta == NULL) || (ta->bitlen == 0)) {
+            /* Tracks missing from both fingerprints don't count. */
+            if ((tb != NULL) && (tb->bitlen != 0))
+                nr++;
+            continue;
+        }
+        nr++;
+        if ((tb != NULL) && (tb->bitlen != 0))
+            score += track_score(ta, tb);
+    }
+
+    return nr ? score / nr : 0;
+}
+
+/*
+ * Fingerprint database: a text file of entries, each a quoted title and
+ * track count, followed by one line per present track:
+ *  <tracknr> <bitlen> <sync count>...
+ */
+
+int fingerprint_db_append(
+    const char *name, const struct disk_fingerprint *dfp)
+{
+    const struct track_fingerprint *fp;
+    unsigned int i, j;
+    FILE *f;
+
+    if ((f = fopen(name, "a")) == NULL) {
+        warn("%s", name);
+        return -1;
+    }
+
+    fprintf(f, "\"%s\" %u\n", dfp->title, dfp->nr_tracks);
+    for (i = 0; i < dfp->nr_tracks; i++) {
+        fp = &dfp->track[i];
+        if (fp->bitlen == 0)
+            continue;
+        fprintf(f, "%u %u", i, fp->bitlen);
+        for (j = 0; j < FP_NR_SYNCS; j++)
+            fprintf(f, " %u", fp->sync[j]);
+        fprintf(f, "\n");
+    }
+
+    if (fclose(f) != 0) {
+        warn("%s", name);
+        return -1;
+    }
+
+    return 0;
+}
+
+struct disk_fingerprint **fingerprint_db_load(
+    const char *name, unsigned int *p_nr)
+{
+    struct disk_fingerprint **db, *dfp = NULL;
+    unsigned int nr = 0, max = 64, lnr = 0, tracknr, bitlen, i, n;
+    char line[512], *p, *q;
+    FILE *f;
+
+    if ((f = fopen(name, "r")) == NULL) {
+        warn("%s", name);
+        return NULL;
+    }
+
+    db = memalloc(max * sizeof(*db));
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lnr++;
+        p = line;
+        if ((*p == '#') || (*p == '\n') || (*p == '\0'))
+            continue;
+        if (*p == '"') {
+            if (((q = strchr(p+1, '"')) == NULL)
+                || (sscanf(q+1, "%u", &n) != 1) || (n > 1000)) {
+                warnx("error at %s:%u: bad title line", name, lnr);
+                goto fail;
+            }
+            *q = '\0';
+            if (nr == max) {
+                struct disk_fingerprint **old = db;
+                max *= 2;
+                db = memalloc(max * sizeof(*db));
+                memcpy(db, old, nr * sizeof(*db));
+                memfree(old);
+            }
+            dfp = db[nr++] = memalloc(sizeof(*dfp));
+            dfp->title = memalloc(strlen(p+1) + 1);
+            strcpy(dfp->title, p+1);
+            dfp->nr_tracks = n;
+            dfp->track = memalloc(n * sizeof(*dfp->track));
+            continue;
+        }
+        if ((dfp == NULL)
+            || (sscanf(p, "%u %u%n", &tracknr, &bitlen, &n) != 2)
+            || (tracknr >= dfp->nr_tracks))
+            goto bad_track;
+        dfp->track[tracknr].bitlen = bitlen;
+        p += n;
+        for (i = 0; i < FP_NR_SYNCS; i++) {
+            unsigned long c = strtoul(p, &q, 10);
+            if ((q == p) || (c > 0xffff))
+                goto bad_track;
+            dfp->track[tracknr].sync[i] = c;
+            p = q;
+        }
+    }
+
+    fclose(f);
+    *p_nr = nr;
+    return db;
+
+bad_track:
+    warnx("error at %s:%u: bad track line", name, lnr);
+fail:
+    for (i = 0; i < nr; i++)
+        disk_fingerprint_free(db[i]);
+    memfree(db);
+    fclose(f);
+    return NULL;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -344,6 +344,7 @@ static const uint16_t d3_t5_syncs[] = {
 static unsigned int disknr(struct disk *d, unsigned int tracknr)
 {
     struct track_info *ti = &d->di->track[1];
+    track_load(d, 1);
     return (ti->type == TRKTYP_deep_core) ? ti->dat[0] : (tracknr < 2) ? 2 : 0;
 }
 
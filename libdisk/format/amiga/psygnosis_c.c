@@ -139,6 +139,7 @@ static bool_t track_metadata(
     if (ti->type != TRKTYP_psygnosis_c_track0)
         return 0;
 
+    track_load(d, 0);
     h = (struct h *)(ti->dat + 512*11);
 
     memcpy(mdat->id, &h->id, 4);
@@ -58,11 +58,13 @@ static void *ratt_dos_write_raw(
 
     if (tracknr != 2) {
         struct track_info *t2 = &d->di->track[2];
-        struct ratt_file *f = (struct ratt_file *)&t2->dat[0xbc];
+        struct ratt_file *f;
         if ((t2->type != TRKTYP_ratt_dos_1800) &&
             (t2->type != TRKTYP_ratt_dos_1810) &&
             (t2->type != TRKTYP_ratt_dos_sync_8944))
             return NULL;
+        track_load(d, 2);
+        f = (struct ratt_file *)&t2->dat[0xbc];
         while (f->name[0] != '\0') {
             uint8_t last_trk = f->first_trk + f->nr_trks - 1;
             if ((f->first_trk <= 80) && (last_trk >= 80))
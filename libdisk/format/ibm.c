@@ -245,6 +245,7 @@ static void *ibm_mfm_write_raw(
          * skip the sector data in this case. CRC errors can also happen from
          * cross-talk (40-track disk read as 80-track). */
         if (idam.crc) {
+            counter_inc(ctr_crc_errors);
 #if CRC_DEBUG
             /* Warn if we are recovering */
             if (is_recovery_type(ti->type)) {
@@ -283,6 +284,8 @@ static void *ibm_mfm_write_raw(
 
         /* Skip bad data CRC unless we are doing data recovery. */
         crc = s->crc16_ccitt;
+        if (crc)
+            counter_inc(ctr_crc_errors);
         if (crc && !is_recovery_type(ti->type))
             continue;
 
@@ -828,6 +831,7 @@ static void *ibm_fm_write_raw(
          * skip the sector data in this case. CRC errors can also happen from
          * cross-talk (40-track disk read as 80-track). */
         if (idam.crc) {
+            counter_inc(ctr_crc_errors);
 #if CRC_DEBUG
             /* Warn if we are recovering */
             if (is_recovery_type(ti->type)) {
@@ -896,6 +900,8 @@ static void *ibm_fm_write_raw(
         }
 
         /* Skip bad data CRC unless we are doing data recovery. */
+        if (crc)
+            counter_inc(ctr_crc_errors);
         if (crc && !is_recovery_type(ti->type))
             continue;
 
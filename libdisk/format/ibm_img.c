@@ -46,8 +46,10 @@ static void *ibm_img_write_raw(
             continue;
 
     redo_idam:
-        if (s->crc16_ccitt)
+        if (s->crc16_ccitt) {
+            counter_inc(ctr_crc_errors);
             continue;
+        }
         /* PCs start numbering sectors at 1, other platforms start at 0. Shift
          * sector number as appropriate.  */
         idam.sec -= extra_data->sector_base;
@@ -83,8 +85,12 @@ static void *ibm_img_write_raw(
         if (mark != IBM_MARK_DAM)
             continue;
         if ((stream_next_bytes(s, dat, 2*sec_sz) == -1) ||
-            (stream_next_bits(s, 32) == -1) || s->crc16_ccitt)
+            (stream_next_bits(s, 32) == -1))
+            continue;
+        if (s->crc16_ccitt) {
+            counter_inc(ctr_crc_errors);
             continue;
+        }
 
         mfm_decode_bytes(bc_mfm, sec_sz, dat, dat);
         memcpy(&block[idam.sec*sec_sz], dat, sec_sz);
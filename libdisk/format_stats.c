@@ -0,0 +1,360 @@
+/*
+ * format_stats.c
+ *
+ * Persistent statistics of format trials, kept for each distinct format
+ * list. A list is identified by the names of its formats, so the same list
+ * reached through different plans, or in a later run, shares statistics.
+ *
+ * Each list is ordered by matches per unit time spent trying, with a prior
+ * of half a match over the list's average trial cost, so that untried
+ * formats keep their configured order and sit between the formats which
+ * often match and those which rarely do.
+ *
+ * Written in 2026 by agent
+ */
+
+#include <libdisk/util.h>
+#include <libdisk/analyse.h>
+#include <private/disk.h>
+
+/* Assumed cost of a trial in a list with no history. */
+#define DEFAULT_TRIAL_NS 1000000ull
+
+struct fs_entry {
+    uint16_t type;
+    /* Totals including this session, and this session alone. */
+    uint64_t attempts, wins, ns;
+    uint64_t new_attempts, new_wins, new_ns;
+};
+
+struct fs_list {
+    uint64_t key;
+    unsigned int nr, max;
+    struct fs_entry *ent;
+};
+
+struct format_stats {
+    char *name;
+    unsigned int nr_lists, max_lists;
+    struct fs_list *lists;
+    /* Lists of the plan most recently bound, with each list's entries in
+     * the order of its formats. The order of trials is kept here, leaving
+     * the plan itself untouched. */
+    unsigned int nr_bound, max_bound;
+    struct fs_binding {
+        const struct format_list *list;
+        struct fs_entry **ent;
+        unsigned int *order; /* list indexes, best first */
+        unsigned int win;    /* position in order[] of the last match */
+    } *bound;
+};
+
+static int cmp_name(const void *a, const void *b)
+{
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/* FNV-1a over the sorted names of the list's formats. */
+static uint64_t list_key(const struct format_list *list)
+{
+    const char *names[list->nr], *p;
+    uint64_t h = 0xcbf29ce484222325ull;
+    unsigned int i;
+
+    for (i = 0; i < list->nr; i++)
+        names[i] = disk_get_format_id_name(list->ent[i]);
+    qsort(names, list->nr, sizeof(names[0]), cmp_name);
+    for (i = 0; i < list->nr; i++) {
+        for (p = names[i]; *p != '\0'; p++)
+            h = (h ^ (uint8_t)*p) * 0x100000001b3ull;
+        h = (h ^ ' ') * 0x100000001b3ull;
+    }
+
+    return h;
+}
+
+static struct fs_list *find_list(struct format_stats *fs, uint64_t key)
+{
+    struct fs_list *l;
+    unsigned int i;
+
+    for (i = 0; i < fs->nr_lists; i++)
+        if (fs->lists[i].key == key)
+            return &fs->lists[i];
+
+    /* Binding pointers into the old array are not kept across a grow. */
+    BUG_ON(fs->nr_bound != 0);
+    fs->lists = memgrow(fs->lists, &fs->max_lists, fs->nr_lists, sizeof(*l));
+    l = &fs->lists[fs->nr_lists++];
+    memset(l, 0, sizeof(*l));
+    l->key = key;
+    return l;
+}
+
+static struct fs_entry *find_entry(struct fs_list *l, uint16_t type)
+{
+    struct fs_entry *e;
+    unsigned int i;
+
+    for (i = 0; i < l->nr; i++)
+        if (l->ent[i].type == type)
+            return &l->ent[i];
+
+    l->ent = memgrow(l->ent, &l->max, l->nr, sizeof(*e));
+    e = &l->ent[l->nr++];
+    memset(e, 0, sizeof(*e));
+    e->type = type;
+    return e;
+}
+
+/* Read statistics file @name into @fs, adding to what is there already.
+ * Returns -1 if the file does not exist. Entries for formats which are no
+ * longer known are dropped. */
+static int read_stats(struct format_stats *fs, const char *name)
+{
+    unsigned long long key, attempts, wins, ns;
+    char line[256], fmt[128];
+    struct fs_entry *e;
+    unsigned int lnr = 0;
+    int type;
+    FILE *f;
+
+    if ((f = fopen(name, "r")) == NULL)
+        return -1;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lnr++;
+        if ((line[0] == '#') || (line[0] == '\n'))
+            continue;
+        if (sscanf(line, "%llx %127s %llu %llu %llu",
+                   &key, fmt, &attempts, &wins, &ns) != 5) {
+            warnx("%s:%u: ignoring bad statistics line", name, lnr);
+            continue;
+        }
+        if ((type = disk_get_format_id_by_name(fmt)) < 0)
+            continue;
+        e = find_entry(find_list(fs, key), type);
+        e->attempts += attempts;
+        e->wins += wins;
+        e->ns += ns;
+    }
+
+    fclose(f);
+    return 0;
+}
+
+void format_stats_unbind(struct format_stats *fs)
+{
+    unsigned int i;
+
+    for (i = 0; i < fs->nr_bound; i++) {
+        memfree(fs->bound[i].ent);
+        memfree(fs->bound[i].order);
+    }
+    fs->nr_bound = 0;
+}
+
+static void free_lists(struct format_stats *fs)
+{
+    unsigned int i;
+
+    format_stats_unbind(fs);
+    for (i = 0; i < fs->nr_lists; i++)
+        memfree(fs->lists[i].ent);
+    memfree(fs->lists);
+    memfree(fs->bound);
+}
+
+struct format_stats *format_stats_open(const char *name)
+{
+    struct format_stats *fs = memalloc(sizeof(*fs));
+
+    fs->name = memalloc(strlen(name) + 1);
+    strcpy(fs->name, name);
+    (void)read_stats(fs, name);
+
+    return fs;
+}
+
+/* Merge this session's trials into the file as it is now, so that runs
+ * which overlapped ours are not overwritten. */
+static void write_stats(struct format_stats *fs)
+{
+    struct format_stats *cur = memalloc(sizeof(*cur));
+    struct fs_list *l, *cl;
+    struct fs_entry *e, *ce;
+    unsigned int i, j;
+    FILE *f;
+
+    (void)read_stats(cur, fs->name);
+    for (i = 0; i < fs->nr_lists; i++) {
+        l = &fs->lists[i];
+        for (j = 0; j < l->nr; j++) {
+            e = &l->ent[j];
+            if (e->new_attempts == 0)
+                continue;
+            ce = find_entry(find_list(cur, l->key), e->type);
+            ce->attempts += e->new_attempts;
+            ce->wins += e->new_wins;
+            ce->ns += e->new_ns;
+        }
+    }
+
+    if ((f = fopen(fs->name, "w")) == NULL) {
+        warn("%s: statistics not updated", fs->name);
+        goto out;
+    }
+    fprintf(f, "# disk-analyse format trials: "
+            "<list> <format> <attempts> <matches> <nanoseconds>\n");
+    for (i = 0; i < cur->nr_lists; i++) {
+        cl = &cur->lists[i];
+        for (j = 0; j < cl->nr; j++) {
+            ce = &cl->ent[j];
+            fprintf(f, "%016llx %s %llu %llu %llu\n",
+                    (unsigned long long)cl->key,
+                    disk_get_format_id_name(ce->type),
+                    (unsigned long long)ce->attempts,
+                    (unsigned long long)ce->wins,
+                    (unsigned long long)ce->ns);
+        }
+    }
+    if (fclose(f) != 0)
+        warn("%s: statistics not updated", fs->name);
+
+out:
+    free_lists(cur);
+    memfree(cur);
+}
+
+void format_stats_close(struct format_stats *fs)
+{
+    unsigned int i, j;
+    bool_t dirty = FALSE;
+
+    for (i = 0; i < fs->nr_lists; i++)
+        for (j = 0; j < fs->lists[i].nr; j++)
+            dirty |= (fs->lists[i].ent[j].new_attempts != 0);
+    if (dirty)
+        write_stats(fs);
+
+    free_lists(fs);
+    memfree(fs->name);
+    memfree(fs);
+}
+
+/* Matches per unit time, scaled to avoid underflow. */
+static double score(const struct fs_entry *e, uint64_t prior_ns)
+{
+    return (e->wins + 0.5) * 1e9 / (e->ns + prior_ns);
+}
+
+void format_stats_bind(struct format_stats *fs, struct format_list **plan)
+{
+    struct format_list *list;
+    struct fs_binding *b;
+    struct fs_list *l;
+    uint64_t attempts, ns, prior_ns;
+    unsigned int i, j, k, idx;
+
+    format_stats_unbind(fs);
+
+    /* Create every list and entry first, as doing so may move them. */
+    for (i = 0; i < FORMAT_PLAN_TRACKS; i++) {
+        if ((list = plan[i]) == NULL)
+            continue;
+        l = find_list(fs, list_key(list));
+        for (j = 0; j < list->nr; j++)
+            (void)find_entry(l, list->ent[j]);
+    }
+
+    for (i = 0; i < FORMAT_PLAN_TRACKS; i++) {
+        if (((list = plan[i]) == NULL) || (list->nr == 0))
+            continue;
+        for (j = 0; j < fs->nr_bound; j++)
+            if (fs->bound[j].list == list)
+                break;
+        if (j != fs->nr_bound)
+            continue;
+
+        fs->bound = memgrow(fs->bound, &fs->max_bound, fs->nr_bound,
+                            sizeof(*b));
+        b = &fs->bound[fs->nr_bound++];
+        b->list = list;
+        b->ent = memalloc(list->nr * sizeof(*b->ent));
+        b->order = memalloc(list->nr * sizeof(*b->order));
+        b->win = 0;
+        l = find_list(fs, list_key(list));
+        for (j = 0; j < list->nr; j++) {
+            b->ent[j] = find_entry(l, list->ent[j]);
+            b->order[j] = j;
+        }
+
+        attempts = ns = 0;
+        for (j = 0; j < list->nr; j++) {
+            attempts += b->ent[j]->attempts;
+            ns += b->ent[j]->ns;
+        }
+        prior_ns = attempts ? ns / attempts : DEFAULT_TRIAL_NS;
+
+        /* Stable insertion sort, best first. */
+        for (j = 1; j < list->nr; j++) {
+            idx = b->order[j];
+            for (k = j; (k > 0) && (score(b->ent[idx], prior_ns)
+                                    > score(b->ent[b->order[k-1]],
+                                            prior_ns)); k--)
+                b->order[k] = b->order[k-1];
+            b->order[k] = idx;
+        }
+    }
+}
+
+static struct fs_binding *find_binding(
+    struct format_stats *fs, const struct format_list *list)
+{
+    unsigned int i;
+
+    for (i = 0; i < fs->nr_bound; i++)
+        if (fs->bound[i].list == list)
+            return &fs->bound[i];
+    BUG();
+}
+
+unsigned int format_stats_trial(
+    struct format_stats *fs, const struct format_list *list, unsigned int j)
+{
+    struct fs_binding *b = find_binding(fs, list);
+
+    /* The last format to match goes first, then the rest in order. */
+    if (j == 0)
+        return b->order[b->win];
+    return b->order[(j <= b->win) ? j - 1 : j];
+}
+
+void format_stats_record(
+    struct format_stats *fs, const struct format_list *list,
+    unsigned int idx, bool_t won, uint64_t ns)
+{
+    struct fs_binding *b = find_binding(fs, list);
+    struct fs_entry *e = b->ent[idx];
+
+    if (won)
+        for (b->win = 0; b->order[b->win] != idx; b->win++)
+            continue;
+
+    e->attempts++;
+    e->new_attempts++;
+    e->wins += won;
+    e->new_wins += won;
+    e->ns += ns;
+    e->new_ns += ns;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,150 @@
+/*
+ * libdisk/analyse.h
+ *
+ * Batch analysis of flux streams into disk images, driven by a format plan
+ * parsed from a disk-analyse formats config file.
+ *
+ * Written in 2026 by agent
+ */
+
+#ifndef __LIBDISK_ANALYSE_H__
+#define __LIBDISK_ANALYSE_H__
+
+#include <stdint.h>
+
+struct disk;
+struct stream;
+struct format_stats;
+
+/* A format plan has a format list for each of this many tracks. */
+#define FORMAT_PLAN_TRACKS 200
+
+/* Candidate formats for a track, tried in rotation starting at @pos. Lists
+ * are shared between tracks, and @pos is left at the most recently matched
+ * format. A NULL list means the track is ignored. */
+struct format_list {
+    uint16_t nr, max, pos;
+    uint16_t ent[1];
+};
+
+/* Per-track outcome of disk_analyse_stream(). */
+enum {
+    ANALYSE_skipped = 0, /* Outside requested range, or ignored by plan */
+    ANALYSE_ok,          /* Identified with all sectors valid */
+    ANALYSE_bad_sectors, /* Identified, but some sectors are invalid */
+    ANALYSE_unformatted, /* No format matched: track is unformatted */
+    ANALYSE_unidentified /* No format matched, and not recognisably blank */
+};
+
+struct analyse_track {
+    uint8_t status;
+    uint16_t type;        /* TRKTYP_* written to the disk */
+    uint16_t attempts;    /* Number of formats tried */
+    uint8_t nr_sectors, nr_bad_sectors;
+    uint8_t valid_sectors[20]; /* Before any ANALYSE_clear_bad_sectors */
+    /* Cost of the analysis, over all formats tried. */
+    uint64_t time_ns;         /* Wall time */
+    uint64_t nr_bits, nr_flux; /* Bitcells and flux reversals consumed */
+    uint16_t revs;        /* Revolutions read from by the matching format,
+                           * else the most by any format */
+    uint16_t density_ns;  /* Bitcell period of the final decode */
+};
+
+/* Signature of a track: its length, and occurrences of common sync words,
+ * over one revolution. Absent or unreadable tracks have zero bitlen. */
+#define FP_NR_SYNCS 16
+struct track_fingerprint {
+    uint32_t bitlen;
+    uint16_t sync[FP_NR_SYNCS];
+};
+
+struct disk_fingerprint {
+    char *title;
+    unsigned int nr_tracks;
+    struct track_fingerprint *track;
+};
+
+#define ANALYSE_index_align       (1u<<0)
+#define ANALYSE_clear_bad_sectors (1u<<1)
+
+struct analyse_opts {
+    unsigned int start_track, end_track, step; /* end_track is inclusive */
+    unsigned int flags;
+    /* If non-NULL, each list's formats are tried in order of past success
+     * (see format_stats_open()), and every trial is recorded. */
+    struct format_stats *stats;
+};
+
+#pragma GCC visibility push(default)
+
+/* Parse the format plan named @specifier ("default" if NULL) from formats
+ * config file @config ("formats" if NULL). Relative names are tried first
+ * in the current directory, then in the installed disk-analyse directory.
+ * Returns NULL, after printing a warning, if the config cannot be read, is
+ * malformed, or has no such plan. */
+struct format_list **format_plan_parse(
+    const char *config, const char *specifier, int verbose);
+void format_plan_free(struct format_list **plan);
+
+/* Compile formats config file @config ("formats" if NULL) and everything it
+ * INCLUDEs into database @db. format_plan_parse() uses "<config>.db" in
+ * place of the config file for as long as none of the sources have changed,
+ * so that lookup cost is independent of the size of the config. Returns
+ * 0, or -1 after printing a warning. */
+int format_plan_compile(const char *config, const char *db);
+
+/* Statistics of format trials, persisted in file @name (created on close
+ * if it does not exist). For each distinct format list they record how
+ * often each format has been tried and has matched, and the time spent
+ * trying it. disk_analyse_stream() uses them to try first the formats
+ * which match most often for the least time: the most recently matched
+ * format first, as before, then the rest in that order. Closing merges
+ * this session's trials into the file, or warns and drops them if it cannot
+ * be written. Statistics may be shared by many analyses, but by only one at
+ * a time. */
+struct format_stats *format_stats_open(const char *name);
+void format_stats_close(struct format_stats *fs);
+
+/* Decode tracks of stream @s into disk @d according to @plan, recording the
+ * outcome for each track of @d in @res[]. The stream's PLL and double-step
+ * settings are used as the caller left them. A plan may be reused across
+ * many analyses, but by only one at a time: its rotation state carries over
+ * from one disk to the next. Returns the number of damaged or unidentified
+ * tracks. */
+unsigned int disk_analyse_stream(
+    struct disk *d, struct stream *s, struct format_list **plan,
+    const struct analyse_opts *opts, struct analyse_track *res);
+
+/* Fingerprint one track, or the first @nr_tracks tracks, of stream @s. */
+int track_fingerprint(
+    struct stream *s, unsigned int tracknr, struct track_fingerprint *fp);
+struct disk_fingerprint *disk_fingerprint_stream(
+    struct stream *s, const char *title, unsigned int nr_tracks);
+void disk_fingerprint_free(struct disk_fingerprint *dfp);
+
+/* Similarity of two disk fingerprints, from 0 (none) to 1000 (identical). */
+unsigned int disk_fingerprint_score(
+    const struct disk_fingerprint *a, const struct disk_fingerprint *b);
+
+/* A fingerprint database is a text file of disk fingerprints. Loading
+ * returns an array of *@p_nr entries, each to be freed by the caller, or
+ * NULL if the file cannot be read or is malformed. Appending returns -1 if
+ * the file cannot be written. */
+int fingerprint_db_append(
+    const char *name, const struct disk_fingerprint *dfp);
+struct disk_fingerprint **fingerprint_db_load(
+    const char *name, unsigned int *p_nr);
+
+#pragma GCC visibility pop
+
+#endif /* __LIBDISK_ANALYSE_H__ */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -83,25 +83,67 @@ struct disk_info {
 struct disk;
 struct stream;
 
+/*
+ * Thread safety: libdisk holds no mutable global state on behalf of a disk
+ * or stream, so independent disks and streams may be used concurrently from
+ * different threads. Each struct disk, struct stream and struct track_raw
+ * must be used by only one thread at a time. Pointers into a disk (its
+ * disk_info, track data and tags) are owned by that disk. A tag replaced by
+ * disk_set_tag() is updated in place if its length is unchanged; otherwise
+ * previously-returned pointers to it become invalid.
+ */
+
 #pragma GCC visibility push(default)
 
 #define DISKFL_read_only     (1u<<0)
 #define DISKFL_kryoflux_hack (1u<<1)
 #define DISKFL_rpm_shift     2
 #define DISKFL_rpm(rpm)      ((rpm)<<DISKFL_rpm_shift)
+/* Regenerate each track's raw bitcells in a worker thread as soon as it is
+ * written, overlapping output encoding with the caller's next track. The
+ * caller must still use the disk from only one thread. Above the rpm. */
+#define DISKFL_pipeline      (1u<<31)
 
+/* A NULL @name creates an anonymous in-memory disk which is never written. */
 struct disk *disk_create(const char *name, unsigned int flags);
 struct disk *disk_open(const char *name, unsigned int flags);
 void disk_close(struct disk *);
 
+/* Accumulate in @ns[tracknr] the time spent generating each track's raw
+ * bitcells, as most containers do for every track when the disk is closed.
+ * @ns has disk_get_nr_tracks() entries, and must remain valid until then. */
+void disk_set_encode_timer(struct disk *d, uint64_t *ns);
+
 const char *disk_get_format_id_name(enum track_type type);
 const char *disk_get_format_desc_name(enum track_type type);
+/* Returns the track type with the given id name, or -1 if there is none. */
+int disk_get_format_id_by_name(const char *name);
 
 void track_get_format_name(
     struct disk *d, unsigned int tracknr, char *str, size_t size);
 
-/* Valid until the disk is closed (disk_close()). */
+/* Valid until the disk is closed (disk_close()). Some containers (HFE, DSK)
+ * read each track only when it is first used, so this does not fill in
+ * track contents: use track_get_info() to look at a track, or
+ * disk_get_loaded_info() to load every track first. */
 struct disk_info *disk_get_info(struct disk *);
+struct disk_info *disk_get_loaded_info(struct disk *);
+/* Track @tracknr, loaded if need be, or NULL if there is no such track.
+ * Valid until the track is rewritten or the disk is closed. */
+struct track_info *track_get_info(struct disk *, unsigned int tracknr);
+unsigned int disk_get_nr_tracks(struct disk *);
+
+/* Digests identify track and disk contents. A track's digest covers its
+ * type, flags and data: DSK images record these so they are available
+ * without reading track data. A disk's digest covers its layout, all its
+ * track digests and its tags. */
+#define DISK_DIGEST_LEN 32
+void track_get_digest(struct disk *d, unsigned int tracknr, uint8_t *digest);
+void disk_get_digest(struct disk *d, uint8_t *digest);
+
+/* Replace the tracks and tags of @dst with copies of those of @src: for
+ * example, to convert between container formats without re-analysis. */
+void disk_copy(struct disk *dst, struct disk *src);
 
 struct disktag *disk_get_tag_by_id(struct disk *d, uint16_t id);
 struct disktag *disk_get_tag_by_idx(struct disk *d, unsigned int idx);
@@ -59,15 +59,50 @@ struct stream {
 
     uint32_t prng_seed;
     bool_t double_step;
+
+    /* Fields below are appended to keep the layout above stable for
+     * clients which set fields of a stream they opened. */
+
+    /* Bitcells and flux reversals consumed. Never reset by the stream. */
+    uint64_t nr_bits, nr_flux;
+
+    /* Value of nr_index when the last track decoder finished with the
+     * stream, before it was rewound to measure the track. Decoding begins
+     * at the first index pulse, so this counts the revolutions read. */
+    uint32_t decode_index;
 };
 
+/* A stream may be used by only one thread at a time (see libdisk/disk.h). */
 #pragma GCC visibility push(default)
 struct stream *stream_open(
     const char *name, unsigned int drive_rpm, unsigned int data_rpm);
 struct stream *stream_soft_open(
     uint8_t *data, uint16_t *speed, uint32_t bitlen, unsigned int data_rpm);
 void stream_close(struct stream *s);
+/* Capture the flux of one track into memory. The returned stream supports
+ * only @tracknr, and further independent cursors over the same read-only
+ * flux may be opened with stream_dup(). Each cursor may be used by a
+ * different thread. */
+struct stream *stream_capture_track(struct stream *s, unsigned int tracknr);
+struct stream *stream_dup(struct stream *s);
+/* Open a stream over @nr_flux flux intervals, in nanoseconds, read from
+ * track @tracknr. An index pulse falls at the start of each interval listed
+ * in ascending @index[]. The stream supports only @tracknr, and ends with
+ * the data. Both arrays are copied. */
+struct stream *stream_flux_open(
+    unsigned int tracknr, const uint32_t *flux, unsigned int nr_flux,
+    const uint32_t *index, unsigned int nr_index,
+    unsigned int drive_rpm, unsigned int data_rpm);
 int stream_select_track(struct stream *s, unsigned int tracknr);
+/* Hint that tracks @start, @start+@step, ... up to @end inclusive will be
+ * selected in turn, so that streams stored as a file per track can read
+ * ahead in the background. Tracks may still be selected in any order. */
+void stream_set_track_order(
+    struct stream *s, unsigned int start, unsigned int end, unsigned int step);
+/* For streams which store several revolutions per track, use only those in
+ * @mask (bit N is the N+1'th full revolution) from the next track selected.
+ * Zero selects all revolutions. Other streams ignore this. */
+void stream_set_revolutions(struct stream *s, uint32_t mask);
 void stream_reset(struct stream *s);
 void stream_next_index(struct stream *s);
 int stream_next_bit(struct stream *s);
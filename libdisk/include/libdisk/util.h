@@ -96,6 +96,42 @@ uint16_t crc16_ccitt_bit(uint8_t b, uint16_t crc);
 
 uint16_t rnd16(uint32_t *p_seed);
 
+/* Monotonic clock, in nanoseconds since an arbitrary point. */
+uint64_t time_ns(void);
+
+/* Record spans of libdisk work in all threads to file @name, as Chrome trace
+ * events, until trace_stop(). Tracing is process-wide, and off by default.
+ * Returns -1 if the file cannot be created. */
+int trace_start(const char *name);
+void trace_stop(void);
+
+/* Hot-path event counters, totalled over all threads. Counting is compiled
+ * in only by "make counters=y": otherwise counters_read() returns -1. */
+enum counter {
+    ctr_bitcells,   /* bitcells clocked from streams */
+    ctr_flux,       /* flux samples read from streams */
+    ctr_pll_unsync, /* flux reversals seen with the PLL out of sync */
+    ctr_syncs,      /* sync marks found (stream_start_crc()) */
+    ctr_crc_errors, /* IBM-style ID and data CRC mismatches */
+    ctr_tbuf_bits,  /* bitcells generated by track encoders */
+    ctr_nr
+};
+const char *counter_name(enum counter ctr);
+int counters_read(uint64_t ctrs[ctr_nr]);
+void counters_reset(void);
+
+/* SHA-256, for content-addressing of track data. */
+#define SHA256_LEN 32
+struct sha256_ctx {
+    uint32_t h[8];
+    uint64_t len;
+    uint8_t buf[64];
+};
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_add(struct sha256_ctx *ctx, const void *buf, size_t len);
+void sha256_final(struct sha256_ctx *ctx, uint8_t digest[SHA256_LEN]);
+void sha256(const void *buf, size_t len, uint8_t digest[SHA256_LEN]);
+
 #if !defined(__PLATFORM_HAS_ENDIAN_H__)
 
 uint16_t htobe16(uint16_t host_16bits);
@@ -20,6 +20,7 @@ struct container;
 
 /* Private data relating to an open disk. */
 struct disk {
+    char *name; /* NULL if anonymous */
     int fd;
     bool_t read_only;
     bool_t kryoflux_hack;
@@ -27,6 +28,10 @@ struct disk {
     struct container *container;
     struct disk_info *di;
     struct disk_list_tag *tags;
+    /* Container-private state: a single allocation, freed by disk_close(). */
+    void *priv;
+    struct pipeline *pipeline;
+    uint64_t *encode_ns; /* see disk_set_encode_timer() */
 };
 
 /* How to interpret data being appended to a track buffer. */
@@ -39,6 +44,14 @@ enum bitcell_encoding {
     bc_mfm_odd_even   /* emit all odd-numbered bits; then even-numbered */
 };
 
+/* A run of weak bitcells emitted by tbuf_weak(), recorded so that it can be
+ * re-randomised without re-encoding the whole track. */
+struct tbuf_weak_extent {
+    uint32_t start, end, nr; /* bitcells [start,end), modulo track length */
+    uint8_t prev_data_bit;   /* data bit preceding the extent */
+    bool_t clk_after;        /* next bitcell is an MFM clock depending on us */
+};
+
 /* Track buffer: this is opaque to encoders, updated via tbuf_* helpers. */
 struct tbuf {
     struct track_raw raw;
@@ -53,6 +66,10 @@ struct tbuf {
                 enum bitcell_encoding enc, uint8_t dat);
     void (*gap)(struct tbuf *, uint16_t speed, unsigned int bits);
     void (*weak)(struct tbuf *, unsigned int bits);
+    /* Weak extents in emission order; not valid if tbuf->bit is replaced. */
+    struct tbuf_weak_extent *weak_ext;
+    unsigned int nr_weak_ext, max_weak_ext;
+    bool_t weak_ext_valid;
 };
 
 /* Append new raw track data into a track buffer. */
@@ -72,6 +89,11 @@ void tbuf_set_gap_fill_byte(struct tbuf *tbuf, uint8_t byte);
 #define TBUF_PRNG_INIT 0xae659201u
 uint16_t tbuf_rnd16(struct tbuf *tbuf);
 
+/* Re-randomise the weak bits of a track buffer filled by track_read_raw(),
+ * exactly as re-reading the track would. Returns -1 if the track must
+ * instead be re-read in full. */
+int track_regen_weak_bits(struct track_raw *);
+
 enum track_density {
     trkden_double, /* default */
     trkden_high,
@@ -114,12 +136,65 @@ struct container {
     /* Analyse and write a raw stream to given track in container. */
     int (*write_raw)(struct disk *, unsigned int tracknr,
                      enum track_type, struct stream *);
+    /* Optional: fill in a track whose decode was deferred by open(). Called
+     * before a track's info is used or replaced. */
+    void (*load_track)(struct disk *, unsigned int tracknr);
+    /* Optional: return a track's digest as recorded in the container, or -1
+     * if it must be computed from the track data. */
+    int (*get_track_digest)(struct disk *, unsigned int tracknr,
+                            uint8_t *digest);
 };
 
+/* Make sure a track's data is present, if the container defers loading it.
+ * Track handlers must call this before looking at another track's data. */
+void track_load(struct disk *d, unsigned int tracknr);
+
+/* SHA-256 digest of a track's type, flags, length and data. */
+void track_compute_digest(const struct track_info *ti, uint8_t *digest);
+
+/* track_read_raw(), bypassing any pipelined result. */
+void __track_read_raw(struct track_raw *, unsigned int tracknr);
+
+/* Pipelined raw-track generation (pipeline.c), for DISKFL_pipeline. All are
+ * no-ops, and pipeline_take() fails, if the disk has no pipeline. */
+void pipeline_start(struct disk *);
+/* Finish queued work and stop the worker thread. */
+void pipeline_stop(struct disk *);
+void pipeline_free(struct disk *);
+/* Discard the result for a track about to be rewritten. */
+void pipeline_invalidate(struct disk *, unsigned int tracknr);
+/* Queue a rewritten track for generation. */
+void pipeline_queue(struct disk *, unsigned int tracknr);
+/* Defer queueing of a track while it is being written. Holds nest. */
+void pipeline_hold(struct disk *, unsigned int tracknr);
+void pipeline_release(struct disk *);
+/* Bracket changes to the disk's tags. */
+void pipeline_pause(struct disk *);
+void pipeline_resume(struct disk *);
+/* Claim the pipelined result for a track, if still valid. */
+int pipeline_take(struct track_raw *, unsigned int tracknr);
+
+struct format_list;
+struct format_stats;
+
+/* Order each list of @plan by its statistics, and record trials against
+ * them, until the next bind or the statistics are closed (format_stats.c).
+ * The plan is not modified: format_stats_trial() gives the index into a
+ * bound list of the @j'th format to try. */
+void format_stats_bind(struct format_stats *, struct format_list **plan);
+void format_stats_unbind(struct format_stats *);
+unsigned int format_stats_trial(
+    struct format_stats *, const struct format_list *, unsigned int j);
+void format_stats_record(
+    struct format_stats *, const struct format_list *,
+    unsigned int idx, bool_t won, uint64_t ns);
+
 /* Supported container formats. */
 extern struct container container_adf;
 extern struct container container_eadf;
 extern struct container container_dsk;
+extern struct container container_dskref;
+extern struct container container_dskz;
 extern struct container container_hfe;
 extern struct container container_imd;
 extern struct container container_img;
@@ -8,6 +8,11 @@ struct stream_type {
     struct stream *(*open)(const char *name, unsigned int data_rpm);
     void (*close)(struct stream *);
     int (*select_track)(struct stream *, unsigned int tracknr);
+    /* Optional: see stream_set_track_order(). */
+    void (*set_track_order)(struct stream *, unsigned int start,
+                            unsigned int end, unsigned int step);
+    /* Optional: see stream_set_revolutions(). */
+    void (*set_revolutions)(struct stream *, uint32_t mask);
     void (*reset)(struct stream *);
     int (*next_flux)(struct stream *);
     const char *suffix[];
@@ -17,6 +22,32 @@ void stream_setup(
     struct stream *s, const struct stream_type *st,
     unsigned int drive_rpm, unsigned int data_rpm);
 
+/* stream/memory.c: capture of the currently-selected track. */
+struct stream *memory_stream_capture(struct stream *s, unsigned int tracknr);
+struct stream *memory_stream_dup(struct stream *s);
+
+/* stream/bitcell.c: flux intervals of a bitcell track, precomputed once so
+ * that streams over in-memory bitcells need not time each cell as they go.
+ * Entries [0,cycle) run from a stream reset to the first 1-bit; entries
+ * [cycle,nr) are one full revolution, repeated thereafter. */
+struct bitcell_flux {
+    const uint8_t *bits;
+    const uint16_t *speed; /* NULL means uniform density */
+    uint32_t bitlen, ns_per_cell;
+    uint32_t *flux;
+    uint32_t nr, max, cycle, pos;
+    struct { uint32_t ent, off; } index[2]; /* entries passing the index */
+    unsigned int nr_index;
+};
+
+/* Returns -1 if the track has no 1-bits: caller must time cells itself. */
+int bitcell_flux_build(
+    struct bitcell_flux *bf, const uint8_t *bits, const uint16_t *speed,
+    uint32_t bitlen, uint32_t ns_per_cell);
+/* Emit the next flux interval into @s, as a stream_type next_flux(). */
+void bitcell_flux_next(struct bitcell_flux *bf, struct stream *s);
+void bitcell_flux_free(struct bitcell_flux *bf);
+
 #endif /* __PRIVATE_STREAM_H__ */
 
 /*
@@ -14,6 +14,60 @@
     fprintf(stderr, "*** T%u.%u: %s: " msg "\n", cyl(trk), hd(trk), \
            (ti)->typename, ## a)
 
+/* Map a whole file read-only, or return NULL if it is empty or cannot be
+ * opened. Release with unmap_file(). */
+void *map_file(const char *name, size_t *psize);
+void unmap_file(void *p, size_t size);
+
+/* Make room in array @old, of *@max elements of @sz bytes, for element @nr,
+ * doubling its size if it is full. Returns the array, which may have moved. */
+void *memgrow(void *old, unsigned int *max, unsigned int nr, size_t sz);
+
+/* Tracing (trace.c): time a span of work from trace_begin() to trace_end().
+ * Both are a flag test when tracing is off. @tracknr is -1 if the span is
+ * not specific to a track, and @detail may be NULL. The flag may change
+ * under running threads, so is accessed atomically: a relaxed load suffices,
+ * as __trace_end() rechecks the trace file under its lock. */
+extern bool_t trace_on;
+static inline uint64_t trace_begin(void)
+{
+    return __atomic_load_n(&trace_on, __ATOMIC_RELAXED) ? time_ns() : 0;
+}
+void __trace_end(uint64_t start, const char *cat, const char *name,
+                 int tracknr, const char *detail);
+#define trace_end(start, cat, name, tracknr, detail) do {       \
+    if (start)                                                  \
+        __trace_end(start, cat, name, tracknr, detail);         \
+} while (0)
+
+/* Counters (counters.c): count an event in the current thread's block. */
+#ifdef LIBDISK_COUNTERS
+struct counters {
+    uint64_t c[ctr_nr];
+    struct counters *next;
+};
+extern __thread struct counters *this_counters
+    __attribute__((tls_model("initial-exec")));
+struct counters *counters_new(void);
+#define counter_add(ctr, n) do {                                    \
+    struct counters *_c = this_counters;                            \
+    if (_c == NULL)                                                 \
+        _c = counters_new();                                        \
+    _c->c[ctr] += (n);                                              \
+} while (0)
+#else
+#define counter_add(ctr, n) ((void)0)
+#endif
+#define counter_inc(ctr) counter_add(ctr, 1)
+
+/* LZ block codec (lz.c). lz_compress() returns the compressed length, or 0
+ * if the output would exceed @out_max bytes. lz_decompress() returns -1 if
+ * the input is corrupt or does not expand to exactly @out_len bytes. */
+unsigned int lz_compress(
+    const void *in, unsigned int in_len, void *out, unsigned int out_max);
+int lz_decompress(
+    const void *in, unsigned int in_len, void *out, unsigned int out_len);
+
 #endif /* __PRIVATE_UTIL_H__ */
 
 /*
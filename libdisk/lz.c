@@ -0,0 +1,187 @@
+/*
+ * lz.c
+ *
+ * A small LZ77 block codec for container track data, with the block layout
+ * of LZ4: a sequence of (token, literals, match) records. Each token holds
+ * a 4-bit literal count and a 4-bit match length (less the minimum match),
+ * a field value of 15 being extended by following bytes up to and
+ * including the first which is not 255. Each match is a 16-bit
+ * little-endian offset back into the output. The last record has literals
+ * only.
+ *
+ * Written in 2026 by agent
+ */
+
+#include <libdisk/util.h>
+#include <private/util.h>
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define HASH_BITS 12
+
+/* Matches may not begin in the last few bytes: these end up as literals. */
+#define LAST_LITERALS 5
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t x;
+    memcpy(&x, p, 4);
+    return x;
+}
+
+static unsigned int hash(uint32_t x)
+{
+    return (x * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/* Emit an extended length field for @n (the excess over 15). */
+static uint8_t *put_len(uint8_t *op, const uint8_t *oend, unsigned int n)
+{
+    for (; n >= 255; n -= 255) {
+        if (op >= oend)
+            return NULL;
+        *op++ = 255;
+    }
+    if (op >= oend)
+        return NULL;
+    *op++ = n;
+    return op;
+}
+
+static uint8_t *put_sequence(
+    uint8_t *op, const uint8_t *oend, const uint8_t *lit,
+    unsigned int nr_lit, unsigned int off, unsigned int match_len)
+{
+    uint8_t *token = op++;
+    unsigned int ml = match_len ? match_len - MIN_MATCH : 0;
+
+    if (token >= oend)
+        return NULL;
+    *token = (min(nr_lit, 15u) << 4) | min(ml, 15u);
+
+    if ((nr_lit >= 15) && !(op = put_len(op, oend, nr_lit - 15)))
+        return NULL;
+    if (nr_lit > (oend - op))
+        return NULL;
+    memcpy(op, lit, nr_lit);
+    op += nr_lit;
+
+    if (match_len == 0)
+        return op;
+
+    if ((oend - op) < 2)
+        return NULL;
+    *op++ = off;
+    *op++ = off >> 8;
+    if ((ml >= 15) && !(op = put_len(op, oend, ml - 15)))
+        return NULL;
+
+    return op;
+}
+
+unsigned int lz_compress(
+    const void *in, unsigned int in_len, void *out, unsigned int out_max)
+{
+    const uint8_t *ip = in, *base = in, *anchor = in, *ref;
+    const uint8_t *mlimit = base + in_len - LAST_LITERALS;
+    uint8_t *op = out, *oend = op + out_max;
+    uint32_t tab[1u << HASH_BITS]; /* position + 1, or 0 if none */
+    unsigned int h, len;
+
+    memset(tab, 0, sizeof(tab));
+
+    while ((in_len > LAST_LITERALS + MIN_MATCH)
+           && ((ip + MIN_MATCH) <= mlimit)) {
+        h = hash(read32(ip));
+        ref = tab[h] ? base + tab[h] - 1 : NULL;
+        tab[h] = ip - base + 1;
+        if ((ref == NULL) || ((ip - ref) > MAX_OFFSET)
+            || (read32(ref) != read32(ip))) {
+            ip++;
+            continue;
+        }
+        for (len = MIN_MATCH; (ip + len) < mlimit; len++)
+            if (ref[len] != ip[len])
+                break;
+        op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, len);
+        if (op == NULL)
+            return 0;
+        ip += len;
+        anchor = ip;
+    }
+
+    op = put_sequence(op, oend, anchor, base + in_len - anchor, 0, 0);
+    return op ? op - (uint8_t *)out : 0;
+}
+
+/* Read an extended length field, adding it to *@n. */
+static const uint8_t *get_len(
+    const uint8_t *ip, const uint8_t *iend, unsigned int *n)
+{
+    uint8_t b;
+
+    do {
+        if (ip >= iend)
+            return NULL;
+        b = *ip++;
+        *n += b;
+    } while (b == 255);
+
+    return ip;
+}
+
+int lz_decompress(
+    const void *in, unsigned int in_len, void *out, unsigned int out_len)
+{
+    const uint8_t *ip = in, *iend = ip + in_len;
+    uint8_t *op = out, *obase = out, *oend = op + out_len;
+    unsigned int token, nr_lit, off, len;
+
+    while (ip < iend) {
+        token = *ip++;
+
+        nr_lit = token >> 4;
+        if ((nr_lit == 15) && !(ip = get_len(ip, iend, &nr_lit)))
+            return -1;
+        if ((nr_lit > (iend - ip)) || (nr_lit > (oend - op)))
+            return -1;
+        memcpy(op, ip, nr_lit);
+        ip += nr_lit;
+        op += nr_lit;
+
+        if (ip == iend)
+            break;
+
+        if ((iend - ip) < 2)
+            return -1;
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if ((off == 0) || (off > (op - obase)))
+            return -1;
+
+        len = token & 15;
+        if ((len == 15) && !(ip = get_len(ip, iend, &len)))
+            return -1;
+        len += MIN_MATCH;
+        if (len > (oend - op))
+            return -1;
+
+        /* Byte by byte: the match may overlap the output being written. */
+        while (len--) {
+            *op = *(op - off);
+            op++;
+        }
+    }
+
+    return (op == oend) ? 0 : -1;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
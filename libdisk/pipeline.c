@@ -0,0 +1,282 @@
+/*
+ * pipeline.c
+ *
+ * Optional per-disk worker thread which regenerates the raw bitcells of each
+ * track as soon as it is written (DISKFL_pipeline). Containers which encode
+ * from raw bitcells at close time then find the work already done, so that
+ * encoding overlaps with analysis of the following tracks.
+ *
+ * The worker reads a queued track, and the disk's tags, concurrently with
+ * the caller writing other tracks. Track handlers which consult another
+ * track rely on it being written first, as disk analysis does.
+ *
+ * Written in 2026 by agent
+ */
+
+#include <libdisk/util.h>
+#include <private/disk.h>
+#include <pthread.h>
+
+struct pipeline_track {
+    uint32_t seq;     /* queue order; 0 if not queued */
+    bool_t valid;     /* raw[] holds a result */
+    bool_t used_prng; /* result depends on the initial PRNG seed */
+    uint32_t prng_seed; /* PRNG seed after generating the result */
+    unsigned int tags_gen;
+    struct track_raw raw;
+};
+
+struct pipeline {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* signalled on every change of state */
+    bool_t stop;
+    int busy;            /* track being generated, or -1 */
+    int held;            /* track not to be queued yet, or -1 */
+    unsigned int hold_depth;
+    bool_t deferred;     /* held track was written */
+    uint32_t seq;
+    unsigned int tags_gen, nr_tracks;
+    struct pipeline_track track[1];
+};
+
+/* Oldest queued track, or -1 if none. Called with the lock held. */
+static int pipeline_next(struct pipeline *p)
+{
+    unsigned int i;
+    int best = -1;
+
+    for (i = 0; i < p->nr_tracks; i++)
+        if (p->track[i].seq
+            && ((best < 0) || (p->track[i].seq < p->track[best].seq)))
+            best = i;
+
+    return best;
+}
+
+static void *pipeline_worker(void *_d)
+{
+    struct disk *d = _d;
+    struct pipeline *p = d->pipeline;
+    struct pipeline_track *pt;
+    struct track_raw *raw;
+    struct tbuf *tbuf;
+    unsigned int gen;
+    int tracknr;
+
+    pthread_mutex_lock(&p->lock);
+
+    for (;;) {
+        while (((tracknr = pipeline_next(p)) < 0) && !p->stop)
+            pthread_cond_wait(&p->cond, &p->lock);
+        if (tracknr < 0)
+            break;
+
+        pt = &p->track[tracknr];
+        pt->seq = 0;
+        p->busy = tracknr;
+        gen = p->tags_gen;
+        pthread_mutex_unlock(&p->lock);
+
+        raw = track_alloc_raw_buffer(d);
+        tbuf = container_of(raw, struct tbuf, raw);
+        __track_read_raw(raw, tracknr);
+
+        pthread_mutex_lock(&p->lock);
+        pt->raw = *raw;
+        pt->valid = 1;
+        pt->used_prng = (tbuf->prng_seed != TBUF_PRNG_INIT);
+        pt->prng_seed = tbuf->prng_seed;
+        pt->tags_gen = gen;
+        memset(raw, 0, sizeof(*raw));
+        track_free_raw_buffer(raw);
+        p->busy = -1;
+        pthread_cond_broadcast(&p->cond);
+    }
+
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+void pipeline_start(struct disk *d)
+{
+    unsigned int nr = d->di->nr_tracks;
+    struct pipeline *p;
+
+    p = memalloc(sizeof(*p) + nr * sizeof(p->track[0]));
+    p->nr_tracks = nr;
+    p->busy = p->held = -1;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    d->pipeline = p;
+
+    if (pthread_create(&p->thread, NULL, pipeline_worker, d) != 0)
+        err(1, NULL);
+}
+
+void pipeline_stop(struct disk *d)
+{
+    struct pipeline *p = d->pipeline;
+
+    if (p == NULL)
+        return;
+
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+
+    /* The worker drains the queue before exiting. */
+    pthread_join(p->thread, NULL);
+}
+
+void pipeline_free(struct disk *d)
+{
+    struct pipeline *p = d->pipeline;
+    unsigned int i;
+
+    if (p == NULL)
+        return;
+
+    for (i = 0; i < p->nr_tracks; i++)
+        track_purge_raw_buffer(&p->track[i].raw);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cond);
+    memfree(p);
+    d->pipeline = NULL;
+}
+
+void pipeline_invalidate(struct disk *d, unsigned int tracknr)
+{
+    struct pipeline *p = d->pipeline;
+    struct pipeline_track *pt;
+
+    if ((p == NULL) || (tracknr >= p->nr_tracks))
+        return;
+    pt = &p->track[tracknr];
+
+    pthread_mutex_lock(&p->lock);
+    while (p->busy == (int)tracknr)
+        pthread_cond_wait(&p->cond, &p->lock);
+    pt->seq = 0;
+    pt->valid = 0;
+    track_purge_raw_buffer(&pt->raw);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void pipeline_queue(struct disk *d, unsigned int tracknr)
+{
+    struct pipeline *p = d->pipeline;
+
+    if ((p == NULL) || (tracknr >= p->nr_tracks))
+        return;
+
+    if (p->held == (int)tracknr) {
+        p->deferred = 1;
+        return;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    if (!p->stop && !p->track[tracknr].seq)
+        p->track[tracknr].seq = ++p->seq;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void pipeline_hold(struct disk *d, unsigned int tracknr)
+{
+    struct pipeline *p = d->pipeline;
+
+    if (p == NULL)
+        return;
+
+    BUG_ON(p->hold_depth && (p->held != (int)tracknr));
+    p->held = tracknr;
+    p->hold_depth++;
+}
+
+void pipeline_release(struct disk *d)
+{
+    struct pipeline *p = d->pipeline;
+    int held;
+
+    if ((p == NULL) || --p->hold_depth)
+        return;
+
+    held = p->held;
+    p->held = -1;
+    if (p->deferred) {
+        p->deferred = 0;
+        pipeline_queue(d, held);
+    }
+}
+
+void pipeline_pause(struct disk *d)
+{
+    struct pipeline *p = d->pipeline;
+
+    if (p == NULL)
+        return;
+
+    pthread_mutex_lock(&p->lock);
+    while (p->busy >= 0)
+        pthread_cond_wait(&p->cond, &p->lock);
+}
+
+void pipeline_resume(struct disk *d)
+{
+    struct pipeline *p = d->pipeline;
+
+    if (p == NULL)
+        return;
+
+    /* Generated tracks may depend on the tags just changed. */
+    p->tags_gen++;
+    pthread_mutex_unlock(&p->lock);
+}
+
+int pipeline_take(struct track_raw *raw, unsigned int tracknr)
+{
+    struct tbuf *tbuf = container_of(raw, struct tbuf, raw);
+    struct pipeline *p = tbuf->disk->pipeline;
+    struct pipeline_track *pt;
+    int rc = -1;
+
+    if ((p == NULL) || (tracknr >= p->nr_tracks))
+        return -1;
+    pt = &p->track[tracknr];
+
+    pthread_mutex_lock(&p->lock);
+
+    /* Rather than duplicate work in progress, wait for it. */
+    while ((p->busy == (int)tracknr) || (pt->seq && !p->stop))
+        pthread_cond_wait(&p->cond, &p->lock);
+
+    if (pt->valid && (pt->tags_gen == p->tags_gen)
+        && (!pt->used_prng || (tbuf->prng_seed == TBUF_PRNG_INIT))) {
+        track_purge_raw_buffer(raw);
+        *raw = pt->raw;
+        memset(&pt->raw, 0, sizeof(pt->raw));
+        if (pt->used_prng)
+            tbuf->prng_seed = pt->prng_seed;
+        tbuf->nr_weak_ext = 0;
+        tbuf->weak_ext_valid = 0;
+        rc = 0;
+    }
+
+    pt->valid = 0;
+    track_purge_raw_buffer(&pt->raw);
+
+    pthread_mutex_unlock(&p->lock);
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
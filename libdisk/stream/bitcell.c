@@ -0,0 +1,166 @@
+/*
+ * stream/bitcell.c
+ *
+ * Precompute the flux intervals of a bitcell track, as emitted revolution
+ * after revolution by the soft and disk-image streams.
+ *
+ * Written in 2026 by agent
+ */
+
+#include <libdisk/util.h>
+#include <libdisk/disk.h>
+#include <private/stream.h>
+
+/* Intervals are cut short after 1ms of no flux. */
+#define MAX_FLUX_NS 1000000u
+
+static void bitcell_flux_emit(struct bitcell_flux *bf, uint32_t flux)
+{
+    if (bf->nr == bf->max) {
+        uint32_t *old = bf->flux;
+        bf->max = bf->max * 2 ?: 1024;
+        bf->flux = memalloc(bf->max * sizeof(*bf->flux));
+        memcpy(bf->flux, old, bf->nr * sizeof(*bf->flux));
+        memfree(old);
+    }
+    bf->flux[bf->nr++] = flux;
+}
+
+/* Position of first 1-bit in [@pos,@end), else @end. */
+static uint32_t next_one(const uint8_t *bits, uint32_t pos, uint32_t end)
+{
+    uint32_t w;
+
+    while ((pos < end) && (pos & 31)) {
+        if (bits[pos>>3] & (0x80u >> (pos&7)))
+            return pos;
+        pos++;
+    }
+
+    while ((pos + 32) <= end) {
+        memcpy(&w, &bits[pos>>3], 4);
+        if ((w = be32toh(w)) != 0)
+            return pos + __builtin_clz(w);
+        pos += 32;
+    }
+
+    while (pos < end) {
+        if (bits[pos>>3] & (0x80u >> (pos&7)))
+            return pos;
+        pos++;
+    }
+
+    return end;
+}
+
+static uint32_t cell_ns(const struct bitcell_flux *bf, uint32_t pos)
+{
+    uint16_t speed = bf->speed ? bf->speed[pos] : SPEED_AVG;
+    if (speed == SPEED_WEAK)
+        speed = SPEED_AVG;
+    return (bf->ns_per_cell * speed) / SPEED_AVG;
+}
+
+/* Emit intervals for @nr cells starting at @pos, which must end on a 1-bit.
+ * Each run of zeroes at one speed is timed in a single step. */
+static void bitcell_flux_walk(
+    struct bitcell_flux *bf, uint32_t pos, uint32_t nr)
+{
+    uint32_t flux = 0, end, run, t, n;
+
+    while (nr != 0) {
+        if (pos == 0) {
+            /* Cell 0 is consumed as the index passes. */
+            bf->index[bf->nr_index].ent = bf->nr;
+            bf->index[bf->nr_index].off = flux;
+            bf->nr_index++;
+        }
+
+        t = cell_ns(bf, pos);
+        end = min(pos + nr, bf->bitlen);
+
+        if (bf->bits[pos>>3] & (0x80u >> (pos&7))) {
+            bitcell_flux_emit(bf, flux + t);
+            flux = 0;
+            run = 1;
+        } else {
+            end = next_one(bf->bits, pos, end);
+            if (bf->speed != NULL) {
+                for (run = 1; (pos + run) < end; run++)
+                    if (bf->speed[pos+run] != bf->speed[pos])
+                        break;
+            } else {
+                run = end - pos;
+            }
+            n = t ? (MAX_FLUX_NS - flux + t - 1) / t : run;
+            run = min(run, n);
+            flux += run * t;
+            if (flux >= MAX_FLUX_NS) {
+                bitcell_flux_emit(bf, flux);
+                flux = 0;
+            }
+        }
+
+        nr -= run;
+        if ((pos += run) >= bf->bitlen)
+            pos = 0;
+    }
+
+    BUG_ON(flux != 0);
+}
+
+int bitcell_flux_build(
+    struct bitcell_flux *bf, const uint8_t *bits, const uint16_t *speed,
+    uint32_t bitlen, uint32_t ns_per_cell)
+{
+    uint32_t first;
+
+    bf->bits = bits;
+    bf->speed = speed;
+    bf->bitlen = bitlen;
+    bf->ns_per_cell = ns_per_cell;
+    bf->nr = bf->nr_index = bf->pos = 0;
+
+    if ((bitlen < 2) || (next_one(bits, 0, bitlen) == bitlen))
+        return -1;
+
+    /* After a stream reset, emission starts at cell 1. Run up to the first
+     * 1-bit: a full revolution of intervals from there then repeats. */
+    first = next_one(bits, 1, bitlen);
+    if (first == bitlen)
+        first = 0;
+    bitcell_flux_walk(bf, 1, first ? first : bitlen);
+    bf->cycle = bf->nr;
+    bitcell_flux_walk(bf, (first + 1) % bitlen, bitlen);
+
+    return 0;
+}
+
+void bitcell_flux_next(struct bitcell_flux *bf, struct stream *s)
+{
+    unsigned int i;
+
+    for (i = 0; i < bf->nr_index; i++)
+        if (bf->index[i].ent == bf->pos)
+            s->ns_to_index = s->flux + bf->index[i].off;
+
+    s->flux += bf->flux[bf->pos];
+    if (++bf->pos >= bf->nr)
+        bf->pos = bf->cycle;
+}
+
+void bitcell_flux_free(struct bitcell_flux *bf)
+{
+    memfree(bf->flux);
+    memset(bf, 0, sizeof(*bf));
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
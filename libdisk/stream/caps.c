@@ -11,6 +11,7 @@
 #include <unistd.h>
 #include <caps/capsimage.h>
 #include <dlfcn.h>
+#include <pthread.h>
 
 #ifdef __APPLE__
 #define CAPSLIB_NAME    "/Library/Frameworks/CAPSImage.framework/CAPSImage"
@@ -62,6 +63,10 @@ static struct {
         CapsLong id);
 } capslib;
 
+/* The CAPS library is not reentrant. Serialise all calls into it, and all
+ * updates to our shared library handle and refcount. */
+static pthread_mutex_t capslib_lock = PTHREAD_MUTEX_INITIALIZER;
+
 #define CAPSInit            capslib.Init
 #define CAPSExit            capslib.Exit
 #define CAPSAddImage        capslib.AddImage
@@ -156,8 +161,12 @@ static struct stream *caps_open(const char *name, unsigned int data_rpm)
     if (strncmp(sig, "CAPS", 4))
         return NULL;
 
-    if (!get_capslib())
+    pthread_mutex_lock(&capslib_lock);
+
+    if (!get_capslib()) {
+        pthread_mutex_unlock(&capslib_lock);
         return NULL;
+    }
 
     cpss = memalloc(sizeof(*cpss));
     cpss->track = ~0u;
@@ -180,6 +189,7 @@ static struct stream *caps_open(const char *name, unsigned int data_rpm)
         goto fail3;
     }
 
+    pthread_mutex_unlock(&capslib_lock);
     return &cpss->s;
 
 fail3:
@@ -193,19 +203,22 @@ fail1:
     }
     memfree(cpss);
     put_capslib();
-        
+    pthread_mutex_unlock(&capslib_lock);
+
     return NULL;
 }
 
 static void caps_close(struct stream *s)
 {
     struct caps_stream *cpss = container_of(s, struct caps_stream, s);
+    pthread_mutex_lock(&capslib_lock);
     CAPSUnlockAllTracks(cpss->container);
     CAPSUnlockImage(cpss->container);
     CAPSRemImage(cpss->container);
+    put_capslib();
+    pthread_mutex_unlock(&capslib_lock);
     memfree(cpss->speed);
     memfree(cpss);
-    put_capslib();
 }
 
 static int caps_select_track(struct stream *s, unsigned int tracknr)
@@ -218,8 +231,10 @@ static int caps_select_track(struct stream *s, unsigned int tracknr)
     /* Attempt to load one track revolution. Modify nothing on failure. */
     memset(&ti, 0, sizeof(ti));
     ti.type = 1;
+    pthread_mutex_lock(&capslib_lock);
     rc = CAPSLockTrack((struct CapsTrackInfo *)&ti, cpss->container,
                        cyl(tracknr), hd(tracknr), CAPS_FLAGS);
+    pthread_mutex_unlock(&capslib_lock);
     if (rc)
         return -1;
 
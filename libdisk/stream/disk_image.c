@@ -8,6 +8,7 @@
 
 #include <libdisk/util.h>
 #include <libdisk/disk.h>
+#include <private/disk.h>
 #include <private/stream.h>
 
 #include <sys/types.h>
@@ -23,6 +24,8 @@ struct di_stream {
     unsigned int track;
     struct track_raw *track_raw;
     uint32_t pos, ns_per_cell;
+    struct bitcell_flux bf;
+    bool_t bf_valid; /* bf is built for this track, which has 1-bits */
 };
 
 static struct stream *di_open(const char *name, unsigned int data_rpm)
@@ -45,6 +48,7 @@ static struct stream *di_open(const char *name, unsigned int data_rpm)
 static void di_close(struct stream *s)
 {
     struct di_stream *dis = container_of(s, struct di_stream, s);
+    bitcell_flux_free(&dis->bf);
     track_free_raw_buffer(dis->track_raw);
     disk_close(dis->d);
     memfree(dis);
@@ -58,12 +62,20 @@ static int di_select_track(struct stream *s, unsigned int tracknr)
         return 0;
 
     dis->track = ~0u;
+    dis->bf_valid = 0;
     track_read_raw(dis->track_raw, tracknr);
     if (dis->track_raw->bits == NULL)
         return -1;
     dis->track = tracknr;
     dis->ns_per_cell = (track_nsecs_from_rpm(s->data_rpm)
                         / dis->track_raw->bitlen);
+    /* Weak bits change every revolution: those tracks are timed cell by
+     * cell as they go. */
+    dis->bf_valid = (!dis->track_raw->has_weak_bits
+                     && !bitcell_flux_build(
+                         &dis->bf, dis->track_raw->bits,
+                         dis->track_raw->speed, dis->track_raw->bitlen,
+                         dis->ns_per_cell));
 
     return 0;
 }
@@ -72,7 +84,9 @@ static void di_reset(struct stream *s)
 {
     struct di_stream *dis = container_of(s, struct di_stream, s);
 
-    if (dis->track_raw->has_weak_bits) {
+    /* Weak bits are re-randomised in place, where the track handler
+     * allows. Otherwise the whole track must be read again. */
+    if (track_regen_weak_bits(dis->track_raw) != 0) {
         unsigned int tracknr = dis->track;
         dis->track = ~0u;
         if (di_select_track(s, tracknr))
@@ -80,6 +94,7 @@ static void di_reset(struct stream *s)
     }
 
     dis->pos = 0;
+    dis->bf.pos = 0;
 }
 
 static int di_next_flux(struct stream *s)
@@ -89,6 +104,11 @@ static int di_next_flux(struct stream *s)
     uint8_t dat;
     int flux = 0;
 
+    if (dis->bf_valid) {
+        bitcell_flux_next(&dis->bf, s);
+        return 0;
+    }
+
     do {
         if (++dis->pos >= dis->track_raw->bitlen) {
             di_reset(s);
@@ -112,7 +132,7 @@ struct stream_type disk_image = {
     .select_track = di_select_track,
     .reset = di_reset,
     .next_flux = di_next_flux,
-    .suffix = { "adf", "eadf", "dsk", "hfe", "imd", "img", NULL }
+    .suffix = { "adf", "eadf", "dsk", "dskz", "dskref", "hfe", "imd", "img", NULL }
 };
 
 /*
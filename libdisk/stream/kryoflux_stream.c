@@ -13,10 +13,32 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+
+/* Number of track files which may be loaded ahead of the current track. */
+#define NR_PREFETCH 4
+
+/* Background loader of track files, in the order given to
+ * stream_set_track_order(). */
+struct kfs_prefetch {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool_t stop;
+    const char *basename;
+    unsigned int next, end, step; /* tracks still to load */
+    struct kfs_buf {
+        int track;     /* -1 if unused or discarded */
+        bool_t loading;
+        unsigned char *dat; /* NULL if the track could not be loaded */
+        unsigned int datsz;
+    } buf[NR_PREFETCH];
+};
 
 struct kfs_stream {
     struct stream s;
     char *basename;
+    struct kfs_prefetch *prefetch;
 
     /* Current track number. */
     unsigned int track;
@@ -66,9 +88,12 @@ static struct stream *kfs_open(const char *name, unsigned int data_rpm)
     return &kfss->s;
 }
 
+static void kfs_prefetch_stop(struct kfs_stream *kfss);
+
 static void kfs_close(struct stream *s)
 {
     struct kfs_stream *kfss = container_of(s, struct kfs_stream, s);
+    kfs_prefetch_stop(kfss);
     memfree(kfss->idxs);
     memfree(kfss->dat);
     memfree(kfss->basename);
@@ -125,13 +150,174 @@ fail:
     return NULL;
 }
 
-static int kfs_select_track(struct stream *s, unsigned int tracknr)
+/* Read a whole track file, or return NULL if it does not exist. */
+static unsigned char *kfs_load_track(
+    const char *basename, unsigned int tracknr, unsigned int *p_sz)
 {
-    struct kfs_stream *kfss = container_of(s, struct kfs_stream, s);
-    char trackname[strlen(kfss->basename) + 9];
+    char trackname[strlen(basename) + 9];
+    unsigned char *dat;
+    uint64_t t = trace_begin();
     off_t sz;
     int fd;
 
+    sprintf(trackname, "%s%02u.%u.raw", basename,
+            cyl(tracknr), hd(tracknr));
+    if ((fd = file_open(trackname, O_RDONLY)) == -1)
+        return NULL;
+    if (((sz = lseek(fd, 0, SEEK_END)) < 0) ||
+        (lseek(fd, 0, SEEK_SET) < 0))
+        err(1, "%s", trackname);
+    dat = memalloc(sz);
+    read_exact(fd, dat, sz);
+    close(fd);
+
+    trace_end(t, "stream", "load_file", tracknr, NULL);
+    *p_sz = sz;
+    return dat;
+}
+
+static struct kfs_buf *kfs_prefetch_free_buf(struct kfs_prefetch *pf)
+{
+    unsigned int i;
+    for (i = 0; i < NR_PREFETCH; i++)
+        if ((pf->buf[i].track < 0) && !pf->buf[i].loading)
+            return &pf->buf[i];
+    return NULL;
+}
+
+static void *kfs_prefetch_worker(void *_pf)
+{
+    struct kfs_prefetch *pf = _pf;
+    struct kfs_buf *b;
+    unsigned char *dat;
+    unsigned int tracknr, sz = 0;
+
+    pthread_mutex_lock(&pf->lock);
+
+    for (;;) {
+        while (!pf->stop && ((pf->next > pf->end)
+                             || ((b = kfs_prefetch_free_buf(pf)) == NULL)))
+            pthread_cond_wait(&pf->cond, &pf->lock);
+        if (pf->stop)
+            break;
+
+        tracknr = pf->next;
+        pf->next += pf->step;
+        b->track = tracknr;
+        b->loading = 1;
+        pthread_mutex_unlock(&pf->lock);
+
+        dat = kfs_load_track(pf->basename, tracknr, &sz);
+
+        pthread_mutex_lock(&pf->lock);
+        b->loading = 0;
+        if (b->track < 0) {
+            /* Discarded while loading. */
+            memfree(dat);
+        } else {
+            b->dat = dat;
+            b->datsz = sz;
+        }
+        pthread_cond_broadcast(&pf->cond);
+    }
+
+    pthread_mutex_unlock(&pf->lock);
+    return NULL;
+}
+
+static void kfs_prefetch_stop(struct kfs_stream *kfss)
+{
+    struct kfs_prefetch *pf = kfss->prefetch;
+    unsigned int i;
+
+    if (pf == NULL)
+        return;
+
+    pthread_mutex_lock(&pf->lock);
+    pf->stop = 1;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+    pthread_join(pf->thread, NULL);
+
+    for (i = 0; i < NR_PREFETCH; i++)
+        memfree(pf->buf[i].dat);
+    pthread_mutex_destroy(&pf->lock);
+    pthread_cond_destroy(&pf->cond);
+    memfree(pf);
+    kfss->prefetch = NULL;
+}
+
+static void kfs_set_track_order(
+    struct stream *s, unsigned int start, unsigned int end, unsigned int step)
+{
+    struct kfs_stream *kfss = container_of(s, struct kfs_stream, s);
+    struct kfs_prefetch *pf;
+    unsigned int i;
+
+    kfs_prefetch_stop(kfss);
+
+    pf = memalloc(sizeof(*pf));
+    pf->basename = kfss->basename;
+    pf->next = start;
+    pf->end = end;
+    pf->step = step ?: 1;
+    for (i = 0; i < NR_PREFETCH; i++)
+        pf->buf[i].track = -1;
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->cond, NULL);
+    kfss->prefetch = pf;
+
+    if (pthread_create(&pf->thread, NULL, kfs_prefetch_worker, pf) != 0)
+        err(1, NULL);
+}
+
+/* Claim track @tracknr from the prefetcher. Returns 0 if it was not
+ * prefetched. Tracks before @tracknr in the order are discarded. */
+static int kfs_prefetch_take(
+    struct kfs_stream *kfss, unsigned int tracknr,
+    unsigned char **p_dat, unsigned int *p_sz)
+{
+    struct kfs_prefetch *pf = kfss->prefetch;
+    struct kfs_buf *b;
+    unsigned int i;
+    int found = 0;
+
+    if (pf == NULL)
+        return 0;
+
+    pthread_mutex_lock(&pf->lock);
+
+    for (i = 0; i < NR_PREFETCH; i++) {
+        b = &pf->buf[i];
+        if ((b->track < 0) || (b->track > (int)tracknr))
+            continue;
+        if (b->track == (int)tracknr) {
+            while (b->loading)
+                pthread_cond_wait(&pf->cond, &pf->lock);
+            *p_dat = b->dat;
+            *p_sz = b->datsz;
+            found = 1;
+        } else {
+            memfree(b->dat);
+        }
+        b->dat = NULL;
+        b->track = -1;
+    }
+
+    /* If the caller has skipped ahead, so do we. */
+    if (tracknr >= pf->next)
+        pf->next = tracknr + pf->step;
+
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+
+    return found;
+}
+
+static int kfs_select_track(struct stream *s, unsigned int tracknr)
+{
+    struct kfs_stream *kfss = container_of(s, struct kfs_stream, s);
+
     if (kfss->dat && (kfss->track == tracknr))
         return 0;
 
@@ -141,20 +327,13 @@ static int kfs_select_track(struct stream *s, unsigned int tracknr)
     memfree(kfss->dat);
     kfss->dat = NULL;
 
-    sprintf(trackname, "%s%02u.%u.raw", kfss->basename,
-            cyl(tracknr), hd(tracknr));
-    if ((fd = file_open(trackname, O_RDONLY)) == -1)
+    if (!kfs_prefetch_take(kfss, tracknr, &kfss->dat, &kfss->datsz))
+        kfss->dat = kfs_load_track(kfss->basename, tracknr, &kfss->datsz);
+    if (kfss->dat == NULL)
         return -1;
-    if (((sz = lseek(fd, 0, SEEK_END)) < 0) ||
-        (lseek(fd, 0, SEEK_SET) < 0))
-        err(1, "%s", trackname);
-    kfss->dat = memalloc(sz);
-    read_exact(fd, kfss->dat, sz);
-    close(fd);
-    kfss->datsz = sz;
     kfss->track = tracknr;
 
-    kfss->idxs = kfs_decode_index(kfss->dat, sz);
+    kfss->idxs = kfs_decode_index(kfss->dat, kfss->datsz);
     if (kfss->idxs == NULL) {
         memfree(kfss->dat);
         kfss->dat = NULL;
@@ -257,6 +436,7 @@ struct stream_type kryoflux_stream = {
     .open = kfs_open,
     .close = kfs_close,
     .select_track = kfs_select_track,
+    .set_track_order = kfs_set_track_order,
     .reset = kfs_reset,
     .next_flux = kfs_next_flux,
     .suffix = { NULL }
@@ -0,0 +1,212 @@
+/*
+ * stream/memory.c
+ *
+ * Memory-backed flux stream. The flux of a single track is captured from
+ * another stream, or supplied by the caller, into a read-only buffer which
+ * may be shared by any number of independent stream cursors.
+ *
+ * Written in 2026 by agent
+ */
+
+#include <limits.h>
+#include <libdisk/util.h>
+#include <private/stream.h>
+
+/* Give up on a capture which is not bounded by index pulses. */
+#define MAX_FLUX (64u<<20)
+
+struct mem_index {
+    uint32_t pos;    /* flux sample which contains the index pulse */
+    uint32_t off_ns; /* offset of index pulse into that flux sample */
+};
+
+struct mem_flux {
+    unsigned int refcnt;
+    unsigned int tracknr;
+    uint32_t max_revolutions;
+    uint32_t nr_flux, nr_index;
+    uint32_t *flux;
+    struct mem_index *index;
+};
+
+struct mem_stream {
+    struct stream s;
+    struct mem_flux *mf;
+    uint32_t pos, idx_i;
+};
+
+static void ms_close(struct stream *s)
+{
+    struct mem_stream *ms = container_of(s, struct mem_stream, s);
+    struct mem_flux *mf = ms->mf;
+
+    if (__sync_sub_and_fetch(&mf->refcnt, 1) == 0) {
+        memfree(mf->flux);
+        memfree(mf->index);
+        memfree(mf);
+    }
+
+    memfree(ms);
+}
+
+static int ms_select_track(struct stream *s, unsigned int tracknr)
+{
+    struct mem_stream *ms = container_of(s, struct mem_stream, s);
+
+    if (tracknr != ms->mf->tracknr)
+        return -1;
+
+    s->max_revolutions = ms->mf->max_revolutions;
+    return 0;
+}
+
+static void ms_reset(struct stream *s)
+{
+    struct mem_stream *ms = container_of(s, struct mem_stream, s);
+    ms->pos = ms->idx_i = 0;
+}
+
+static int ms_next_flux(struct stream *s)
+{
+    struct mem_stream *ms = container_of(s, struct mem_stream, s);
+    struct mem_flux *mf = ms->mf;
+
+    if (ms->pos >= mf->nr_flux)
+        return -1;
+
+    if ((ms->idx_i < mf->nr_index) && (mf->index[ms->idx_i].pos == ms->pos))
+        s->ns_to_index = s->flux + mf->index[ms->idx_i++].off_ns;
+
+    s->flux += mf->flux[ms->pos++];
+    return 0;
+}
+
+static struct stream_type memory_stream = {
+    .close = ms_close,
+    .select_track = ms_select_track,
+    .reset = ms_reset,
+    .next_flux = ms_next_flux
+};
+
+static struct stream *mem_stream_open(
+    struct mem_flux *mf, unsigned int drive_rpm, unsigned int data_rpm)
+{
+    struct mem_stream *ms = memalloc(sizeof(*ms));
+
+    __sync_add_and_fetch(&mf->refcnt, 1);
+    ms->mf = mf;
+
+    stream_setup(&ms->s, &memory_stream, drive_rpm, data_rpm);
+
+    return &ms->s;
+}
+
+/* New cursor over @mf with the rpm and PLL settings of stream @s. */
+static struct stream *mem_stream_open_like(
+    struct mem_flux *mf, struct stream *s)
+{
+    struct stream *ms = mem_stream_open(mf, s->drive_rpm, s->data_rpm);
+
+    ms->pll_period_adj_pct = s->pll_period_adj_pct;
+    ms->pll_phase_adj_pct = s->pll_phase_adj_pct;
+
+    return ms;
+}
+
+struct stream *memory_stream_capture(struct stream *s, unsigned int tracknr)
+{
+    struct mem_flux *mf;
+    struct stream *ms;
+    uint32_t max_flux = 0, max_index = 0, extra = 2;
+
+    mf = memalloc(sizeof(*mf));
+    mf->tracknr = tracknr;
+    mf->max_revolutions = s->max_revolutions;
+
+    s->flux = 0;
+    s->nr_index = 0;
+    s->ns_to_index = INT_MAX;
+    s->type->reset(s);
+
+    /* Pull flux samples until the stream's revolution limit is passed. The
+     * source may depend on s->nr_index, so we count index pulses as the PLL
+     * would. Each sample is recorded relative to zero residual flux. */
+    while ((s->nr_index <= mf->max_revolutions) || extra--) {
+        if (mf->nr_flux == MAX_FLUX)
+            break;
+        s->flux = 0;
+        s->ns_to_index = INT_MAX;
+        if (s->type->next_flux(s) != 0)
+            break;
+        if (mf->nr_flux == max_flux) {
+            uint32_t *flux = mf->flux;
+            max_flux = max_flux ? max_flux * 2 : 65536;
+            mf->flux = memalloc(max_flux * sizeof(*flux));
+            memcpy(mf->flux, flux, mf->nr_flux * sizeof(*flux));
+            memfree(flux);
+        }
+        if (s->ns_to_index != INT_MAX) {
+            if (mf->nr_index == max_index) {
+                struct mem_index *index = mf->index;
+                max_index = max_index ? max_index * 2 : 8;
+                mf->index = memalloc(max_index * sizeof(*index));
+                memcpy(mf->index, index, mf->nr_index * sizeof(*index));
+                memfree(index);
+            }
+            mf->index[mf->nr_index].pos = mf->nr_flux;
+            mf->index[mf->nr_index].off_ns = max(s->ns_to_index, 0);
+            mf->nr_index++;
+            s->nr_index++;
+        }
+        mf->flux[mf->nr_flux++] = max(s->flux, 0);
+    }
+
+    ms = mem_stream_open_like(mf, s);
+    ms->double_step = 0;
+    return ms;
+}
+
+struct stream *stream_flux_open(
+    unsigned int tracknr, const uint32_t *flux, unsigned int nr_flux,
+    const uint32_t *index, unsigned int nr_index,
+    unsigned int drive_rpm, unsigned int data_rpm)
+{
+    struct mem_flux *mf;
+    unsigned int i;
+
+    mf = memalloc(sizeof(*mf));
+    mf->tracknr = tracknr;
+    mf->max_revolutions = nr_index;
+
+    mf->nr_flux = nr_flux;
+    mf->flux = memalloc(nr_flux * sizeof(*flux));
+    memcpy(mf->flux, flux, nr_flux * sizeof(*flux));
+
+    mf->nr_index = nr_index;
+    mf->index = memalloc(nr_index * sizeof(*mf->index));
+    for (i = 0; i < nr_index; i++)
+        mf->index[i].pos = index[i];
+
+    return mem_stream_open(mf, drive_rpm, data_rpm);
+}
+
+struct stream *memory_stream_dup(struct stream *s)
+{
+    struct mem_stream *ms;
+
+    if (s->type != &memory_stream)
+        return NULL;
+
+    ms = container_of(s, struct mem_stream, s);
+    return mem_stream_open_like(ms->mf, s);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
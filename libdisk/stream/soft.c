@@ -7,6 +7,7 @@
  */
 
 #include <libdisk/util.h>
+#include <libdisk/disk.h>
 #include <private/stream.h>
 
 struct soft_stream {
@@ -14,11 +15,14 @@ struct soft_stream {
     uint8_t *dat;
     uint16_t *speed;
     uint32_t pos, bitlen, ns_per_cell;
+    struct bitcell_flux bf;
+    bool_t bf_valid; /* bf has been built, and the track has 1-bits */
 };
 
 static void ss_close(struct stream *s)
 {
     struct soft_stream *ss = container_of(s, struct soft_stream, s);
+    bitcell_flux_free(&ss->bf);
     memfree(ss);
 }
 
@@ -31,6 +35,7 @@ static void ss_reset(struct stream *s)
 {
     struct soft_stream *ss = container_of(s, struct soft_stream, s);
     ss->pos = 0;
+    ss->bf.pos = 0;
 }
 
 static int ss_next_flux(struct stream *s)
@@ -40,14 +45,21 @@ static int ss_next_flux(struct stream *s)
     uint8_t dat;
     int flux = 0;
 
+    if (ss->bf_valid) {
+        bitcell_flux_next(&ss->bf, s);
+        return 0;
+    }
+
     do {
         if (++ss->pos >= ss->bitlen) {
             ss_reset(s);
             s->ns_to_index = s->flux + flux;
         }
         dat = !!(ss->dat[ss->pos >> 3] & (0x80u >> (ss->pos & 7)));
-        speed = ss->speed ? ss->speed[ss->pos] : 1000u;
-        flux += (ss->ns_per_cell * speed) / 1000u;
+        speed = ss->speed ? ss->speed[ss->pos] : SPEED_AVG;
+        if (speed == SPEED_WEAK)
+            speed = SPEED_AVG;
+        flux += (ss->ns_per_cell * speed) / SPEED_AVG;
     } while (!dat && (flux < 1000000 /* 1ms */));
 
     s->flux += flux;
@@ -71,6 +83,8 @@ struct stream *stream_soft_open(
     ss->speed = speed;
     ss->bitlen = bitlen;
     ss->ns_per_cell = track_nsecs_from_rpm(data_rpm) / ss->bitlen;
+    ss->bf_valid = !bitcell_flux_build(
+        &ss->bf, data, speed, bitlen, ss->ns_per_cell);
 
     stream_setup(&ss->s, &stream_soft, data_rpm, data_rpm);
 
@@ -102,16 +102,48 @@ void stream_close(struct stream *s)
 
 int stream_select_track(struct stream *s, unsigned int tracknr)
 {
+    uint64_t t = trace_begin();
     int rc;
 
     s->max_revolutions = 0;
     rc = s->type->select_track(s, tracknr << s->double_step);
-    if (rc)
-        return rc;
+    if (rc == 0) {
+        s->max_revolutions = max_t(uint32_t, s->max_revolutions, 4);
+        stream_reset(s);
+    }
+
+    trace_end(t, "stream", "select_track", tracknr, NULL);
+    return rc;
+}
+
+void stream_set_track_order(
+    struct stream *s, unsigned int start, unsigned int end, unsigned int step)
+{
+    if (s->type->set_track_order != NULL)
+        s->type->set_track_order(s, start << s->double_step,
+                                 end << s->double_step,
+                                 step << s->double_step);
+}
+
+void stream_set_revolutions(struct stream *s, uint32_t mask)
+{
+    if (s->type->set_revolutions != NULL)
+        s->type->set_revolutions(s, mask);
+}
+
+struct stream *stream_capture_track(struct stream *s, unsigned int tracknr)
+{
+    s->max_revolutions = 0;
+    if (s->type->select_track(s, tracknr << s->double_step))
+        return NULL;
     s->max_revolutions = max_t(uint32_t, s->max_revolutions, 4);
 
-    stream_reset(s);
-    return 0;
+    return memory_stream_capture(s, tracknr);
+}
+
+struct stream *stream_dup(struct stream *s)
+{
+    return memory_stream_dup(s);
 }
 
 static void _stream_reset(struct stream *s)
@@ -160,6 +192,7 @@ void stream_start_crc(struct stream *s)
     uint16_t x = htobe16(mfm_decode_word(s->word));
     s->crc16_ccitt = crc16_ccitt(&x, 2, 0xffff);
     s->crc_bitoff = 0;
+    counter_inc(ctr_syncs);
 }
 
 int stream_next_bit(struct stream *s)
@@ -171,6 +204,8 @@ int stream_next_bit(struct stream *s)
     s->index_offset_bc++;
     if ((b = flux_next_bit(s)) == -1)
         return -1;
+    s->nr_bits++;
+    counter_inc(ctr_bitcells);
     lat = s->latency - lat;
     s->index_offset_ns += lat;
     s->ns_to_index -= lat;
@@ -228,9 +263,12 @@ static int flux_next_bit(struct stream *s)
 {
     int new_flux;
 
-    while (s->flux < (s->clock/2))
+    while (s->flux < (s->clock/2)) {
         if (s->type->next_flux(s) != 0)
             return -1;
+        s->nr_flux++;
+        counter_inc(ctr_flux);
+    }
 
     s->latency += s->clock;
     s->flux -= s->clock;
@@ -247,6 +285,7 @@ static int flux_next_bit(struct stream *s)
         s->clock += s->flux * s->pll_period_adj_pct / 100;
     } else {
         /* Out of sync: adjust base clock towards centre. */
+        counter_inc(ctr_pll_unsync);
         s->clock += (s->clock_centre - s->clock) * s->pll_period_adj_pct / 100;
     }
 
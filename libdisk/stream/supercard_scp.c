@@ -12,21 +12,35 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
 
 struct scp_stream {
     struct stream s;
-    int fd;
+
+    /* The whole file, mapped read-only. */
+    char *name;
+    const uint8_t *map;
+    size_t mapsz;
+
+    /* Checksum verification, carried out as the file is read. */
+    bool_t verify;
+    uint32_t csum, csum_expected;
+    size_t csum_pos;         /* checksummed up to here */
+    unsigned int end_track;  /* last track: the file is summed to its end */
 
     /* Current track number. */
     unsigned int track;
 
-    /* Raw track data. */
-    uint16_t *dat;
+    /* Flux intervals of the current track, in ticks, with overflow samples
+     * folded into the following interval. */
+    uint32_t *dat;
     unsigned int datsz;
 
     bool_t index_cued;
     unsigned int revs;       /* stored disk revolutions */
+    uint32_t rev_mask;       /* stored revolutions to use (0: all) */
+    unsigned int nr_revs;    /* revolutions in dat[] */
     unsigned int dat_idx;    /* current index into dat[] */
     unsigned int index_pos;  /* next index offset */
     int jitter;              /* accumulated injected jitter */
@@ -53,21 +67,77 @@ struct disk_header {
 
 #define SCK_NS_PER_TICK (25u)
 
+/* Little-endian 32-bit field at @p, which may be unaligned. */
+static uint32_t read_le32(const uint8_t *p)
+{
+    uint32_t x;
+    memcpy(&x, p, 4);
+    return le32toh(x);
+}
+
+/* Is stored revolution @rev selected? A mask can only name the first 32. */
+static bool_t rev_selected(const struct scp_stream *scss, unsigned int rev)
+{
+    return !scss->rev_mask || ((rev < 32) && (scss->rev_mask & (1u << rev)));
+}
+
+/* Sum of bytes, eight at a time. Each 16-bit lane of @acc gains at most
+ * 2*255 per word, so is folded into the total every 128 words. */
+static uint32_t byte_sum(const uint8_t *p, size_t n)
+{
+    const uint64_t m = 0x00ff00ff00ff00ffull;
+    uint64_t w, acc;
+    uint32_t sum = 0;
+    unsigned int i;
+
+    while (n >= 8) {
+        acc = 0;
+        for (i = 0; (i < 128) && (n >= 8); i++, p += 8, n -= 8) {
+            memcpy(&w, p, 8);
+            acc += (w & m) + ((w >> 8) & m);
+        }
+        sum += (acc & 0xffff) + ((acc >> 16) & 0xffff)
+            + ((acc >> 32) & 0xffff) + (acc >> 48);
+    }
+
+    while (n--)
+        sum += *p++;
+
+    return sum;
+}
+
+/* Extend the checksum over the file up to offset @end. A mismatch is
+ * fatal, as it would be if the whole file were checked at open. */
+static void scp_checksum_to(struct scp_stream *scss, size_t end)
+{
+    if (!scss->verify || (end <= scss->csum_pos))
+        return;
+    end = min(end, scss->mapsz);
+    scss->csum += byte_sum(&scss->map[scss->csum_pos], end - scss->csum_pos);
+    scss->csum_pos = end;
+    if ((end == scss->mapsz) && (scss->csum != scss->csum_expected))
+        errx(1, "%s has bad checksum (%08x, expected %08x)",
+             scss->name, scss->csum, scss->csum_expected);
+}
+
 static struct stream *scp_open(const char *name, unsigned int data_rpm)
 {
     struct stat sbuf;
     struct scp_stream *scss;
     struct disk_header header;
+    const uint8_t *map;
+    size_t mapsz;
     uint8_t revs;
-    int fd;
 
     if (stat(name, &sbuf) < 0)
         return NULL;
 
-    if ((fd = file_open(name, O_RDONLY)) == -1)
-        err(1, "%s", name);
+    if (sbuf.st_size < sizeof(header))
+        errx(1, "%s is not a SCP file!", name);
 
-    read_exact(fd, &header, sizeof(header));
+    if ((map = map_file(name, &mapsz)) == NULL)
+        err(1, "%s", name);
+    memcpy(&header, map, sizeof(header));
 
     if (memcmp(header.sig, "SCP", 3) != 0)
         errx(1, "%s is not a SCP file!", name);
@@ -79,27 +149,21 @@ static struct stream *scp_open(const char *name, unsigned int data_rpm)
         errx(1, "%s has unsupported bit cell time width (%u)",
              name, header.cell_width);
 
+    scss = memalloc(sizeof(*scss) + revs*sizeof(unsigned int));
+    scss->name = memalloc(strlen(name) + 1);
+    strcpy(scss->name, name);
+    scss->map = map;
+    scss->mapsz = mapsz;
+
+    /* The checksum covers all but the header. Rather than read the whole
+     * file now, verify it as tracks are read, finishing when the last track
+     * is read, or at close if it never is. */
     if (!(header.flags & (1u<<4)) && header.checksum) {
-        int sz;
-        uint8_t *p, *buf;
-        uint32_t csum = 0;
-        if ((sz = lseek(fd, 0, SEEK_END)) < 16)
-            errx(1, "%s is too short", name);
-        sz -= 16;
-        buf = memalloc(sz);
-        lseek(fd, 16, SEEK_SET);
-        read_exact(fd, buf, sz);
-        p = buf;
-        while (sz--)
-            csum += *p++;
-        memfree(buf);
-        if (csum != le32toh(header.checksum))
-            errx(1, "%s has bad checksum", name);
-        lseek(fd, 16, SEEK_SET);
+        scss->verify = 1;
+        scss->csum_expected = le32toh(header.checksum);
+        scss->csum_pos = 16;
     }
-
-    scss = memalloc(sizeof(*scss) + revs*sizeof(unsigned int));
-    scss->fd = fd;
+    scss->end_track = header.end_track;
     scss->revs = revs;
     scss->index_cued = !!(header.flags & (1u<<0)) || (scss->revs == 1);
     if (!scss->index_cued)
@@ -111,18 +175,54 @@ static struct stream *scp_open(const char *name, unsigned int data_rpm)
 static void scp_close(struct stream *s)
 {
     struct scp_stream *scss = container_of(s, struct scp_stream, s);
-    close(scss->fd);
+    scp_checksum_to(scss, scss->mapsz);
+    unmap_file((void *)scss->map, scss->mapsz);
     memfree(scss->dat);
+    memfree(scss->name);
     memfree(scss);
 }
 
+static void scp_set_revolutions(struct stream *s, uint32_t mask)
+{
+    struct scp_stream *scss = container_of(s, struct scp_stream, s);
+
+    scss->rev_mask = mask;
+
+    /* Reload the current track with the new selection. */
+    memfree(scss->dat);
+    scss->dat = NULL;
+}
+
+/* Decode @nr big-endian samples into flux intervals at @out. Overflow
+ * samples carry into the next interval via *@carry. Returns the number of
+ * intervals written. */
+static unsigned int scp_decode(
+    const uint8_t *in, unsigned int nr, uint32_t *out, uint32_t *carry)
+{
+    uint32_t val = *carry, t;
+    unsigned int i, n = 0;
+
+    for (i = 0; i < nr; i++) {
+        t = ((uint32_t)in[2*i] << 8) | in[2*i+1];
+        if (t == 0) { /* overflow */
+            val += 0x10000;
+            continue;
+        }
+        out[n++] = val + t;
+        val = 0;
+    }
+
+    *carry = val;
+    return n;
+}
+
 static int scp_select_track(struct stream *s, unsigned int tracknr)
 {
     struct scp_stream *scss = container_of(s, struct scp_stream, s);
-    uint8_t trk_header[4];
-    uint32_t longwords[3];
-    unsigned int rev, trkoffset[scss->revs];
-    uint32_t hdr_offset, tdh_offset;
+    const uint8_t *map = scss->map, *rev_hdr, *trk_hdr;
+    unsigned int rev, nr_samples[scss->revs];
+    uint32_t hdr_offset, tdh_offset, carry = 0;
+    uint64_t trkoffset[scss->revs], trkend = 0, total_samples = 0;
 
     if (scss->dat && (scss->track == tracknr))
         return 0;
@@ -130,59 +230,69 @@ static int scp_select_track(struct stream *s, unsigned int tracknr)
     memfree(scss->dat);
     scss->dat = NULL;
     scss->datsz = 0;
-    
-    hdr_offset = 0x10 + tracknr*sizeof(uint32_t);
 
-    if (lseek(scss->fd, hdr_offset, SEEK_SET) != hdr_offset)
+    hdr_offset = 0x10 + tracknr*sizeof(uint32_t);
+    if ((hdr_offset + 4) > scss->mapsz)
         return -1;
+    tdh_offset = read_le32(&map[hdr_offset]);
 
-    read_exact(scss->fd, longwords, sizeof(uint32_t));
-    tdh_offset = le32toh(longwords[0]);
-
-    if (lseek(scss->fd, tdh_offset, SEEK_SET) != tdh_offset)
+    /* The file is untrusted: check bounds in 64 bits, which cannot wrap. */
+    if ((tdh_offset >= scss->mapsz)
+        || ((tdh_offset + 4ull + (scss->revs + 1) * 12ull) > scss->mapsz))
         return -1;
-
-    read_exact(scss->fd, trk_header, sizeof(trk_header));
-    if (memcmp(trk_header, "TRK", 3) != 0)
+    trk_hdr = &map[tdh_offset];
+    if (memcmp(trk_hdr, "TRK", 3) != 0)
         return -1;
 
-    if (trk_header[3] != tracknr)
+    if (trk_hdr[3] != tracknr)
         return -1;
 
-    if (!scss->index_cued) {
-        /* Skip first partial revolution. */
-        lseek(scss->fd, 12, SEEK_CUR);
-    }
+    /* Skip first partial revolution. */
+    rev_hdr = trk_hdr + (scss->index_cued ? 4 : 16);
 
     scss->total_ticks = 0;
-    for (rev = 0 ; rev < scss->revs ; rev++) {
-        read_exact(scss->fd, longwords, sizeof(longwords));
-        trkoffset[rev] = tdh_offset + le32toh(longwords[2]);
-        scss->index_off[rev] = le32toh(longwords[1]);
-        scss->total_ticks += le32toh(longwords[0]);
-        scss->datsz += scss->index_off[rev];
+    for (rev = 0 ; rev < scss->revs ; rev++, rev_hdr += 12) {
+        if (!rev_selected(scss, rev))
+            continue;
+        trkoffset[rev] = (uint64_t)tdh_offset + read_le32(&rev_hdr[8]);
+        nr_samples[rev] = read_le32(&rev_hdr[4]);
+        trkend = max_t(uint64_t, trkend,
+                       trkoffset[rev] + nr_samples[rev] * 2ull);
+        if (trkend > scss->mapsz)
+            return -1;
+        scss->total_ticks += read_le32(&rev_hdr[0]);
+        total_samples += nr_samples[rev];
     }
 
+    /* Revolutions may share samples: bound the total we will decode. */
+    if ((total_samples == 0)
+        || (total_samples > (UINT_MAX / sizeof(scss->dat[0]))))
+        return -1;
+    scss->datsz = total_samples;
     scss->dat = memalloc(scss->datsz * sizeof(scss->dat[0]));
     scss->datsz = 0;
+    scss->nr_revs = 0;
 
     for (rev = 0 ; rev < scss->revs ; rev++) {
-        if (lseek(scss->fd, trkoffset[rev], SEEK_SET) != trkoffset[rev])
-            return -1;
-        read_exact(scss->fd, &scss->dat[scss->datsz],
-                   scss->index_off[rev] * sizeof(scss->dat[0]));
-        scss->datsz += scss->index_off[rev];
-        scss->index_off[rev] = scss->datsz;
+        if (!rev_selected(scss, rev))
+            continue;
+        scss->datsz += scp_decode(&map[trkoffset[rev]], nr_samples[rev],
+                                  &scss->dat[scss->datsz], &carry);
+        scss->index_off[scss->nr_revs++] = scss->datsz;
     }
 
     scss->track = tracknr;
 
+    /* Checksum the file as far as this track, while it is fresh in cache,
+     * so that a bad image is rejected before its last track is decoded. */
+    scp_checksum_to(scss, (tracknr >= scss->end_track) ? scss->mapsz : trkend);
+
     /* Don't jitter ED tracks (average bitcell shorter than 2us). */
-    scss->apply_jitter = ((scss->revs == 1) &&
+    scss->apply_jitter = ((scss->nr_revs == 1) && scss->datsz &&
                           ((scss->total_ticks / scss->datsz)
                            > (2000 / SCK_NS_PER_TICK)));
 
-    s->max_revolutions = scss->revs + 1;
+    s->max_revolutions = scss->nr_revs + 1;
     return 0;
 }
 
@@ -199,12 +309,12 @@ static void scp_reset(struct stream *s)
 static int scp_next_flux(struct stream *s)
 {
     struct scp_stream *scss = container_of(s, struct scp_stream, s);
-    uint32_t val = 0, t;
+    uint32_t val = 0;
     unsigned int nr_index_seen = 0;
 
     for (;;) {
         if (scss->dat_idx >= scss->index_pos) {
-            uint32_t rev = s->nr_index % scss->revs;
+            uint32_t rev = s->nr_index % scss->nr_revs;
             if ((rev == 0) && (scss->index_pos != 0)) {
                 /* We are wrapping back to the start of the dump. Unless a flux
                  * reversal sits exactly on the index we have some time to
@@ -220,16 +330,10 @@ static int scp_next_flux(struct stream *s)
              * Bail if we see no flux transitions in a complete revolution. */
             if (nr_index_seen++)
                 break;
-        }
-
-        t = be16toh(scss->dat[scss->dat_idx++]);
-
-        if (t == 0) { /* overflow */
-            val += 0x10000;
             continue;
         }
 
-        val += t;
+        val += scss->dat[scss->dat_idx++];
         break;
     }
 
@@ -271,6 +375,7 @@ struct stream_type supercard_scp = {
     .open = scp_open,
     .close = scp_close,
     .select_track = scp_select_track,
+    .set_revolutions = scp_set_revolutions,
     .reset = scp_reset,
     .next_flux = scp_next_flux,
     .suffix = { "scp", NULL }
@@ -0,0 +1,149 @@
+/*
+ * trace.c
+ *
+ * Optional timeline of libdisk work, written as Chrome trace events: each
+ * span is a complete ("X") event in a lane for the thread which ran it. The
+ * file may be loaded into chrome://tracing or Perfetto.
+ *
+ * Written in 2026 by agent
+ */
+
+#include <libdisk/util.h>
+#include <private/util.h>
+#include <pthread.h>
+#include <unistd.h>
+
+bool_t trace_on;
+
+static struct {
+    pthread_mutex_t lock;
+    FILE *f;
+    uint64_t t0;
+    unsigned int nr_threads, gen;
+    int pid;
+} trace = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Trace lane of the current thread, valid if allocated in the current trace
+ * (trace_gen == trace.gen). */
+static __thread unsigned int trace_tid, trace_gen;
+
+static void trace_string(const char *s)
+{
+    fputc('"', trace.f);
+    for (; *s != '\0'; s++) {
+        if ((*s == '"') || (*s == '\\'))
+            fprintf(trace.f, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(trace.f, "\\u%04x", *s);
+        else
+            fputc(*s, trace.f);
+    }
+    fputc('"', trace.f);
+}
+
+/* Microseconds, as trace events expect, to nanosecond precision. */
+static void trace_us(const char *field, uint64_t ns)
+{
+    fprintf(trace.f, ",\"%s\":%llu.%03u", field,
+            (unsigned long long)(ns / 1000), (unsigned int)(ns % 1000));
+}
+
+/* Allocate a lane for the current thread. Called with the lock held. */
+static void trace_new_thread(void)
+{
+    trace_tid = ++trace.nr_threads;
+    trace_gen = trace.gen;
+    fprintf(trace.f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\","
+            "\"pid\":%d,\"tid\":%u,\"args\":{\"name\":",
+            trace.pid, trace_tid);
+    if (trace_tid == 1)
+        fprintf(trace.f, "\"main\"");
+    else
+        fprintf(trace.f, "\"worker %u\"", trace_tid - 1);
+    fprintf(trace.f, "}}");
+}
+
+int trace_start(const char *name)
+{
+    pthread_mutex_lock(&trace.lock);
+
+    BUG_ON(trace.f != NULL);
+    if ((trace.f = fopen(name, "w")) == NULL) {
+        warn("%s", name);
+        pthread_mutex_unlock(&trace.lock);
+        return -1;
+    }
+
+    trace.pid = getpid();
+    trace.t0 = time_ns();
+    fprintf(trace.f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+            "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"args\":{\"name\":\"libdisk\"}}", trace.pid);
+
+    /* The caller's thread is the main lane. */
+    trace.nr_threads = 0;
+    trace.gen++;
+    trace_new_thread();
+    __atomic_store_n(&trace_on, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&trace.lock);
+    return 0;
+}
+
+void trace_stop(void)
+{
+    pthread_mutex_lock(&trace.lock);
+
+    if (trace.f != NULL) {
+        __atomic_store_n(&trace_on, 0, __ATOMIC_RELAXED);
+        fprintf(trace.f, "\n]}\n");
+        if (fclose(trace.f) != 0)
+            warn("trace file");
+        trace.f = NULL;
+    }
+
+    pthread_mutex_unlock(&trace.lock);
+}
+
+void __trace_end(uint64_t start, const char *cat, const char *name,
+                 int tracknr, const char *detail)
+{
+    uint64_t end = time_ns();
+
+    pthread_mutex_lock(&trace.lock);
+
+    /* Spans ending after tracing stops are dropped. */
+    if ((trace.f == NULL) || (start < trace.t0))
+        goto out;
+
+    if (trace_gen != trace.gen)
+        trace_new_thread();
+
+    fprintf(trace.f, ",\n{\"name\":");
+    trace_string(name);
+    fprintf(trace.f, ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u",
+            cat, trace.pid, trace_tid);
+    trace_us("ts", start - trace.t0);
+    trace_us("dur", end - start);
+    fprintf(trace.f, ",\"args\":{");
+    if (tracknr >= 0)
+        fprintf(trace.f, "\"track\":\"%u.%u\"", cyl(tracknr), hd(tracknr));
+    if (detail != NULL) {
+        fprintf(trace.f, "%s\"detail\":", (tracknr >= 0) ? "," : "");
+        trace_string(detail);
+    }
+    fprintf(trace.f, "}}");
+
+out:
+    pthread_mutex_unlock(&trace.lock);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -7,9 +7,16 @@
  */
 
 #include <libdisk/util.h>
+#include <private/util.h>
 
 #include <ctype.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <time.h>
+#if !defined(__MINGW32__)
+#include <sys/mman.h>
+#endif
 
 void __bug(const char *file, int line)
 {
@@ -72,6 +79,51 @@ void read_exact(int fd, void *buf, size_t count)
     }
 }
 
+void *map_file(const char *name, size_t *psize)
+{
+    struct stat st;
+    void *p;
+    int fd;
+
+    if ((fd = file_open(name, O_RDONLY)) == -1)
+        return NULL;
+    if ((fstat(fd, &st) < 0) || (st.st_size == 0)) {
+        close(fd);
+        return NULL;
+    }
+    *psize = st.st_size;
+#if defined(__MINGW32__)
+    p = memalloc(*psize);
+    read_exact(fd, p, *psize);
+#else
+    if ((p = mmap(NULL, *psize, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+        p = NULL;
+#endif
+    close(fd);
+    return p;
+}
+
+void unmap_file(void *p, size_t size)
+{
+#if defined(__MINGW32__)
+    memfree(p);
+#else
+    munmap(p, size);
+#endif
+}
+
+void *memgrow(void *old, unsigned int *max, unsigned int nr, size_t sz)
+{
+    void *new;
+    if (nr < *max)
+        return old;
+    *max = *max ? *max * 2 : 16;
+    new = memalloc(*max * sz);
+    memcpy(new, old, nr * sz);
+    memfree(old);
+    return new;
+}
+
 void write_exact(int fd, const void *buf, size_t count)
 {
     ssize_t done;
@@ -145,6 +197,125 @@ uint16_t rnd16(uint32_t *p_seed)
     return *p_seed >> 16;
 }
 
+uint64_t time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ror32(x,n) (((x) >> (n)) | ((x) << (32-(n))))
+
+static void sha256_block(struct sha256_ctx *ctx, const uint8_t *p)
+{
+    uint32_t w[64], s[8], t1, t2;
+    unsigned int i;
+
+    for (i = 0; i < 16; i++, p += 4)
+        w[i] = ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    for (; i < 64; i++)
+        w[i] = w[i-16] + w[i-7]
+            + (ror32(w[i-15], 7) ^ ror32(w[i-15], 18) ^ (w[i-15] >> 3))
+            + (ror32(w[i-2], 17) ^ ror32(w[i-2], 19) ^ (w[i-2] >> 10));
+
+    memcpy(s, ctx->h, sizeof(s));
+    for (i = 0; i < 64; i++) {
+        t1 = s[7] + (ror32(s[4], 6) ^ ror32(s[4], 11) ^ ror32(s[4], 25))
+            + ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256_k[i] + w[i];
+        t2 = (ror32(s[0], 2) ^ ror32(s[0], 13) ^ ror32(s[0], 22))
+            + ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+        memmove(&s[1], &s[0], 7 * sizeof(s[0]));
+        s[4] += t1;
+        s[0] = t1 + t2;
+    }
+
+    for (i = 0; i < 8; i++)
+        ctx->h[i] += s[i];
+}
+
+void sha256_init(struct sha256_ctx *ctx)
+{
+    static const uint32_t h[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->h, h, sizeof(h));
+    ctx->len = 0;
+}
+
+void sha256_add(struct sha256_ctx *ctx, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    unsigned int off = ctx->len & 63, n;
+
+    ctx->len += len;
+
+    if (off != 0) {
+        n = min_t(size_t, 64 - off, len);
+        memcpy(&ctx->buf[off], p, n);
+        p += n; len -= n;
+        if ((off + n) < 64)
+            return;
+        sha256_block(ctx, ctx->buf);
+    }
+
+    for (; len >= 64; p += 64, len -= 64)
+        sha256_block(ctx, p);
+
+    memcpy(ctx->buf, p, len);
+}
+
+void sha256_final(struct sha256_ctx *ctx, uint8_t digest[SHA256_LEN])
+{
+    uint64_t bits = ctx->len * 8;
+    unsigned int i, off = ctx->len & 63;
+
+    ctx->buf[off++] = 0x80;
+    if (off > 56) {
+        memset(&ctx->buf[off], 0, 64 - off);
+        sha256_block(ctx, ctx->buf);
+        off = 0;
+    }
+    memset(&ctx->buf[off], 0, 56 - off);
+    for (i = 0; i < 8; i++)
+        ctx->buf[56+i] = bits >> (56 - i*8);
+    sha256_block(ctx, ctx->buf);
+
+    for (i = 0; i < 8; i++) {
+        digest[i*4+0] = ctx->h[i] >> 24;
+        digest[i*4+1] = ctx->h[i] >> 16;
+        digest[i*4+2] = ctx->h[i] >> 8;
+        digest[i*4+3] = ctx->h[i];
+    }
+}
+
+void sha256(const void *buf, size_t len, uint8_t digest[SHA256_LEN])
+{
+    struct sha256_ctx ctx;
+    sha256_init(&ctx);
+    sha256_add(&ctx, buf, len);
+    sha256_final(&ctx, digest);
+}
+
 #if !defined(__PLATFORM_HAS_ENDIAN_H__)
 
 uint16_t htobe16(uint16_t host_16bits)
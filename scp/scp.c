@@ -19,8 +19,6 @@
 
 #include "scp.h"
 
-#include "../libdisk/util.c"
-
 const struct scp_params default_scp_params = {
     .select_delay_ms = 1,
     .step_delay_ms = 5,
@@ -174,7 +172,9 @@ void scp_send(
     write_exact(scp->fd, buf, len + 3);
 
     if (cmd == SCPCMD_SENDRAM_USB) {
-        read_exact(scp->fd, dat, 512*1024);
+        uint32_t *ramcmd = dat;
+        uint32_t len = be32toh(ramcmd[1]);
+        read_exact(scp->fd, dat, len);
     } else if (cmd == SCPCMD_LOADRAM_USB) {
         uint32_t *ramcmd = dat;
         uint32_t len = be32toh(ramcmd[1]);
@@ -247,7 +247,7 @@ void scp_read_flux(struct scp_handle *scp, unsigned int nr_revs,
                    struct scp_flux *flux)
 {
     uint8_t info[2] = { nr_revs, 1 /* wait for index */};
-    unsigned int i;
+    unsigned int i, nr_bytes = 0;
 
     scp_send(scp, SCPCMD_READFLUX, &info, 2);
 
@@ -259,8 +259,16 @@ void scp_read_flux(struct scp_handle *scp, unsigned int nr_revs,
         flux->info[i].nr_bitcells = be32toh(flux->info[i].nr_bitcells);
     }
 
+    /* Transfer only the samples captured, not the whole of SCP RAM. */
+    for (i = 0; i < nr_revs; i++)
+        nr_bytes += flux->info[i].nr_bitcells * sizeof(flux->flux[0]);
+    if (nr_bytes > sizeof(flux->flux))
+        errx(1, "Flux read too long (%u bytes)", nr_bytes);
+    if (nr_bytes == 0)
+        return;
+
     *(uint32_t *)&flux->flux[0] = htobe32(0);
-    *(uint32_t *)&flux->flux[2] = htobe32(512*1024);
+    *(uint32_t *)&flux->flux[2] = htobe32(nr_bytes);
     scp_send(scp, SCPCMD_SENDRAM_USB, flux->flux, 8);
 }
 
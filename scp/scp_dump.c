@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
 #include <string.h>
 #include <termios.h>
 #include <unistd.h>
@@ -17,8 +18,12 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <getopt.h>
+#include <pthread.h>
 
 #include <libdisk/util.h>
+#include <libdisk/stream.h>
+#include <libdisk/disk.h>
+#include <libdisk/analyse.h>
 #include <time.h>
 #include "scp.h"
 
@@ -33,8 +38,22 @@
 #define DEFAULT_STARTTRK   0
 #define DEFAULT_ENDTRK     163
 #define DEFAULT_REVS       2
+#define DEFAULT_RETRIES    3
 static int double_step = 0;
 
+/* Inline decode of each captured track, for -f/--format. */
+static struct format_list **format_lists;
+static struct disk *check_disk;
+static struct scp_flux *spare_flux;
+static unsigned int nr_retries = DEFAULT_RETRIES;
+
+/* check_track() results for a track that no format matched. Tracks in the
+ * dumped range are expected to be formatted, so a blank read is retried. */
+#define TRACK_unidentified INT_MAX
+#define TRACK_unformatted  (INT_MAX-1)
+
+#define SCK_NS_PER_TICK 25u
+
 static struct scp_params scp_params;
 
 #define log(_f, _a...) do { if (!quiet) printf(_f, ##_a); } while (0)
@@ -62,6 +81,12 @@ static void usage(int rc)
            default_scp_params.step_delay_ms);
     printf("  -K, --settle-delay  Settle time after seek, millisecs (%u)\n",
            default_scp_params.seek_settle_delay_ms);
+    printf("  -f, --format=FORMAT Decode each track as it is read, "
+           "re-reading\n");
+    printf("                    any that is blank or has missing sectors\n");
+    printf("  -c, --config=FILE Config file to parse for format info\n");
+    printf("  -n, --retries=N   Re-reads of a bad track, with -f (%u)\n",
+           DEFAULT_RETRIES);
 
     exit(rc);
 }
@@ -87,24 +112,226 @@ static void checksum_and_write(
     *p_csum = csum;
 }
 
+/* Captured tracks are written out by a separate thread, so that the next
+ * track's seek and capture overlap with checksumming and file I/O. The
+ * capture loop fills one buffer while the writer empties the other. */
+static struct writer {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct scp_flux *flux[2];
+    int trk[2];        /* track held by each buffer, or -1 if free */
+    unsigned int next; /* next buffer to be written */
+    int done;
+    int fd, nr_revs;
+    uint32_t *th_offs, file_off, csum;
+} writer;
+
+static void write_track(int trk, const struct scp_flux *flux)
+{
+    struct track_header thdr;
+    unsigned int sizeof_thdr = 4 + 12*writer.nr_revs;
+    uint32_t dat_off;
+    int rev;
+
+    writer.th_offs[trk] = htole32(writer.file_off);
+
+    memset(&thdr, 0, sizeof_thdr);
+    memcpy(thdr.sig, "TRK", sizeof(thdr.sig));
+    thdr.tracknr = trk;
+
+    dat_off = sizeof_thdr;
+    for (rev = 0; rev < writer.nr_revs; rev++) {
+        thdr.rev[rev].duration = htole32(flux->info[rev].index_time);
+        thdr.rev[rev].nr_samples = htole32(flux->info[rev].nr_bitcells);
+        thdr.rev[rev].offset = htole32(dat_off);
+        dat_off += flux->info[rev].nr_bitcells * sizeof(uint16_t);
+    }
+    checksum_and_write(writer.fd, &writer.csum, &thdr, sizeof_thdr);
+    checksum_and_write(writer.fd, &writer.csum, flux->flux,
+                       dat_off - sizeof_thdr);
+    writer.file_off += dat_off;
+}
+
+static void *writer_thread(void *unused)
+{
+    unsigned int i;
+    int trk;
+
+    pthread_mutex_lock(&writer.lock);
+    for (;;) {
+        i = writer.next;
+        while (((trk = writer.trk[i]) < 0) && !writer.done)
+            pthread_cond_wait(&writer.cond, &writer.lock);
+        if (trk < 0)
+            break;
+        pthread_mutex_unlock(&writer.lock);
+        write_track(trk, writer.flux[i]);
+        pthread_mutex_lock(&writer.lock);
+        writer.trk[i] = -1;
+        writer.next = !i;
+        pthread_cond_broadcast(&writer.cond);
+    }
+    pthread_mutex_unlock(&writer.lock);
+
+    return NULL;
+}
+
+static void writer_start(int fd, int nr_revs, uint32_t *th_offs,
+                         uint32_t file_off)
+{
+    unsigned int i;
+
+    writer.fd = fd;
+    writer.nr_revs = nr_revs;
+    writer.th_offs = th_offs;
+    writer.file_off = file_off;
+    for (i = 0; i < 2; i++) {
+        writer.flux[i] = memalloc(sizeof(*writer.flux[i]));
+        writer.trk[i] = -1;
+    }
+    pthread_mutex_init(&writer.lock, NULL);
+    pthread_cond_init(&writer.cond, NULL);
+    if (pthread_create(&writer.thread, NULL, writer_thread, NULL))
+        errx(1, "Failed to create writer thread");
+}
+
+/* Wait for buffer @i to be free, and return it for capture. */
+static struct scp_flux *writer_get_buffer(unsigned int i)
+{
+    pthread_mutex_lock(&writer.lock);
+    while (writer.trk[i] >= 0)
+        pthread_cond_wait(&writer.cond, &writer.lock);
+    pthread_mutex_unlock(&writer.lock);
+    return writer.flux[i];
+}
+
+/* Hand buffer @i, holding track @trk, to the writer. */
+static void writer_put_buffer(unsigned int i, int trk)
+{
+    pthread_mutex_lock(&writer.lock);
+    writer.trk[i] = trk;
+    pthread_cond_broadcast(&writer.cond);
+    pthread_mutex_unlock(&writer.lock);
+}
+
+/* Write out remaining tracks and stop the writer. */
+static void writer_finish(void)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&writer.lock);
+    writer.done = 1;
+    pthread_cond_broadcast(&writer.cond);
+    pthread_mutex_unlock(&writer.lock);
+    pthread_join(writer.thread, NULL);
+
+    for (i = 0; i < 2; i++)
+        memfree(writer.flux[i]);
+    pthread_mutex_destroy(&writer.lock);
+    pthread_cond_destroy(&writer.cond);
+}
+
+/* Decode a captured track according to the format plan. Returns the number
+ * of missing sectors, or TRACK_unidentified or TRACK_unformatted if no
+ * format matched. */
+static int check_track(int trk, const struct scp_flux *flux, int nr_revs)
+{
+    struct analyse_opts opts = {
+        .start_track = trk, .end_track = trk, .step = 1 };
+    struct analyse_track *res;
+    struct stream *s;
+    uint32_t *ns, index[ARRAY_SIZE(flux->info)], t, val = 0;
+    unsigned int i, pos = 0, nr = 0;
+    int rev, bad;
+
+    /* Samples are big-endian ticks. Zero marks a 16-bit overflow. */
+    ns = memalloc(ARRAY_SIZE(flux->flux) * sizeof(*ns));
+    for (rev = 0; rev < nr_revs; rev++) {
+        index[rev] = nr;
+        for (i = 0; i < flux->info[rev].nr_bitcells; i++) {
+            if ((t = be16toh(flux->flux[pos++])) == 0) {
+                val += 0x10000;
+                continue;
+            }
+            ns[nr++] = (val + t) * SCK_NS_PER_TICK;
+            val = 0;
+        }
+    }
+
+    s = stream_flux_open(trk, ns, nr, index, nr_revs, 0, 0);
+    memfree(ns);
+
+    res = memalloc(disk_get_nr_tracks(check_disk) * sizeof(*res));
+    (void)disk_analyse_stream(check_disk, s, format_lists, &opts, res);
+    switch (res[trk].status) {
+    case ANALYSE_bad_sectors:
+        bad = res[trk].nr_bad_sectors;
+        break;
+    case ANALYSE_unformatted:
+        bad = TRACK_unformatted;
+        break;
+    case ANALYSE_unidentified:
+        bad = TRACK_unidentified;
+        break;
+    default:
+        bad = 0;
+        break;
+    }
+    memfree(res);
+    stream_close(s);
+
+    return bad;
+}
+
+/* Capture track @trk into writer buffer @slot. With a format plan, re-read
+ * a track that does not decode cleanly, and keep the best capture. Returns
+ * the result of check_track() for the capture kept. */
+static int capture_track(struct scp_handle *scp, int trk, int nr_revs,
+                         unsigned int slot)
+{
+    struct scp_flux *flux = writer_get_buffer(slot), *tmp;
+    unsigned int i;
+    int bad = 0, b;
+
+    scp_seek_track(scp, trk, double_step);
+    scp_read_flux(scp, nr_revs, flux);
+
+    if (format_lists != NULL) {
+        bad = check_track(trk, flux, nr_revs);
+        for (i = 0; (bad != 0) && (i < nr_retries); i++) {
+            scp_read_flux(scp, nr_revs, spare_flux);
+            if ((b = check_track(trk, spare_flux, nr_revs)) < bad) {
+                tmp = flux;
+                flux = spare_flux;
+                spare_flux = tmp;
+                bad = b;
+            }
+        }
+        writer.flux[slot] = flux;
+    }
+
+    writer_put_buffer(slot, trk);
+    return bad;
+}
+
 int main(int argc, char **argv)
 {
     struct scp_handle *scp;
-    struct scp_flux flux;
+    struct scp_flux *flux;
     struct disk_header dhdr;
-    struct track_header thdr;
-    int rev, nr_revs = DEFAULT_REVS;
+    int nr_revs = DEFAULT_REVS;
     int trk, start_trk = -1, end_trk = -1;
-    unsigned int sizeof_thdr, unit = DEFAULT_UNIT;
-    uint32_t *th_offs, file_off, dat_off, csum = 0;
-    int ch, fd, quiet = 0, ramtest = 0;
-    char *sername = DEFAULT_SERDEVICE;
+    unsigned int unit = DEFAULT_UNIT;
+    uint32_t *th_offs, file_off, csum;
+    int ch, fd, quiet = 0, ramtest = 0, *track_bad;
+    char *sername = DEFAULT_SERDEVICE, *format = NULL, *config = NULL;
     struct footer ftr;
     uint8_t hwinfo[2];
     uint16_t app_name_len;
     const static char app_name[] = "scp_dump (keirf)";
 
-    const static char sopts[] = "hqd:u:r:Rs:e:Dk:K:";
+    const static char sopts[] = "hqd:u:r:Rs:e:Dk:K:f:c:n:";
     const static struct option lopts[] = {
         { "help", 0, NULL, 'h' },
         { "quiet", 0, NULL, 'q' },
@@ -117,6 +344,9 @@ int main(int argc, char **argv)
         { "double-step", 0, NULL, 'D' },
         { "step-delay", 1, NULL, 'k' },
         { "settle-delay", 1, NULL, 'K' },
+        { "format", 1, NULL, 'f' },
+        { "config", 1, NULL, 'c' },
+        { "retries", 1, NULL, 'n' },
         { 0, 0, 0, 0 }
     };
 
@@ -165,6 +395,15 @@ int main(int argc, char **argv)
         case 'K':
             scp_params.seek_settle_delay_ms = atoi(optarg);
             break;
+        case 'f':
+            format = optarg;
+            break;
+        case 'c':
+            config = optarg;
+            break;
+        case 'n':
+            nr_retries = atoi(optarg);
+            break;
         default:
             usage(1);
             break;
@@ -184,12 +423,20 @@ int main(int argc, char **argv)
         usage(1);
     }
 
-    if (nr_revs > ARRAY_SIZE(flux.info)) {
+    if (nr_revs > ARRAY_SIZE(flux->info)) {
         warnx("Too many revolutions specified (%u, max %u)",
-              nr_revs, (unsigned int)ARRAY_SIZE(flux.info));
+              nr_revs, (unsigned int)ARRAY_SIZE(flux->info));
         usage(1);
     }
 
+    if (format != NULL) {
+        if ((format_lists = format_plan_parse(config, format, 0)) == NULL)
+            exit(1);
+        check_disk = disk_create(NULL, 0);
+        spare_flux = memalloc(sizeof(*spare_flux));
+    }
+    track_bad = memalloc(SCP_MAX_TRACKS * sizeof(*track_bad));
+
     if ((fd = file_open(argv[optind], O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1)
         err(1, "Error creating %s", argv[optind]);
 
@@ -217,34 +464,29 @@ int main(int argc, char **argv)
 
     log("Reading track %7s", "");
 
-    sizeof_thdr = 4 + 12*nr_revs;
+    writer_start(fd, nr_revs, th_offs, file_off);
     for (trk = start_trk; trk <= end_trk; trk++) {
         log("\b\b\b\b\b\b\b%-4u...", trk);
         fflush(stdout);
 
-        scp_seek_track(scp, trk, double_step);
-        scp_read_flux(scp, nr_revs, &flux);
-
-        th_offs[trk] = htole32(file_off);
-
-        memset(&thdr, 0, sizeof_thdr);
-        memcpy(thdr.sig, "TRK", sizeof(thdr.sig));
-        thdr.tracknr = trk;
-
-        dat_off = sizeof_thdr;
-        for (rev = 0; rev < nr_revs; rev++) {
-            thdr.rev[rev].duration = htole32(flux.info[rev].index_time);
-            thdr.rev[rev].nr_samples = htole32(flux.info[rev].nr_bitcells);
-            thdr.rev[rev].offset = htole32(dat_off);
-            dat_off += flux.info[rev].nr_bitcells * sizeof(uint16_t);
-        }
-        checksum_and_write(fd, &csum, &thdr, sizeof_thdr);
-        checksum_and_write(fd, &csum, flux.flux, dat_off - sizeof_thdr);
-        file_off += dat_off;
+        track_bad[trk] = capture_track(scp, trk, nr_revs,
+                                       (trk - start_trk) & 1);
     }
+    writer_finish();
+    csum = writer.csum;
 
     log("\n");
 
+    for (trk = start_trk; trk <= end_trk; trk++) {
+        if (track_bad[trk] == TRACK_unidentified)
+            fprintf(stderr, "** Track %u: unidentified\n", trk);
+        else if (track_bad[trk] == TRACK_unformatted)
+            fprintf(stderr, "** Track %u: unformatted\n", trk);
+        else if (track_bad[trk])
+            fprintf(stderr, "** Track %u: %d sectors missing\n",
+                    trk, track_bad[trk]);
+    }
+
     scp_deselectdrive(scp, unit);
     scp_close(scp);
 
@@ -269,5 +511,12 @@ int main(int argc, char **argv)
     lseek(fd, 0, SEEK_SET);
     write_exact(fd, &dhdr, sizeof(dhdr));
 
+    if (format != NULL) {
+        disk_close(check_disk);
+        format_plan_free(format_lists);
+        memfree(spare_flux);
+    }
+    memfree(track_bad);
+
     return 0;
 }
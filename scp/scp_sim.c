@@ -0,0 +1,602 @@
+/*
+ * scp_sim.c
+ *
+ * Simulate Supercard Pro hardware on a pseudo-terminal, serving flux from a
+ * disk image, so that scp_dump and scp_write can be run and timed without
+ * a drive attached.
+ *
+ * Tracks are streamed through libdisk, so any image which disk-analyse can
+ * read may back the simulated disk. Flux is re-clocked by libdisk's PLL, and
+ * is therefore clean rather than a faithful copy of any original flux.
+ *
+ * Written in 2026 by agent
+ */
+
+/* posix_openpt() and friends. */
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <termios.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <getopt.h>
+
+#include <libdisk/util.h>
+#include <libdisk/stream.h>
+#include "scp.h"
+
+#define SCK_NS_PER_TICK 25u
+#define MAX_REVS        5
+
+/* Status codes returned to the host: see scp_errstr(). */
+#define SCPST_OK          0x4f
+#define SCPST_BADCOMMAND  0x01
+#define SCPST_CHECKSUM    0x03
+#define SCPST_NOINDEX     0x09
+#define SCPST_ZEROREVS    0x0a
+#define SCPST_READTOOLONG 0x0b
+#define SCPST_BADLENGTH   0x0c
+
+#define HW_VERSION 0x13
+#define FW_VERSION 0x14
+
+#define SRAM_BYTES (512*1024)
+
+static int quiet, verbose, once;
+static unsigned int rpm = 300, time_pct = 100, settle_ms;
+static int nr_bad[SCP_MAX_TRACKS]; /* reads of each track to corrupt */
+
+#define log(_f, _a...) \
+    do { if (!quiet) fprintf(stderr, _f, ##_a); } while (0)
+
+static struct stream *s;
+
+/* Flux of the most recently read track, in SCP sample format. */
+static struct {
+    int tracknr;
+    unsigned int nr_revs;
+    struct {
+        uint32_t index_time, nr_samples, off;
+    } info[MAX_REVS];
+    uint16_t *dat;
+    uint32_t nr, max;
+} cache = { .tracknr = -1 };
+
+/* Simulated drive and SCP RAM. */
+static struct {
+    unsigned int cyl, side;
+    int motor;
+    struct timespec motor_on;
+    uint16_t step_us, motoron_ms, seek0_ms;
+    struct {
+        uint32_t index_time, nr_samples;
+    } info[MAX_REVS]; /* big-endian, as returned by GETFLUXINFO */
+    uint8_t ram[SRAM_BYTES];
+} drv = {
+    .step_us = 5000, .motoron_ms = 750, .seek0_ms = 15
+};
+
+static struct {
+    unsigned int cmds, flux_reads, tracks_read, flux_writes;
+    uint64_t bytes_to_host, bytes_from_host;
+    struct timespec start;
+    uint8_t read[SCP_MAX_TRACKS];
+} stats;
+
+static void usage(int rc)
+{
+    printf("Usage: scp_sim [options] in_file\n");
+    printf("Serve the flux of in_file from a simulated Supercard Pro.\n");
+    printf("The name of the simulated serial device is printed on "
+           "stdout.\n");
+    printf("Options:\n");
+    printf("  -h, --help        Display this information\n");
+    printf("  -q, --quiet       Quiesce normal informational output\n");
+    printf("  -v, --verbose     Log each command received\n");
+    printf("  -1, --once        Exit when the first host disconnects\n");
+    printf("  -r, --rpm=N       Simulated disk speed; 0 for no rotational "
+           "delay (%u)\n", rpm);
+    printf("  -t, --time=PCT    Scale all simulated delays (%u)\n",
+           time_pct);
+    printf("  -K, --settle-delay=MS  Extra head settle time after a "
+           "seek (%u)\n", settle_ms);
+    printf("  -b, --bad=TRK[:N][,...]  Corrupt the first N reads "
+           "(default all)\n");
+    printf("                    of each listed track\n");
+    exit(rc);
+}
+
+static void parse_bad(const char *list)
+{
+    unsigned long trk, n;
+    char *p;
+
+    for (;;) {
+        trk = strtoul(list, &p, 10);
+        if ((p == list) || (trk >= SCP_MAX_TRACKS))
+            goto bad;
+        n = INT_MAX;
+        if (*p == ':') {
+            list = p + 1;
+            n = strtoul(list, &p, 10);
+            if ((p == list) || (n > INT_MAX))
+                goto bad;
+        }
+        nr_bad[trk] = n;
+        if (*p == '\0')
+            return;
+        if (*p != ',')
+            goto bad;
+        list = p + 1;
+    }
+
+bad:
+    warnx("Bad track list '%s'", list);
+    usage(1);
+}
+
+static uint64_t ts_ns(const struct timespec *ts)
+{
+    return ts->tv_sec * 1000000000ull + ts->tv_nsec;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts_ns(&ts);
+}
+
+/* Complete a command @ns (unscaled) after it was received at @start. Work
+ * done meanwhile, such as generating flux, counts towards the delay. */
+static void sim_delay(uint64_t start, uint64_t ns)
+{
+    struct timespec ts;
+    uint64_t end = start + ns * time_pct / 100;
+
+    ts.tv_sec = end / 1000000000u;
+    ts.tv_nsec = end % 1000000000u;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+           == EINTR)
+        continue;
+}
+
+static uint64_t rev_ns(void)
+{
+    return rpm ? 60000000000ull / rpm : 0;
+}
+
+static void cache_emit(uint32_t ticks)
+{
+    if ((cache.nr + (ticks >> 16) + 1) > cache.max) {
+        uint16_t *old = cache.dat;
+        cache.max = max(cache.max * 2, cache.nr + (ticks >> 16) + 1);
+        cache.dat = memalloc(cache.max * sizeof(*cache.dat));
+        memcpy(cache.dat, old, cache.nr * sizeof(*cache.dat));
+        memfree(old);
+    }
+
+    /* Each zero sample adds 65536 ticks to the next. */
+    for (; ticks >= 0x10000; ticks -= 0x10000)
+        cache.dat[cache.nr++] = 0;
+    cache.dat[cache.nr++] = htobe16(ticks ?: 1);
+}
+
+/* Re-clock up to MAX_REVS revolutions of @tracknr from the image, starting
+ * at the index. Intervals are timed from the PLL's accumulated latency and
+ * rounded to sample ticks without drift. */
+static void cache_track(unsigned int tracknr)
+{
+    uint64_t t0, tick, last = 0, rev_tick = 0;
+    uint32_t rev_nr = 0;
+    int b;
+
+    cache.tracknr = tracknr;
+    cache.nr_revs = cache.nr = 0;
+
+    if (stream_select_track(s, tracknr) != 0)
+        return;
+
+    /* The image's flux repeats as needed to fill every revolution. */
+    s->max_revolutions = max_t(uint32_t, s->max_revolutions, MAX_REVS);
+    t0 = s->latency;
+
+    while ((b = stream_next_bit(s)) != -1) {
+        tick = (s->latency - t0 + SCK_NS_PER_TICK/2) / SCK_NS_PER_TICK;
+        if (b) {
+            cache_emit(tick - last);
+            last = tick;
+        }
+        if (s->nr_index > cache.nr_revs + 1) {
+            cache.info[cache.nr_revs].index_time = tick - rev_tick;
+            cache.info[cache.nr_revs].nr_samples = cache.nr - rev_nr;
+            cache.info[cache.nr_revs].off = rev_nr;
+            rev_tick = tick;
+            rev_nr = cache.nr;
+            if (++cache.nr_revs == MAX_REVS)
+                break;
+        }
+    }
+}
+
+/* Stretch a few short runs of samples, enough to break any sector. */
+static void corrupt(uint16_t *dat, uint32_t nr)
+{
+    uint32_t i;
+    uint16_t t;
+
+    for (i = 0; i < nr; i++) {
+        if (((i % 1500) >= 20) || ((t = be16toh(dat[i])) == 0))
+            continue;
+        dat[i] = htobe16(min_t(uint32_t, t + t/2, 0xffff));
+    }
+}
+
+static uint8_t read_flux(const uint8_t *dat, uint64_t start)
+{
+    unsigned int trk = drv.cyl*2 + drv.side, nr_revs = dat[0], i, r;
+    uint32_t off = 0, nr;
+    uint64_t phase, delay = 0;
+
+    memset(drv.info, 0, sizeof(drv.info));
+
+    if ((nr_revs == 0) || (nr_revs > MAX_REVS))
+        return SCPST_ZEROREVS;
+
+    if (trk >= SCP_MAX_TRACKS)
+        return SCPST_NOINDEX;
+    if (cache.tracknr != trk)
+        cache_track(trk);
+    if (cache.nr_revs == 0)
+        return SCPST_NOINDEX;
+
+    /* Revolutions beyond those in the image are repeated. */
+    for (i = 0; i < nr_revs; i++) {
+        r = i % cache.nr_revs;
+        nr = cache.info[r].nr_samples;
+        if ((off + nr) > (SRAM_BYTES / 2))
+            return SCPST_READTOOLONG;
+        memcpy(&drv.ram[off*2], &cache.dat[cache.info[r].off], nr * 2);
+        drv.info[i].index_time = htobe32(cache.info[r].index_time);
+        drv.info[i].nr_samples = htobe32(nr);
+        off += nr;
+    }
+
+    if (nr_bad[trk] > 0) {
+        nr_bad[trk]--;
+        corrupt((uint16_t *)drv.ram, off);
+    }
+
+    stats.flux_reads++;
+    if (!stats.read[trk]) {
+        stats.read[trk] = 1;
+        stats.tracks_read++;
+    }
+
+    /* Wait for the index, if asked, then for the revolutions to pass. */
+    if (rpm) {
+        if (dat[1] & 1) {
+            phase = (start - ts_ns(&drv.motor_on)) % rev_ns();
+            delay = rev_ns() - phase;
+        }
+        delay += nr_revs * rev_ns();
+    }
+    sim_delay(start, delay);
+
+    return SCPST_OK;
+}
+
+static void session_report(void)
+{
+    struct timespec end;
+    uint64_t ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ms = (ts_ns(&end) - ts_ns(&stats.start)) / 1000000u;
+    log("Host disconnected after %u.%03us: %u commands, %u flux reads "
+        "of %u tracks (%u re-reads), %u writes\n",
+        (unsigned int)(ms / 1000), (unsigned int)(ms % 1000),
+        stats.cmds, stats.flux_reads, stats.tracks_read,
+        stats.flux_reads - stats.tracks_read, stats.flux_writes);
+    log("  %llu bytes to host, %llu bytes from host\n",
+        (unsigned long long)stats.bytes_to_host,
+        (unsigned long long)stats.bytes_from_host);
+}
+
+/* Read exactly @len bytes from the host. Returns -1 if it disconnects. */
+static int host_read(int fd, void *buf, size_t len)
+{
+    ssize_t nr;
+
+    while (len != 0) {
+        nr = read(fd, buf, len);
+        if (nr <= 0) {
+            if ((nr < 0) && (errno == EINTR))
+                continue;
+            /* The master reads EIO once the host closes the slave. */
+            if ((nr == 0) || (errno == EIO))
+                return -1;
+            err(1, "pty read");
+        }
+        buf = (uint8_t *)buf + nr;
+        len -= nr;
+    }
+
+    return 0;
+}
+
+/* Serve commands from one host until it disconnects. */
+static void serve(int fd)
+{
+    uint8_t hdr[2], dat[256], csum, st, reply[2+sizeof(drv.info)];
+    uint32_t off, len;
+    unsigned int i, nr_reply, cyl;
+    uint64_t start, delay;
+
+    memset(&stats, 0, sizeof(stats));
+    clock_gettime(CLOCK_MONOTONIC, &stats.start);
+
+    for (;;) {
+        if (host_read(fd, hdr, 2) || host_read(fd, dat, hdr[1] + 1))
+            break;
+        start = now_ns();
+        stats.cmds++;
+
+        if (verbose)
+            log("%02x %s\n", hdr[0], scp_cmdstr(hdr[0]));
+
+        csum = 0x4a + hdr[0] + hdr[1];
+        for (i = 0; i < hdr[1]; i++)
+            csum += dat[i];
+
+        st = SCPST_OK;
+        nr_reply = 0;
+        delay = 0;
+
+        if (csum != dat[hdr[1]]) {
+            st = SCPST_CHECKSUM;
+            goto reply;
+        }
+
+        switch (hdr[0]) {
+        case SCPCMD_SELA: case SCPCMD_SELB:
+        case SCPCMD_DSELA: case SCPCMD_DSELB:
+        case SCPCMD_SELDENS: case SCPCMD_SETPIN33:
+        case SCPCMD_RAMTEST:
+            break;
+        case SCPCMD_MTRAON: case SCPCMD_MTRBON:
+            if (!drv.motor) {
+                drv.motor = 1;
+                clock_gettime(CLOCK_MONOTONIC, &drv.motor_on);
+                delay = drv.motoron_ms * 1000000ull;
+            }
+            break;
+        case SCPCMD_MTRAOFF: case SCPCMD_MTRBOFF:
+            drv.motor = 0;
+            break;
+        case SCPCMD_SEEK0:
+            delay = drv.cyl * drv.step_us * 1000ull
+                + drv.seek0_ms * 1000000ull;
+            drv.cyl = 0;
+            goto settle;
+        case SCPCMD_STEPTO:
+            if (hdr[1] != 1)
+                goto badlength;
+            cyl = dat[0];
+            delay = abs((int)cyl - (int)drv.cyl) * drv.step_us * 1000ull;
+            drv.cyl = cyl;
+            goto settle;
+        case SCPCMD_STEPIN:
+            drv.cyl++;
+            delay = drv.step_us * 1000ull;
+            goto settle;
+        case SCPCMD_STEPOUT:
+            if (drv.cyl)
+                drv.cyl--;
+            delay = drv.step_us * 1000ull;
+        settle:
+            delay += settle_ms * 1000000ull;
+            break;
+        case SCPCMD_SIDE:
+            if (hdr[1] != 1)
+                goto badlength;
+            drv.side = dat[0] & 1;
+            break;
+        case SCPCMD_STATUS:
+            reply[2] = reply[3] = 0;
+            nr_reply = 2;
+            break;
+        case SCPCMD_SETPARAMS:
+            if (hdr[1] != 10)
+                goto badlength;
+            drv.step_us = (dat[2] << 8) | dat[3];
+            drv.motoron_ms = (dat[4] << 8) | dat[5];
+            drv.seek0_ms = (dat[6] << 8) | dat[7];
+            break;
+        case SCPCMD_READFLUX:
+            if (hdr[1] != 2)
+                goto badlength;
+            if (!drv.motor) {
+                st = SCPST_NOINDEX;
+                break;
+            }
+            st = read_flux(dat, start);
+            break;
+        case SCPCMD_GETFLUXINFO:
+            memcpy(&reply[2], drv.info, sizeof(drv.info));
+            nr_reply = sizeof(drv.info);
+            break;
+        case SCPCMD_WRITEFLUX:
+            if (hdr[1] != 5)
+                goto badlength;
+            stats.flux_writes++;
+            if (rpm)
+                delay = ((dat[4] & 1) ? 2 : 1) * rev_ns();
+            break;
+        case SCPCMD_SENDRAM_USB:
+        case SCPCMD_LOADRAM_USB:
+            if (hdr[1] != 8)
+                goto badlength;
+            off = (dat[0] << 24) | (dat[1] << 16) | (dat[2] << 8) | dat[3];
+            len = (dat[4] << 24) | (dat[5] << 16) | (dat[6] << 8) | dat[7];
+            if ((off > SRAM_BYTES) || (len > (SRAM_BYTES - off)))
+                errx(1, "Host transfer out of range (%u bytes at %u)",
+                     len, off);
+            /* The data phase precedes the status. */
+            if (hdr[0] == SCPCMD_SENDRAM_USB) {
+                write_exact(fd, &drv.ram[off], len);
+                stats.bytes_to_host += len;
+            } else {
+                if (host_read(fd, &drv.ram[off], len))
+                    goto out;
+                stats.bytes_from_host += len;
+            }
+            break;
+        case SCPCMD_SCPINFO:
+            reply[2] = HW_VERSION;
+            reply[3] = FW_VERSION;
+            nr_reply = 2;
+            break;
+        default:
+            st = SCPST_BADCOMMAND;
+            break;
+        badlength:
+            st = SCPST_BADLENGTH;
+            break;
+        }
+
+        sim_delay(start, delay);
+
+    reply:
+        reply[0] = hdr[0];
+        reply[1] = st;
+        if (st != SCPST_OK)
+            nr_reply = 0;
+        write_exact(fd, reply, 2 + nr_reply);
+        stats.bytes_to_host += nr_reply;
+        if (verbose && (st != SCPST_OK))
+            log("  -> %02x %s\n", st, scp_errstr(st));
+    }
+
+out:
+    drv.motor = 0;
+    session_report();
+}
+
+/* Wait for a host to open the slave side of the pty. */
+static void wait_for_host(int fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+    for (;;) {
+        if ((poll(&pfd, 1, -1) < 0) && (errno != EINTR))
+            err(1, "poll");
+        if (!(pfd.revents & POLLHUP))
+            return;
+        usleep(10000);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct termios tio;
+    int ch, fd, sfd;
+    char *sername;
+
+    const static char sopts[] = "hqv1r:t:K:b:";
+    const static struct option lopts[] = {
+        { "help", 0, NULL, 'h' },
+        { "quiet", 0, NULL, 'q' },
+        { "verbose", 0, NULL, 'v' },
+        { "once", 0, NULL, '1' },
+        { "rpm", 1, NULL, 'r' },
+        { "time", 1, NULL, 't' },
+        { "settle-delay", 1, NULL, 'K' },
+        { "bad", 1, NULL, 'b' },
+        { 0, 0, 0, 0 }
+    };
+
+    while ((ch = getopt_long(argc, argv, sopts, lopts, NULL)) != -1) {
+        switch (ch) {
+        case 'h':
+            usage(0);
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case '1':
+            once = 1;
+            break;
+        case 'r':
+            rpm = atoi(optarg);
+            break;
+        case 't':
+            time_pct = atoi(optarg);
+            break;
+        case 'K':
+            settle_ms = atoi(optarg);
+            break;
+        case 'b':
+            parse_bad(optarg);
+            break;
+        default:
+            usage(1);
+            break;
+        }
+    }
+
+    if (argc != (optind + 1))
+        usage(1);
+
+    if ((s = stream_open(argv[optind], 0, 0)) == NULL)
+        errx(1, "Failed to probe input file: %s", argv[optind]);
+
+    if (((fd = posix_openpt(O_RDWR | O_NOCTTY)) < 0)
+        || grantpt(fd) || unlockpt(fd)
+        || ((sername = ptsname(fd)) == NULL))
+        err(1, "Error creating pty");
+
+    /* Raw mode, set once via the slave: it persists across hosts. */
+    if (((sfd = open(sername, O_RDWR | O_NOCTTY)) < 0)
+        || tcgetattr(sfd, &tio))
+        err(1, "%s", sername);
+    cfmakeraw(&tio);
+    if (tcsetattr(sfd, TCSANOW, &tio) || close(sfd))
+        err(1, "%s", sername);
+
+    printf("%s\n", sername);
+    fflush(stdout);
+
+    do {
+        wait_for_host(fd);
+        serve(fd);
+    } while (!once);
+
+    stream_close(s);
+    memfree(cache.dat);
+    close(fd);
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */